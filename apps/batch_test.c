@@ -0,0 +1,163 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <disk.h>
+
+#define ASSERT(cond, func)                               \
+do {                                                     \
+	if (!(cond)) {                                       \
+		fprintf(stderr, "Function '%s' failed\n", func); \
+		exit(EXIT_FAILURE);                              \
+	}                                                    \
+} while (0)
+
+#define BLOCKS 80
+
+static char data[BLOCKS][BLOCK_SIZE], check[BLOCKS][BLOCK_SIZE];
+static char diskname[] = "batch_test.XXXXXX";
+
+/* Remove the scratch disk and its checksums, also when a check failed */
+static void remove_disk(void)
+{
+	char sums[sizeof(diskname) + 4];
+
+	snprintf(sums, sizeof(sums), "%s.sum", diskname);
+	unlink(sums);
+	unlink(diskname);
+}
+
+static void fill(int block, char c)
+{
+	memset(data[block], c, BLOCK_SIZE);
+	ASSERT(!block_write(block, data[block]), "block_write");
+}
+
+/* Every block of the disk reads back as last written */
+static void check_all(void)
+{
+	for (int b = 0; b < BLOCKS; b++) {
+		ASSERT(!block_read(b, check[b]), "block_read");
+		ASSERT(!memcmp(check[b], data[b], BLOCK_SIZE), "block_read");
+	}
+	ASSERT(!block_read_range(0, BLOCKS, check), "block_read_range");
+	ASSERT(!memcmp(check, data, sizeof(data)), "block_read_range");
+}
+
+/* The image file holds @block as last written, behind the library's back */
+static int on_disk(int block)
+{
+	char raw[BLOCK_SIZE];
+	int fd = open(diskname, O_RDONLY), same;
+
+	ASSERT(fd >= 0, "open");
+	same = pread(fd, raw, BLOCK_SIZE, (off_t)block * BLOCK_SIZE) == BLOCK_SIZE &&
+	       !memcmp(raw, data[block], BLOCK_SIZE);
+	close(fd);
+	return same;
+}
+
+/*
+ * Write blocks of a scratch disk in batches and through the write-back
+ * cache, out of order and more than once: reads must see the writes held
+ * back, and the disk must hold the last of them once the batch ends or the
+ * cache is flushed, also when the disk is reopened. The disk is made with
+ * checksums in the current directory, and removed at the end.
+ */
+int main(void)
+{
+	int fd = mkstemp(diskname);
+
+	ASSERT(fd >= 0, "mkstemp");
+	close(fd);
+	atexit(remove_disk);
+	ASSERT(block_disk_create(diskname, BLOCKS, BLOCK_CREATE_SUMS) == BLOCKS,
+	       "block_disk_create");
+
+	ASSERT(block_batch_start() == -1, "block_batch_start");
+	ASSERT(!block_disk_open(diskname), "block_disk_open");
+	ASSERT(block_disk_count() == BLOCKS, "block_disk_count");
+	ASSERT(block_batch_end() == -1, "block_batch_end");
+	for (int b = 0; b < BLOCKS; b++)
+		fill(b, 'a');
+
+	/* Out of order, nested, rewritten and read while queued */
+	ASSERT(!block_batch_start(), "block_batch_start");
+	for (int b = 20; b >= 0; b -= 2)
+		fill(b, 'b');
+	ASSERT(!block_batch_start(), "block_batch_start");
+	for (int b = 1; b < 20; b += 2)
+		fill(b, 'c');
+	fill(4, 'd');
+	ASSERT(!block_batch_end(), "block_batch_end");
+	check_all();
+	memset(data[30], 'e', 3 * BLOCK_SIZE);
+	ASSERT(!block_write_range(30, 3, data[30]), "block_write_range");
+	check_all();
+
+	/* Large ranges go straight to the disk, over what is queued */
+	memset(data[10], 'f', 64 * BLOCK_SIZE);
+	ASSERT(!block_write_range(10, 64, data[10]), "block_write_range");
+	fill(12, 'g');
+	check_all();
+
+	/* Released blocks stay released */
+	fill(75, 'h');
+	ASSERT(!block_discard(75, 2), "block_discard");
+	memset(data[75], 0, 2 * BLOCK_SIZE);
+	check_all();
+	ASSERT(!block_batch_end(), "block_batch_end");
+	ASSERT(block_batch_end() == -1, "block_batch_end");
+	check_all();
+
+	/* More blocks than the queue holds */
+	ASSERT(!block_batch_start(), "block_batch_start");
+	for (int n = 0; n < 400; n++)
+		fill((n * 7) % BLOCKS, 'i' + n % 10);
+	check_all();
+
+	/* Closing the disk sends the writes of a batch left open */
+	fill(79, 'z');
+	ASSERT(!block_disk_close(), "block_disk_close");
+	ASSERT(!block_disk_open(diskname), "block_disk_open");
+	check_all();
+
+	/* The cache holds writes back until they expire */
+	ASSERT(block_writeback_stop() == -1, "block_writeback_stop");
+	ASSERT(!block_writeback_start(200, 16), "block_writeback_start");
+	ASSERT(block_writeback_start(200, 16) == -1, "block_writeback_start");
+	fill(3, 'j');
+	check_all();
+	ASSERT(!on_disk(3), "block_writeback_start");
+	usleep(600000);
+	ASSERT(on_disk(3), "block_writeback_start");
+
+	/* More blocks than the cache holds: writers wait for the flusher */
+	for (int n = 0; n < 400; n++)
+		fill((n * 11) % BLOCKS, 'k' + n % 10);
+	check_all();
+	ASSERT(!block_batch_start(), "block_batch_start");
+	fill(50, 'l');
+	ASSERT(!block_batch_end(), "block_batch_end");
+	ASSERT(!block_sync(), "block_sync");
+	ASSERT(on_disk(50), "block_sync");
+	fill(51, 'm');
+	ASSERT(!block_flush(), "block_flush");
+	ASSERT(on_disk(51), "block_flush");
+	fill(52, 'n');
+	ASSERT(!block_writeback_stop(), "block_writeback_stop");
+	check_all();
+
+	/* Closing the disk flushes the cache */
+	ASSERT(!block_writeback_start(60000, 32), "block_writeback_start");
+	fill(53, 'o');
+	ASSERT(!block_disk_close(), "block_disk_close");
+	ASSERT(!block_disk_open(diskname), "block_disk_open");
+	check_all();
+	ASSERT(!block_disk_close(), "block_disk_close");
+
+	printf("batch_test: all checks passed\n");
+	return 0;
+}
@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fs.h>
+
+#define ASSERT(cond, func)                               \
+do {                                                     \
+	if (!(cond)) {                                       \
+		fprintf(stderr, "Function '%s' failed\n", func); \
+		exit(EXIT_FAILURE);                              \
+	}                                                    \
+} while (0)
+
+#define BLK 4096
+#define SRC_LEN (6 * BLK + 123)
+
+static void check_contents(const char *name, const char *data, int len)
+{
+	char *check = malloc(len + 1);
+	int fd = fs_open(name);
+
+	ASSERT(fd >= 0, "fs_open");
+	ASSERT(fs_stat(fd) == len, "fs_stat");
+	ASSERT(fs_read(fd, check, len + 1) == len, "fs_read");
+	ASSERT(!memcmp(check, data, len), "fs_read");
+	fs_close(fd);
+	free(check);
+}
+
+/*
+ * Clone a file, write to the clone, and copy ranges between files both on
+ * and off block boundaries: every file must read back as if the copies had
+ * been made byte by byte. Works on any volume, blocks are only shared on
+ * 32-bit FAT ones.
+ */
+int main(int argc, char *argv[])
+{
+	char *src = malloc(SRC_LEN), *clone = malloc(SRC_LEN);
+	char *part = calloc(1, 4 * BLK);
+	int fd_src, fd_dst;
+
+	if (argc < 2) {
+		printf("Usage: %s <diskimage>\n", argv[0]);
+		exit(1);
+	}
+	for (int i = 0; i < SRC_LEN; i++)
+		src[i] = 'A' + (i * 7 + i / BLK) % 26;
+
+	ASSERT(!fs_mount(argv[1]), "fs_mount");
+	ASSERT(!fs_create("src"), "fs_create");
+	fd_src = fs_open("src");
+	ASSERT(fd_src >= 0, "fs_open");
+	ASSERT(fs_write(fd_src, src, SRC_LEN) == SRC_LEN, "fs_write");
+	fs_close(fd_src);
+
+	/* A clone reads the same, and writing to it leaves the source alone */
+	ASSERT(!fs_clone("src", "clone"), "fs_clone");
+	ASSERT(fs_clone("src", "clone") == -1, "fs_clone");
+	ASSERT(fs_clone("none", "other") == -1, "fs_clone");
+	check_contents("clone", src, SRC_LEN);
+	memcpy(clone, src, SRC_LEN);
+	memcpy(clone + 2 * BLK - 3, "written", 7);
+	fd_dst = fs_open("clone");
+	ASSERT(!fs_lseek(fd_dst, 2 * BLK - 3), "fs_lseek");
+	ASSERT(fs_write(fd_dst, "written", 7) == 7, "fs_write");
+	fs_close(fd_dst);
+	check_contents("src", src, SRC_LEN);
+	check_contents("clone", clone, SRC_LEN);
+
+	/* Aligned range in the middle, then an unaligned one past it */
+	ASSERT(!fs_create("part"), "fs_create");
+	fd_src = fs_open("src");
+	fd_dst = fs_open("part");
+	ASSERT(fd_src >= 0 && fd_dst >= 0, "fs_open");
+	ASSERT(fs_copy_range(fd_src, BLK, fd_dst, 0, 2 * BLK) == 2 * BLK, "fs_copy_range");
+	memcpy(part, src + BLK, 2 * BLK);
+	ASSERT(fs_copy_range(fd_src, 10, fd_dst, 2 * BLK, BLK + 50) == BLK + 50, "fs_copy_range");
+	memcpy(part + 2 * BLK, src + 10, BLK + 50);
+	/* The end of the source is reached before count */
+	ASSERT(fs_copy_range(fd_src, SRC_LEN - 100, fd_dst, 3 * BLK + 50, BLK) == 100, "fs_copy_range");
+	memcpy(part + 3 * BLK + 50, src + SRC_LEN - 100, 100);
+	/* Past the end of the destination, or overlapping in the same file */
+	ASSERT(fs_copy_range(fd_src, 0, fd_dst, 4 * BLK, 10) == -1, "fs_copy_range");
+	ASSERT(fs_copy_range(fd_src, 0, fd_src, BLK, 2 * BLK) == -1, "fs_copy_range");
+	fs_close(fd_src);
+	fs_close(fd_dst);
+	check_contents("part", part, 3 * BLK + 150);
+	check_contents("src", src, SRC_LEN);
+
+	/* Overwriting a file on a full volume, its blocks are given back */
+	ASSERT(!fs_create("full") && !fs_create("spare") && !fs_create("filler"), "fs_create");
+	fd_dst = fs_open("full");
+	ASSERT(fs_write(fd_dst, clone, 3 * BLK) == 3 * BLK, "fs_write");
+	fs_close(fd_dst);
+	fd_dst = fs_open("spare");
+	ASSERT(fs_write(fd_dst, clone, BLK) == BLK, "fs_write");
+	fs_close(fd_dst);
+	fd_dst = fs_open("filler");
+	while (fs_write(fd_dst, clone, BLK) == BLK)
+		;
+	fs_close(fd_dst);
+	ASSERT(!fs_delete("spare"), "fs_delete");
+	fd_src = fs_open("src");
+	fd_dst = fs_open("full");
+	ASSERT(fs_copy_range(fd_src, 0, fd_dst, 0, 3 * BLK) == 3 * BLK, "fs_copy_range");
+	fs_close(fd_src);
+	fs_close(fd_dst);
+	check_contents("full", src, 3 * BLK);
+	ASSERT(!fs_delete("filler"), "fs_delete");
+
+	/* Deleting the source leaves the copies readable */
+	ASSERT(!fs_delete("src"), "fs_delete");
+	ASSERT(!fs_umount(), "fs_umount");
+	ASSERT(!fs_mount(argv[1]), "fs_mount");
+	check_contents("clone", clone, SRC_LEN);
+	check_contents("part", part, 3 * BLK + 150);
+	check_contents("full", src, 3 * BLK);
+	ASSERT(!fs_delete("clone"), "fs_delete");
+	ASSERT(!fs_delete("full"), "fs_delete");
+	ASSERT(!fs_delete("part"), "fs_delete");
+	ASSERT(!fs_umount(), "fs_umount");
+
+	free(src);
+	free(clone);
+	free(part);
+	printf("clone_test: all checks passed\n");
+	return 0;
+}
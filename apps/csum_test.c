@@ -0,0 +1,148 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <disk.h>
+#include <fs.h>
+
+#define ASSERT(cond, func)                               \
+do {                                                     \
+	if (!(cond)) {                                       \
+		fprintf(stderr, "Function '%s' failed\n", func); \
+		exit(EXIT_FAILURE);                              \
+	}                                                    \
+} while (0)
+
+#define BLK 4096
+#define LEN (4 * BLK + 100)
+
+#define FEAT_COMPRESS 0x2
+
+/* Start of the superblock, as far as the features of the volume */
+struct super_start {
+	char signature[8];
+	uint16_t counts[4];
+	uint8_t fat_blks;
+	uint8_t ext[28];
+	uint8_t geo[24];
+	uint32_t features;
+} __attribute__((packed));
+
+/* Whether image file @diskname has checksums, and stores blocks as written */
+static int plain_summed(const char *diskname)
+{
+	struct super_start super;
+	char sums[256];
+	int fd = open(diskname, O_RDONLY), ok;
+
+	if (fd < 0)
+		return 0;
+	ok = pread(fd, &super, sizeof(super), 0) == sizeof(super) &&
+	     (!memcmp(super.signature, "ECS150FS", 8) ||
+	      (!memcmp(super.signature, "ECS150FX", 8) && !(super.features & FEAT_COMPRESS)));
+	close(fd);
+	snprintf(sums, sizeof(sums), "%s.sum", diskname);
+	return ok && !access(sums, F_OK);
+}
+
+static int scrub(void)
+{
+	ASSERT(!block_scrub_start(0), "block_scrub_start");
+	while (block_scrub_passes() < 1)
+		usleep(1000);
+	return block_scrub_stop();
+}
+
+/* Flip a byte of the image block holding @data, which must be the only one
+ * holding it, behind the library's back */
+static void corrupt(const char *diskname, const char *data)
+{
+	char block[BLK];
+	int fd = open(diskname, O_RDWR), found = 0;
+	off_t at = 0;
+
+	ASSERT(fd >= 0, "open");
+	for (off_t off = 0; pread(fd, block, BLK, off) == BLK; off += BLK) {
+		if (!memcmp(block, data, BLK)) {
+			at = off;
+			found++;
+		}
+	}
+	ASSERT(found == 1, "corrupt");
+	ASSERT(pread(fd, block, BLK, at) == BLK, "pread");
+	block[10] ^= 0xff;
+	ASSERT(pwrite(fd, block, BLK, at) == BLK, "pwrite");
+	close(fd);
+}
+
+/*
+ * Corrupt a data block of a file on a volume made with fs_mkfs -s and
+ * without -c, whose blocks are found as written in its image file: reads and
+ * scrubbing must notice it, until the block is written again.
+ */
+int main(int argc, char *argv[])
+{
+	char *data = malloc(LEN), *check = malloc(LEN);
+	int fd;
+
+	if (argc < 2) {
+		printf("Usage: %s <image file of a volume made with -s, without -c>\n", argv[0]);
+		exit(1);
+	}
+	if (!plain_summed(argv[1])) {
+		fprintf(stderr, "%s: not the image of a volume made with -s and without -c\n",
+			argv[1]);
+		exit(1);
+	}
+	for (int i = 0; i < LEN; i++)
+		data[i] = 'a' + (i * 7 + i / BLK) % 26;
+
+	ASSERT(!fs_mount(argv[1]), "fs_mount");
+	ASSERT(!fs_create("file"), "fs_create");
+	fd = fs_open("file");
+	ASSERT(fd >= 0, "fs_open");
+	ASSERT(fs_write(fd, data, LEN) == LEN, "fs_write");
+	fs_close(fd);
+	ASSERT(scrub() == 0, "block_scrub_stop");
+	ASSERT(!fs_umount(), "fs_umount");
+
+	/* Reads end early at the bad block, unless checks are off */
+	corrupt(argv[1], data + 2 * BLK);
+	ASSERT(!fs_mount(argv[1]), "fs_mount");
+	fd = fs_open("file");
+	ASSERT(fd >= 0, "fs_open");
+	ASSERT(fs_read(fd, check, LEN) < 2 * BLK + 1, "fs_read");
+	ASSERT(fs_pread(fd, check, BLK, BLK) == BLK, "fs_pread");
+	ASSERT(!memcmp(check, data + BLK, BLK), "fs_pread");
+	ASSERT(fs_pread(fd, check, BLK, 2 * BLK + 5) == -1, "fs_pread");
+	ASSERT(block_verify(BLOCK_VERIFY_OFF) == BLOCK_VERIFY_ALWAYS, "block_verify");
+	ASSERT(fs_pread(fd, check, LEN, 0) == LEN, "fs_pread");
+	ASSERT(memcmp(check, data, LEN), "fs_pread");
+	ASSERT(block_verify(BLOCK_VERIFY_ALWAYS) == BLOCK_VERIFY_OFF, "block_verify");
+	ASSERT(block_verify(42) == -1, "block_verify");
+	ASSERT(scrub() == 1, "block_scrub_stop");
+
+	/* Writing the block again fixes it */
+	ASSERT(fs_pwrite(fd, data + 2 * BLK, BLK, 2 * BLK) == BLK, "fs_pwrite");
+	ASSERT(scrub() == 0, "block_scrub_stop");
+	fs_close(fd);
+	ASSERT(!fs_umount(), "fs_umount");
+
+	/* The checksums survive unmounting */
+	ASSERT(!fs_mount(argv[1]), "fs_mount");
+	fd = fs_open("file");
+	ASSERT(fd >= 0, "fs_open");
+	ASSERT(fs_read(fd, check, LEN) == LEN, "fs_read");
+	ASSERT(!memcmp(check, data, LEN), "fs_read");
+	fs_close(fd);
+	ASSERT(!fs_delete("file"), "fs_delete");
+	ASSERT(!fs_umount(), "fs_umount");
+
+	free(data);
+	free(check);
+	printf("csum_test: all checks passed\n");
+	return 0;
+}
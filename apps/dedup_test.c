@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fs.h>
+
+#define ASSERT(cond, func)                               \
+do {                                                     \
+	if (!(cond)) {                                       \
+		fprintf(stderr, "Function '%s' failed\n", func); \
+		exit(EXIT_FAILURE);                              \
+	}                                                    \
+} while (0)
+
+#define DATA_LEN (4 * 4096 + 500)
+
+/* Write the same data to a new file, return its descriptor */
+static int write_copy(const char *name, char *data)
+{
+	int fd;
+
+	ASSERT(!fs_create(name), "fs_create");
+	fd = fs_open(name);
+	ASSERT(fd >= 0, "fs_open");
+	ASSERT(fs_write(fd, data, DATA_LEN) == DATA_LEN, "fs_write");
+	return fd;
+}
+
+/* Fill a block with contents no other block of the test has */
+static void unique_block(char *block, int n)
+{
+	memset(block, 0, 4096);
+	snprintf(block, 4096, "unique block %d", n);
+}
+
+static void check_contents(const char *name, const char *data)
+{
+	char *check = malloc(DATA_LEN);
+	int fd = fs_open(name);
+
+	ASSERT(fd >= 0, "fs_open");
+	ASSERT(fs_stat(fd) == DATA_LEN, "fs_stat");
+	ASSERT(fs_read(fd, check, DATA_LEN) == DATA_LEN, "fs_read");
+	ASSERT(!memcmp(check, data, DATA_LEN), "fs_read");
+	fs_close(fd);
+	free(check);
+}
+
+/*
+ * Two files with the same contents share their blocks: writing to one of them
+ * must leave the other alone, and deleting one must leave the other readable.
+ * Meant for volumes made with `fs_mkfs.x -D disk.fs 100`.
+ */
+int main(int argc, char *argv[])
+{
+	char *data = malloc(DATA_LEN), *changed = malloc(DATA_LEN);
+	char *blocks = malloc(2 * 4096), *check = malloc(2 * 4096);
+	int fd, n = 0;
+
+	if (argc < 2) {
+		printf("Usage: %s <diskimage>\n", argv[0]);
+		exit(1);
+	}
+	for (int i = 0; i < DATA_LEN; i++)
+		data[i] = 'a' + i % 23;
+	memcpy(changed, data, DATA_LEN);
+	memcpy(changed + 4096 + 10, "changed", 7);
+
+	ASSERT(!fs_mount(argv[1]), "fs_mount");
+	fs_close(write_copy("first", data));
+	fs_close(write_copy("second", data));
+	check_contents("first", data);
+	check_contents("second", data);
+
+	/* Overwrite part of a shared block of the second file */
+	fd = fs_open("second");
+	ASSERT(fd >= 0, "fs_open");
+	ASSERT(!fs_lseek(fd, 4096 + 10), "fs_lseek");
+	ASSERT(fs_write(fd, "changed", 7) == 7, "fs_write");
+	fs_close(fd);
+	ASSERT(!fs_umount(), "fs_umount");
+
+	ASSERT(!fs_mount(argv[1]), "fs_mount");
+	check_contents("first", data);
+	check_contents("second", changed);
+	ASSERT(!fs_delete("first"), "fs_delete");
+	check_contents("second", changed);
+
+	/* Writing the original data again shares it with the second file */
+	fs_close(write_copy("third", data));
+	check_contents("third", data);
+	ASSERT(!fs_delete("second"), "fs_delete");
+
+	/*
+	 * On a full volume, a write that frees a block by sharing another one
+	 * gets that block back for the next one it writes: the block must not
+	 * be released as freed once the write is done
+	 */
+	ASSERT(!fs_create("fourth"), "fs_create");
+	fd = fs_open("fourth");
+	ASSERT(fd >= 0, "fs_open");
+	unique_block(blocks, n++);
+	ASSERT(fs_write(fd, blocks, 4096) == 4096, "fs_write");
+	ASSERT(!fs_create("spare") && !fs_create("filler"), "fs_create");
+	int filler = fs_open("spare");
+	ASSERT(filler >= 0, "fs_open");
+	unique_block(blocks, n++);
+	ASSERT(fs_write(filler, blocks, 4096) == 4096, "fs_write");
+	fs_close(filler);
+	filler = fs_open("filler");
+	ASSERT(filler >= 0, "fs_open");
+	do
+		unique_block(blocks, n++);
+	while (fs_write(filler, blocks, 4096) == 4096);
+	fs_close(filler);
+	ASSERT(!fs_delete("spare"), "fs_delete");
+	memcpy(blocks, data, 4096);
+	unique_block(blocks + 4096, n++);
+	ASSERT(fs_pwrite(fd, blocks, 2 * 4096, 0) == 2 * 4096, "fs_pwrite");
+	fs_close(fd);
+	ASSERT(!fs_umount(), "fs_umount");
+	ASSERT(!fs_mount(argv[1]), "fs_mount");
+	fd = fs_open("fourth");
+	ASSERT(fd >= 0, "fs_open");
+	ASSERT(fs_read(fd, check, 2 * 4096) == 2 * 4096, "fs_read");
+	ASSERT(!memcmp(check, blocks, 2 * 4096), "fs_read");
+	fs_close(fd);
+	check_contents("third", data);
+	ASSERT(!fs_delete("fourth"), "fs_delete");
+	ASSERT(!fs_delete("filler"), "fs_delete");
+	ASSERT(!fs_delete("third"), "fs_delete");
+	ASSERT(!fs_umount(), "fs_umount");
+
+	free(data);
+	free(changed);
+	free(blocks);
+	free(check);
+	printf("dedup_test: all checks passed\n");
+	return 0;
+}
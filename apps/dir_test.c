@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fs.h>
+
+#define ASSERT(cond, func)                               \
+do {                                                     \
+	if (!(cond)) {                                       \
+		fprintf(stderr, "Function '%s' failed\n", func); \
+		exit(EXIT_FAILURE);                              \
+	}                                                    \
+} while (0)
+
+/*
+ * Fill the root directory of an empty volume, punch holes in it and fill them
+ * again: every file must stay reachable by name, whichever directory block
+ * it ended up in. Meant for volumes made with a large directory, such as
+ * `fs_mkfs.x -d 5000 disk.fs 8192`.
+ */
+int main(int argc, char *argv[])
+{
+	char name[FS_FILENAME_LEN];
+	int files = 0, fd;
+
+	if (argc < 2) {
+		printf("Usage: %s <diskimage>\n", argv[0]);
+		exit(1);
+	}
+
+	ASSERT(!fs_mount(argv[1]), "fs_mount");
+
+	/* Create files until the directory is full */
+	for (;;) {
+		snprintf(name, sizeof(name), "file%d", files);
+		if (fs_create(name))
+			break;
+		files++;
+	}
+	ASSERT(files > 0, "fs_create");
+	snprintf(name, sizeof(name), "file%d", 0);
+	ASSERT(fs_create(name) == -1, "fs_create");
+
+	/* Delete every other file */
+	for (int i = 0; i < files; i += 2) {
+		snprintf(name, sizeof(name), "file%d", i);
+		ASSERT(!fs_delete(name), "fs_delete");
+	}
+	for (int i = 0; i < files; i++) {
+		snprintf(name, sizeof(name), "file%d", i);
+		fd = fs_open(name);
+		ASSERT((fd >= 0) == (i % 2 == 1), "fs_open");
+		if (fd >= 0)
+			fs_close(fd);
+	}
+
+	/* Refill the holes under other names, then remount and look again */
+	for (int i = 0; i < files; i += 2) {
+		snprintf(name, sizeof(name), "new%d", i);
+		ASSERT(!fs_create(name), "fs_create");
+	}
+	ASSERT(!fs_umount(), "fs_umount");
+	ASSERT(!fs_mount(argv[1]), "fs_mount");
+	for (int i = 0; i < files; i++) {
+		snprintf(name, sizeof(name), i % 2 ? "file%d" : "new%d", i);
+		fd = fs_open(name);
+		ASSERT(fd >= 0, "fs_open");
+		fs_close(fd);
+		ASSERT(!fs_delete(name), "fs_delete");
+	}
+	ASSERT(!fs_umount(), "fs_umount");
+
+	printf("dir_test: %d files, all checks passed\n", files);
+	return 0;
+}
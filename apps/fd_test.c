@@ -0,0 +1,137 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fs.h>
+
+#define ASSERT(cond, func)                               \
+do {                                                     \
+	if (!(cond)) {                                       \
+		fprintf(stderr, "Function '%s' failed\n", func); \
+		exit(EXIT_FAILURE);                              \
+	}                                                    \
+} while (0)
+
+#define FDS 600
+#define LEN 20000
+#define THREADS 4
+#define PIECE 4096
+#define ROUNDS 50
+
+static int fds[FDS];
+static char *data;
+static pthread_barrier_t start;
+
+/*
+ * Create a file of its own and write it a block at a time through two
+ * descriptors, then delete it, over and over; the last one is kept
+ */
+static void *writer(void *arg)
+{
+	char name[16];
+	int fd, other;
+
+	snprintf(name, sizeof(name), "thread%ld", (long)arg);
+	pthread_barrier_wait(&start);
+	for (int round = 0; round < ROUNDS; round++) {
+		if (round)
+			ASSERT(!fs_delete(name), "fs_delete");
+		ASSERT(!fs_create(name), "fs_create");
+		fd = fs_open(name);
+		other = fs_open(name);
+		ASSERT(fd >= 0 && other >= 0, "fs_open");
+		for (int off = 0; off < LEN; off += PIECE) {
+			int n = LEN - off < PIECE ? LEN - off : PIECE;
+
+			ASSERT(fs_pwrite(off % (2 * PIECE) ? other : fd, data + off, n, off) == n,
+			       "fs_pwrite");
+		}
+		ASSERT(!fs_close(fd) && !fs_close(other), "fs_close");
+	}
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	char *check = malloc(LEN);
+	pthread_t threads[THREADS];
+	int fd, stale;
+
+	if (argc < 2) {
+		printf("Usage: %s <diskimage>\n", argv[0]);
+		exit(1);
+	}
+	data = malloc(LEN);
+	for (int i = 0; i < LEN; i++)
+		data[i] = 'a' + (i * 13 + i / 4096) % 26;
+
+	ASSERT(!fs_mount(argv[1]), "fs_mount");
+	ASSERT(!fs_create("fdfile"), "fs_create");
+	fd = fs_open("fdfile");
+	ASSERT(fd >= 0, "fs_open");
+	ASSERT(fs_write(fd, data, LEN) == LEN, "fs_write");
+	ASSERT(!fs_close(fd), "fs_close");
+
+	/* More descriptors than the table first holds */
+	for (int i = 0; i < FDS; i++) {
+		fds[i] = fs_open("fdfile");
+		ASSERT(fds[i] >= 0, "fs_open");
+		for (int j = 0; j < i; j++)
+			ASSERT(fds[j] != fds[i], "fs_open");
+	}
+
+	/* Each descriptor moves on its own, in step with the others */
+	for (int i = 0; i < FDS; i++)
+		ASSERT(!fs_lseek(fds[i], (i * 31) % LEN), "fs_lseek");
+	for (int i = 0; i < FDS; i++) {
+		int off = (i * 31) % LEN, n = LEN - off < 100 ? LEN - off : 100;
+
+		ASSERT(fs_read(fds[i], check, 100) == n, "fs_read");
+		ASSERT(!memcmp(check, data + off, n), "fs_read");
+	}
+	ASSERT(fs_read(fds[1], check, LEN) == LEN - 131, "fs_read");
+	ASSERT(!memcmp(check, data + 131, LEN - 131), "fs_read");
+	ASSERT(fs_delete("fdfile") == -1, "fs_delete");
+
+	/* A closed descriptor stays invalid, also once its slot is reused */
+	stale = fds[7];
+	ASSERT(!fs_close(stale), "fs_close");
+	ASSERT(fs_close(stale) == -1, "fs_close");
+	fds[7] = fs_open("fdfile");
+	ASSERT(fds[7] >= 0 && fds[7] != stale, "fs_open");
+	ASSERT(fs_stat(stale) == -1, "fs_stat");
+	ASSERT(fs_read(stale, check, 1) == -1, "fs_read");
+	ASSERT(fs_stat(fds[7]) == LEN, "fs_stat");
+	ASSERT(fs_stat(-1) == -1 && fs_stat(FS_OPEN_MAX_COUNT + 3) == -1, "fs_stat");
+
+	/* Files stay open until their last descriptor is closed */
+	ASSERT(fs_umount() == -1, "fs_umount");
+	for (int i = 0; i < FDS; i++)
+		ASSERT(!fs_close(fds[i]), "fs_close");
+	ASSERT(!fs_delete("fdfile"), "fs_delete");
+
+	/* Threads open, write and close files at the same time */
+	pthread_barrier_init(&start, NULL, THREADS);
+	for (long t = 0; t < THREADS; t++)
+		ASSERT(!pthread_create(&threads[t], NULL, writer, (void *)t), "pthread_create");
+	for (int t = 0; t < THREADS; t++)
+		pthread_join(threads[t], NULL);
+	pthread_barrier_destroy(&start);
+	for (int t = 0; t < THREADS; t++) {
+		char name[16];
+
+		snprintf(name, sizeof(name), "thread%d", t);
+		fd = fs_open(name);
+		ASSERT(fd >= 0, "fs_open");
+		ASSERT(fs_read(fd, check, LEN) == LEN, "fs_read");
+		ASSERT(!memcmp(check, data, LEN), "fs_read");
+		ASSERT(!fs_close(fd) && !fs_delete(name), "fs_delete");
+	}
+	ASSERT(!fs_umount(), "fs_umount");
+
+	free(data);
+	free(check);
+	printf("fd_test: all checks passed\n");
+	return 0;
+}
@@ -0,0 +1,130 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <disk.h>
+
+#define die(...)				\
+do {							\
+	fprintf(stderr, __VA_ARGS__);	\
+	fprintf(stderr, "\n");		\
+	exit(1);					\
+} while (0)
+
+/* Largest run of a delta, as written by fs_delta */
+#define RUN_MAX 64
+
+struct delta_header {
+	char magic[8];		/* "FSDELTA1" */
+	uint32_t base_epoch;	/* epoch the image must be at, 0 for a full image */
+	uint32_t epoch;		/* epoch of the image once the delta is applied */
+	uint64_t bcount;
+} __attribute__((packed));
+
+struct delta_run {
+	uint32_t start;
+	uint32_t count;		/* 0 ends the delta */
+	uint32_t zero;
+	uint32_t padding;
+} __attribute__((packed));
+
+/* Make a run of blocks read back as zeros, sparse where the host allows it */
+static void zero_run(size_t start, size_t count, uint8_t *buf)
+{
+	if (block_discard(start, count) || block_read_range(start, count, buf))
+		die("Cannot clear blocks %zu to %zu", start, start + count - 1);
+	for (size_t i = 0; i < count * BLOCK_SIZE; i++) {
+		if (buf[i]) {
+			memset(buf, 0, count * BLOCK_SIZE);
+			if (block_write_range(start, count, buf))
+				die("Cannot clear blocks %zu to %zu",
+				    start, start + count - 1);
+			return;
+		}
+	}
+}
+
+/*
+ * Apply a delta written by fs_delta to a replica of the disk image it came
+ * from, which must be at the epoch the delta starts from. A full delta
+ * creates the replica if it does not exist yet.
+ */
+int main(int argc, char *argv[])
+{
+	struct delta_header hdr;
+	struct delta_run run;
+	uint8_t *buf = malloc(RUN_MAX * BLOCK_SIZE);
+	size_t applied = 0;
+	FILE *in;
+	int fd, cur;
+
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s <diskname> <delta file>\n", argv[0]);
+		exit(1);
+	}
+	if (!buf)
+		die("Cannot allocate buffer");
+	in = fopen(argv[2], "rb");
+	if (!in)
+		die("Cannot open '%s'", argv[2]);
+	if (fread(&hdr, sizeof(hdr), 1, in) != 1 || memcmp(hdr.magic, "FSDELTA1", 8))
+		die("'%s' is not a delta", argv[2]);
+
+	/* Sparse image: blocks the delta does not write stay holes */
+	fd = open(argv[1], O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd >= 0) {
+		if (hdr.base_epoch || ftruncate(fd, hdr.bcount * BLOCK_SIZE)) {
+			unlink(argv[1]);
+			die("'%s' does not exist, it needs a full delta", argv[1]);
+		}
+		close(fd);
+	} else if (errno != EEXIST) {
+		die("Cannot create '%s'", argv[1]);
+	}
+
+	if (block_disk_open(argv[1]))
+		die("Cannot open '%s'", argv[1]);
+	if ((uint64_t)block_disk_count() != hdr.bcount)
+		die("'%s' has %d blocks, the delta is for %llu", argv[1],
+		    block_disk_count(), (unsigned long long)hdr.bcount);
+	cur = block_epoch();
+	if (hdr.base_epoch && (uint32_t)cur != hdr.base_epoch)
+		die("'%s' is at epoch %d, the delta applies to epoch %u",
+		    argv[1], cur, hdr.base_epoch);
+	if ((uint32_t)cur >= hdr.epoch)
+		die("'%s' is already at epoch %d", argv[1], cur);
+
+	for (;;) {
+		if (fread(&run, sizeof(run), 1, in) != 1)
+			die("'%s' is truncated", argv[2]);
+		if (!run.count)
+			break;
+		if (run.count > RUN_MAX || (uint64_t)run.start + run.count > hdr.bcount)
+			die("'%s' is corrupted", argv[2]);
+		if (run.zero) {
+			zero_run(run.start, run.count, buf);
+		} else {
+			if (fread(buf, BLOCK_SIZE, run.count, in) != run.count)
+				die("'%s' is truncated", argv[2]);
+			if (block_write_range(run.start, run.count, buf))
+				die("Cannot write blocks %u to %u", run.start,
+				    run.start + run.count - 1);
+		}
+		applied += run.count;
+	}
+	fclose(in);
+
+	/* The replica is now at the same epoch as the image */
+	if (block_checkpoint(hdr.epoch) != (int)hdr.epoch)
+		die("Cannot start epoch %u of '%s'", hdr.epoch, argv[1]);
+	block_disk_close();
+	free(buf);
+
+	printf("Applied %zu blocks to '%s', now at epoch %u\n", applied, argv[1],
+	       hdr.epoch);
+	return 0;
+}
@@ -0,0 +1,887 @@
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <disk.h>
+#include <fs.h>
+
+#define check_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	check_error(__VA_ARGS__);	\
+	exit(2);					\
+} while (0)
+
+#define FAT16_EOC 0xffff
+#define FAT32_EOC 0xffffffff
+#define SUPER_EXT_MAGIC 0x31545845
+#define SUPER_EXT_VERSION 1
+#define MAX_THREADS 16
+#define SNAP_MAX 8
+
+/* On-disk layout, as produced by fs_make.x and extended by libfs */
+struct super_ext {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t clean;
+	uint32_t free_blks;
+	uint32_t free_roots;
+	uint32_t alloc_hint;
+	uint32_t root_sum;
+	uint32_t checksum;
+} __attribute__((packed));
+
+/* Geometry of "ECS150FX" volumes, which have a 32-bit FAT */
+struct super_geo {
+	uint32_t total_blks;
+	uint32_t root_dir_idx;
+	uint32_t data_blk_idx;
+	uint32_t total_data_blks;
+	uint32_t fat_blks;
+	uint32_t dir_blks;	/* 0 is the same as 1 */
+} __attribute__((packed));
+
+struct super_block {
+	char signature[8];
+	uint16_t total_blks;
+	uint16_t root_dir_idx;
+	uint16_t data_blk_idx;
+	uint16_t total_data_blks;
+	uint8_t fat_blks;
+	struct super_ext ext;
+	struct super_geo geo;
+	uint32_t features;
+	uint32_t tail_blk;
+	uint32_t snap_blk[SNAP_MAX];	/* 0 for a free slot */
+	uint32_t snap_seq;
+	uint8_t padding[4071 - sizeof(struct super_ext) - sizeof(struct super_geo) - 4 * (SNAP_MAX + 1)];
+} __attribute__((packed));
+
+struct root_entry {
+	char filename[FS_FILENAME_LEN];
+	uint32_t file_size;
+	uint16_t first_data_idx;
+	uint16_t first_data_hi;	/* 32-bit FAT volumes only */
+	uint8_t flags;
+	uint8_t reserved;
+	uint16_t tail_off;	/* packed files only */
+	uint32_t size_hi;	/* 32-bit FAT volumes only */
+} __attribute__((packed));
+
+#define FEAT_TAILS 0x1
+#define FEAT_COMPRESS 0x2
+#define FEAT_DEDUP 0x4
+#define ROOT_PACKED 0x1
+#define ROOT_COMPRESSED 0x2
+#define ROOT_MAPPED 0x8
+#define CZ_MAGIC 0x315a4c43
+#define TAIL_MAGIC 0x4c494154
+#define SNAP_MAGIC 0x50414e53
+/* Shared blocks hold a reference count instead of a link */
+#define FAT32_SHARED 0x80000000
+#define MAP_ENTRIES (BLOCK_SIZE / 4)
+/* @owner of tail blocks and shared blocks, which several files use */
+#define TAIL_OWNER -1
+#define SHARED_OWNER -2
+/* @owner of the blocks holding snapshots */
+#define SNAP_OWNER -3
+
+/* Start of the chain of a compressed file, followed by an extent table */
+struct cz_header {
+	uint32_t magic;
+	uint32_t blocks;
+} __attribute__((packed));
+
+struct cz_extent {
+	uint32_t off;
+	uint16_t len;
+	uint16_t flags;
+} __attribute__((packed));
+
+/* Start of a tail block, which packed files share */
+struct tail_header {
+	uint32_t magic;
+	uint16_t live;
+	uint16_t end;
+} __attribute__((packed));
+
+/* Start of the chain of a snapshot, then its copies of the FAT and root directory */
+struct snap_header {
+	uint32_t magic;
+	uint32_t seq;
+	char name[FS_FILENAME_LEN];
+	uint32_t fat_blks;
+	uint32_t dir_blks;
+} __attribute__((packed));
+
+/* First slot of each block of a hashed (multi-block) root directory */
+struct dir_header {
+	uint32_t used;
+	uint32_t overflow;
+	uint8_t padding[24];
+} __attribute__((packed));
+
+#define DIR_BLK_FILES (BLOCK_SIZE / sizeof(struct root_entry))
+
+/* Per-file result of a chain walk */
+struct file_report {
+	int bad_start;		/* first block index out of range */
+	int bad_link;		/* chain points outside the data area or to a free block */
+	int cross_link;		/* chain runs into a block owned by another file */
+	int cross_with;		/* index of that other file, or an *_OWNER */
+	int cycle;		/* chain runs into itself */
+	uint32_t blocks;	/* blocks reached before the chain ended or broke */
+	uint32_t extents;	/* physically contiguous runs */
+};
+
+/* Loaded image, shared read-only by the workers (except for @owner) */
+static struct {
+	struct super_block super;
+	struct super_geo geo;	/* whatever the FAT width */
+	int fat32;
+	uint32_t fat_per_blk;
+	void *fat;
+	uint8_t *dir;		/* raw root directory blocks */
+	int dir_hashed;
+	int dir_per_blk;
+	int nfiles;		/* directory entries, used or not */
+	struct root_entry *root;
+	/* 1 + index of the file whose chain claimed each block, 0 if none */
+	int *owner;
+	struct file_report *report;
+	int next_file;
+} img;
+
+/* FAT entry of @blk, end of chain is FAT32_EOC whatever the FAT width */
+static uint32_t fat_get(uint32_t blk)
+{
+	uint16_t entry;
+
+	if (img.fat32)
+		return ((uint32_t *)img.fat)[blk];
+	entry = ((uint16_t *)img.fat)[blk];
+	return entry == FAT16_EOC ? FAT32_EOC : entry;
+}
+
+/* References to a shared block, 0 if @blk is not one */
+static uint32_t fat_refs(uint32_t blk)
+{
+	uint32_t entry = fat_get(blk);
+
+	if (!img.fat32 || entry == FAT32_EOC || !(entry & FAT32_SHARED))
+		return 0;
+	return entry & ~FAT32_SHARED;
+}
+
+static uint32_t root_first(const struct root_entry *ent)
+{
+	if (img.fat32)
+		return ent->first_data_idx | (uint32_t)ent->first_data_hi << 16;
+	return ent->first_data_idx == FAT16_EOC ? FAT32_EOC : ent->first_data_idx;
+}
+
+static uint64_t root_size(const struct root_entry *ent)
+{
+	return ent->file_size | (img.fat32 ? (uint64_t)ent->size_hi << 32 : 0);
+}
+
+/* Blocks the contents of a file take up */
+static uint32_t root_blocks(const struct root_entry *ent)
+{
+	return (root_size(ent) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+static int check_file_errors(int i)
+{
+	struct file_report *r = &img.report[i];
+
+	return r->bad_start || r->bad_link || r->cross_link || r->cycle;
+}
+
+/* Claim @blk for file @i, return the previous owner (1-based) or 0 */
+static int claim_block(uint32_t blk, int i)
+{
+	int expected = 0;
+
+	if (__atomic_compare_exchange_n(&img.owner[blk], &expected, i + 1, 0,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		return 0;
+	return expected;
+}
+
+static void walk_chain(int i)
+{
+	struct root_entry *ent = &img.root[i];
+	struct file_report *r = &img.report[i];
+	uint32_t blk = root_first(ent);
+	uint32_t prev = FAT32_EOC;
+
+	if (blk == FAT32_EOC)
+		return;
+	if (blk == 0 || blk >= img.geo.total_data_blks) {
+		r->bad_start = 1;
+		return;
+	}
+
+	while (blk != FAT32_EOC) {
+		int prev_owner = claim_block(blk, i);
+
+		if (prev_owner == i + 1) {
+			r->cycle = 1;
+			return;
+		} else if (prev_owner) {
+			r->cross_link = 1;
+			r->cross_with = prev_owner < 0 ? prev_owner : prev_owner - 1;
+			return;
+		}
+
+		r->blocks++;
+		if (prev == FAT32_EOC || blk != prev + 1)
+			r->extents++;
+
+		prev = blk;
+		blk = fat_get(blk);
+		if (blk == 0 || (blk != FAT32_EOC && blk >= img.geo.total_data_blks)) {
+			r->bad_link = 1;
+			return;
+		}
+	}
+}
+
+/*
+ * Packed files are slices of tail blocks: each tail block must say how many
+ * files it holds, and every slice must lie within the part in use.
+ */
+static int check_tails(void)
+{
+	uint32_t *refs = calloc(img.geo.total_data_blks, sizeof(uint32_t));
+	uint8_t block[BLOCK_SIZE];
+	struct tail_header *hdr = (struct tail_header *)block;
+	int errors = 0;
+
+	if (!refs)
+		die("Cannot allocate tail block counts");
+	for (int i = 0; i < img.nfiles; i++) {
+		struct root_entry *ent = &img.root[i];
+		uint32_t blk = root_first(ent);
+
+		if (ent->filename[0] == '\0' || !(ent->flags & ROOT_PACKED))
+			continue;
+		if (!(img.super.features & FEAT_TAILS)) {
+			printf("%s: packed, but the volume has no tail packing\n",
+			       ent->filename);
+			errors++;
+		}
+		if (blk == 0 || blk >= img.geo.total_data_blks ||
+		    fat_get(blk) != FAT32_EOC) {
+			img.report[i].bad_start = 1;
+			continue;
+		}
+		refs[blk]++;
+		img.owner[blk] = TAIL_OWNER;
+	}
+
+	for (uint32_t b = 1; b < img.geo.total_data_blks; b++) {
+		if (!refs[b])
+			continue;
+		if (block_read(img.geo.data_blk_idx + b, block))
+			die("Cannot read tail block %u", b);
+		if (hdr->magic != TAIL_MAGIC) {
+			printf("tail[%u]: not a tail block\n", b);
+			errors++;
+			continue;
+		}
+		if (hdr->live != refs[b] || hdr->end > BLOCK_SIZE) {
+			printf("tail[%u]: header says %u files up to %u, "
+			       "found %u files\n", b, hdr->live, hdr->end, refs[b]);
+			errors++;
+		}
+		for (int i = 0; i < img.nfiles; i++) {
+			struct root_entry *ent = &img.root[i];
+
+			if (ent->filename[0] == '\0' ||
+			    !(ent->flags & ROOT_PACKED) || root_first(ent) != b)
+				continue;
+			if (ent->tail_off < sizeof(struct tail_header) ||
+			    ent->tail_off + ent->file_size > hdr->end) {
+				printf("%s: tail at %u+%u is outside tail[%u]\n",
+				       ent->filename, ent->tail_off,
+				       ent->file_size, b);
+				errors++;
+			}
+		}
+	}
+	free(refs);
+	return errors;
+}
+
+/*
+ * The chain of a compressed file holds its extent table and then the
+ * compressed blocks: return how many blocks that takes, 0 if the table is
+ * not valid.
+ */
+static uint32_t check_compressed(int i)
+{
+	struct root_entry *ent = &img.root[i];
+	uint32_t blocks = root_blocks(ent);
+	size_t len = sizeof(struct cz_header) + blocks * sizeof(struct cz_extent);
+	size_t data_start = (len + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+	uint8_t *head = malloc(data_start);
+	struct cz_header *hdr = (struct cz_header *)head;
+	struct cz_extent *ext = (struct cz_extent *)(hdr + 1);
+	uint32_t blk = root_first(ent), end = 0;
+
+	if (!head)
+		die("Cannot allocate extent table");
+	for (size_t k = 0; k < data_start / BLOCK_SIZE; k++) {
+		if (blk == FAT32_EOC ||
+		    block_read(img.geo.data_blk_idx + blk, head + k * BLOCK_SIZE)) {
+			free(head);
+			return 0;
+		}
+		blk = fat_get(blk);
+	}
+	if (hdr->magic != CZ_MAGIC || hdr->blocks != blocks) {
+		free(head);
+		return 0;
+	}
+	for (uint32_t k = 0; k < blocks; k++) {
+		if (ext[k].len > BLOCK_SIZE) {
+			free(head);
+			return 0;
+		}
+		if (ext[k].off + ext[k].len > end)
+			end = ext[k].off + ext[k].len;
+	}
+	free(head);
+	return (data_start + end + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+/*
+ * The chain of a mapped file holds one shared block index per block of the
+ * file: count the references in @refs, return 0 if the map is valid.
+ */
+static int check_mapped(int i, uint32_t *refs)
+{
+	struct root_entry *ent = &img.root[i];
+	uint32_t blocks = root_blocks(ent);
+	uint32_t map[MAP_ENTRIES];
+	uint32_t blk = root_first(ent);
+	int errors = 0;
+
+	for (uint32_t k = 0; k < blocks; k++) {
+		uint32_t b;
+
+		if (k % MAP_ENTRIES == 0) {
+			if (k && blk != FAT32_EOC)
+				blk = fat_get(blk);
+			if (blk == FAT32_EOC ||
+			    block_read(img.geo.data_blk_idx + blk, map))
+				return 1;
+		}
+		b = map[k % MAP_ENTRIES];
+		if (b == 0 || b >= img.geo.total_data_blks || !fat_refs(b)) {
+			printf("%s: block %u maps to %u, not a shared block\n",
+			       ent->filename, k, b);
+			errors++;
+			continue;
+		}
+		refs[b]++;
+	}
+	return errors;
+}
+
+/*
+ * Each snapshot listed by the superblock has a chain of its own, holding a
+ * header and copies of the FAT and root directory: claim it, and mark in
+ * @frozen the blocks the snapshot uses, which the volume must leave alone.
+ */
+static int check_snapshots(uint8_t *frozen)
+{
+	uint32_t len = 1 + img.geo.fat_blks + img.geo.dir_blks;
+	uint32_t *chain = malloc(sizeof(uint32_t) * len);
+	uint8_t block[BLOCK_SIZE];
+	struct snap_header *hdr = (struct snap_header *)block;
+	int errors = 0;
+
+	if (!chain)
+		die("Cannot allocate snapshot chain");
+	for (int s = 0; img.fat32 && s < SNAP_MAX; s++) {
+		uint32_t blk = img.super.snap_blk[s], n = 0;
+
+		if (!blk)
+			continue;
+		while (blk != FAT32_EOC && n < len) {
+			if (blk == 0 || blk >= img.geo.total_data_blks ||
+			    fat_get(blk) == 0 || img.owner[blk])
+				break;
+			img.owner[blk] = SNAP_OWNER;
+			chain[n++] = blk;
+			blk = fat_get(blk);
+		}
+		if (n != len || blk != FAT32_EOC) {
+			printf("snapshot[%d]: chain is broken or has the wrong length\n", s);
+			errors++;
+			continue;
+		}
+		if (block_read(img.geo.data_blk_idx + chain[0], block))
+			die("Cannot read snapshot %d", s);
+		if (hdr->magic != SNAP_MAGIC || hdr->fat_blks != img.geo.fat_blks ||
+		    hdr->dir_blks != img.geo.dir_blks) {
+			printf("snapshot[%d]: not a snapshot of this volume\n", s);
+			errors++;
+			continue;
+		}
+		printf("snapshot: %.*s, seq: %u\n", FS_FILENAME_LEN, hdr->name, hdr->seq);
+
+		for (uint32_t j = 0; j < img.geo.fat_blks; j++) {
+			uint32_t *fat = (uint32_t *)block;
+
+			if (block_read(img.geo.data_blk_idx + chain[1 + j], block))
+				die("Cannot read snapshot %d", s);
+			for (uint32_t e = 0; e < img.fat_per_blk; e++) {
+				uint32_t b = j * img.fat_per_blk + e;
+
+				if (b < img.geo.total_data_blks && fat[e])
+					frozen[b] = 1;
+			}
+		}
+	}
+	free(chain);
+	return errors;
+}
+
+static void *check_worker(void *arg)
+{
+	(void)arg;
+
+	for (;;) {
+		int i = __atomic_fetch_add(&img.next_file, 1, __ATOMIC_RELAXED);
+
+		if (i >= img.nfiles)
+			break;
+		if (img.root[i].filename[0] != '\0' &&
+		    !(img.root[i].flags & ROOT_PACKED))
+			walk_chain(i);
+	}
+	return NULL;
+}
+
+static int check_super(void)
+{
+	struct super_block *sb = &img.super;
+	struct super_geo *geo = &img.geo;
+	int errors = 0;
+	uint32_t fat_blks;
+
+	if (!memcmp(sb->signature, "ECS150FS", 8)) {
+		geo->total_blks = sb->total_blks;
+		geo->root_dir_idx = sb->root_dir_idx;
+		geo->data_blk_idx = sb->data_blk_idx;
+		geo->total_data_blks = sb->total_data_blks;
+		geo->fat_blks = sb->fat_blks;
+		geo->dir_blks = 1;
+		img.fat_per_blk = BLOCK_SIZE / 2;
+	} else if (!memcmp(sb->signature, "ECS150FX", 8)) {
+		*geo = sb->geo;
+		if (!geo->dir_blks)
+			geo->dir_blks = 1;
+		img.fat32 = 1;
+		img.fat_per_blk = BLOCK_SIZE / 4;
+	} else {
+		die("bad signature, not an ECS150FS image");
+	}
+	fat_blks = (geo->total_data_blks + img.fat_per_blk - 1) / img.fat_per_blk;
+
+	if (geo->total_blks != (uint32_t)block_disk_count()) {
+		printf("superblock: total_blk_count=%u but image has %d blocks\n",
+		       geo->total_blks, block_disk_count());
+		errors++;
+	}
+	if (geo->fat_blks != fat_blks) {
+		printf("superblock: fat_blk_count=%u, expected %u\n",
+		       geo->fat_blks, fat_blks);
+		errors++;
+	}
+	if (geo->root_dir_idx != 1 + geo->fat_blks) {
+		printf("superblock: rdir_blk=%u, expected %u\n",
+		       geo->root_dir_idx, 1 + geo->fat_blks);
+		errors++;
+	}
+	if (geo->data_blk_idx != geo->root_dir_idx + geo->dir_blks) {
+		printf("superblock: data_blk=%u, expected %u\n",
+		       geo->data_blk_idx, geo->root_dir_idx + geo->dir_blks);
+		errors++;
+	}
+	if ((uint64_t)geo->data_blk_idx + geo->total_data_blks != geo->total_blks) {
+		printf("superblock: data_blk_count=%u does not fill the volume\n",
+		       geo->total_data_blks);
+		errors++;
+	}
+
+	/* The rest of the checks index the FAT with these, bail out early */
+	if (errors && (geo->fat_blks < fat_blks ||
+		       geo->dir_blks > INT32_MAX / DIR_BLK_FILES ||
+		       (uint64_t)geo->root_dir_idx + geo->dir_blks >
+		       (uint64_t)block_disk_count() ||
+		       (uint64_t)geo->data_blk_idx + geo->total_data_blks >
+		       (uint64_t)block_disk_count()))
+		die("superblock geometry is unusable");
+
+	return errors;
+}
+
+static uint32_t fnv1a(const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	uint32_t hash = 2166136261u;
+
+	for (size_t i = 0; i < len; i++)
+		hash = (hash ^ p[i]) * 16777619u;
+	return hash;
+}
+
+static uint32_t super_ext_checksum(const struct super_ext *ext)
+{
+	return fnv1a(ext, offsetof(struct super_ext, checksum));
+}
+
+static uint32_t super_ext_checksum_root(void)
+{
+	return fnv1a(img.dir, BLOCK_SIZE);
+}
+
+/*
+ * The saved allocation state is only a hint (libfs recomputes it when it does
+ * not trust it), so a stale one is reported but not counted as an error.
+ */
+static void check_super_ext(uint32_t free_blocks)
+{
+	struct super_ext *ext = &img.super.ext;
+	uint32_t free_roots = 0;
+
+	if (ext->magic != SUPER_EXT_MAGIC) {
+		printf("superblock: no allocation state saved\n");
+		return;
+	}
+	if (ext->version != SUPER_EXT_VERSION ||
+	    ext->checksum != super_ext_checksum(ext)) {
+		printf("superblock: allocation state is corrupted (ignored by libfs)\n");
+		return;
+	}
+	if (!ext->clean) {
+		printf("superblock: volume was not cleanly unmounted\n");
+		return;
+	}
+
+	for (int i = 0; i < img.nfiles; i++)
+		if (img.root[i].filename[0] == '\0')
+			free_roots++;
+	if (ext->root_sum != super_ext_checksum_root())
+		printf("superblock: allocation state saved for another root directory (ignored by libfs)\n");
+	else if (ext->free_blks != free_blocks || ext->free_roots != free_roots)
+		printf("superblock: stale allocation state (free %u/%u, saved %u/%u)\n",
+		       free_blocks, free_roots, ext->free_blks, ext->free_roots);
+}
+
+static int cmp_root_name(const void *a, const void *b)
+{
+	int i = *(const int *)a, j = *(const int *)b;
+	int ret = strcmp(img.root[i].filename, img.root[j].filename);
+
+	return ret ? ret : i - j;
+}
+
+static int check_root(void)
+{
+	int errors = 0, used = 0;
+	int *by_name = malloc(sizeof(int) * img.nfiles);
+
+	if (!by_name)
+		die("Cannot allocate root directory index");
+	for (int i = 0; i < img.nfiles; i++) {
+		struct root_entry *ent = &img.root[i];
+
+		if (ent->filename[0] == '\0')
+			continue;
+		if (memchr(ent->filename, '\0', FS_FILENAME_LEN) == NULL) {
+			printf("root[%d]: filename is not NUL-terminated\n", i);
+			ent->filename[FS_FILENAME_LEN - 1] = '\0';
+			errors++;
+		}
+		by_name[used++] = i;
+	}
+
+	/* Duplicates end up next to each other once sorted by name */
+	qsort(by_name, used, sizeof(int), cmp_root_name);
+	for (int k = 1; k < used; k++) {
+		int i = by_name[k], j = by_name[k - 1];
+
+		if (!strcmp(img.root[j].filename, img.root[i].filename)) {
+			printf("root[%d]: duplicate filename '%s' (root[%d])\n",
+			       i, img.root[i].filename, j);
+			errors++;
+		}
+	}
+	free(by_name);
+	return errors;
+}
+
+/*
+ * In a hashed directory, a file must be found by probing from the block its
+ * name hashes to, through blocks whose overflow count says a file went past
+ * them: recompute the block headers from the entries and compare.
+ */
+static int check_dir_headers(void)
+{
+	uint32_t nblks = img.geo.dir_blks;
+	uint32_t *used, *overflow;
+	int errors = 0;
+
+	if (!img.dir_hashed)
+		return 0;
+	used = calloc(nblks, sizeof(uint32_t));
+	overflow = calloc(nblks, sizeof(uint32_t));
+	if (!used || !overflow)
+		die("Cannot allocate directory headers");
+
+	for (int i = 0; i < img.nfiles; i++) {
+		const char *name = img.root[i].filename;
+		uint32_t blk = i / img.dir_per_blk;
+		uint32_t b;
+
+		if (name[0] == '\0')
+			continue;
+		used[blk]++;
+		for (b = fnv1a(name, strlen(name)) % nblks; b != blk;
+		     b = (b + 1) % nblks)
+			overflow[b]++;
+	}
+
+	for (uint32_t b = 0; b < nblks; b++) {
+		struct dir_header *hdr =
+			(struct dir_header *)(img.dir + (size_t)b * BLOCK_SIZE);
+
+		if (hdr->used != used[b] || hdr->overflow != overflow[b]) {
+			printf("rdir[%u]: header says %u used, %u overflow; "
+			       "expected %u, %u\n", b, hdr->used, hdr->overflow,
+			       used[b], overflow[b]);
+			errors++;
+		}
+	}
+	free(used);
+	free(overflow);
+	return errors;
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t workers[MAX_THREADS];
+	int nthreads, errors = 0;
+	uint32_t used = 0, orphans = 0, free_extents = 0;
+	uint32_t free_run = 0, largest_free = 0, free_blocks = 0;
+	uint32_t shared = 0, shared_refs = 0, *refs;
+	uint32_t frozen_blocks = 0;
+	uint8_t *frozen;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <diskname> [<threads>]\n", argv[0]);
+		exit(2);
+	}
+
+	nthreads = argc > 2 ? atoi(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads < 1)
+		nthreads = 1;
+	if (nthreads > MAX_THREADS)
+		nthreads = MAX_THREADS;
+
+	if (block_disk_open(argv[1]))
+		die("Cannot open diskname");
+
+	if (block_read(0, &img.super))
+		die("Cannot read superblock");
+	errors += check_super();
+
+	img.fat = malloc((size_t)img.geo.fat_blks * BLOCK_SIZE);
+	img.owner = calloc(img.geo.total_data_blks, sizeof(int));
+	if (!img.fat || !img.owner)
+		die("Cannot allocate FAT");
+	if (block_read_range(1, img.geo.fat_blks, img.fat))
+		die("Cannot read FAT");
+
+	/* Entries of a hashed directory follow the header of each block */
+	img.dir_hashed = img.geo.dir_blks > 1;
+	img.dir_per_blk = DIR_BLK_FILES - img.dir_hashed;
+	img.nfiles = img.dir_per_blk * img.geo.dir_blks;
+	img.dir = malloc((size_t)img.geo.dir_blks * BLOCK_SIZE);
+	img.root = malloc(sizeof(struct root_entry) * img.nfiles);
+	img.report = calloc(img.nfiles, sizeof(struct file_report));
+	if (!img.dir || !img.root || !img.report)
+		die("Cannot allocate root directory");
+	if (block_read_range(img.geo.root_dir_idx, img.geo.dir_blks, img.dir))
+		die("Cannot read root directory");
+	for (uint32_t b = 0; b < img.geo.dir_blks; b++)
+		memcpy(&img.root[b * img.dir_per_blk],
+		       img.dir + (size_t)b * BLOCK_SIZE +
+		       img.dir_hashed * sizeof(struct root_entry),
+		       img.dir_per_blk * sizeof(struct root_entry));
+
+	if (fat_get(0) != FAT32_EOC) {
+		printf("fat[0]: reserved entry is %#x, expected end of chain\n",
+		       fat_get(0));
+		errors++;
+	}
+	errors += check_root();
+	errors += check_dir_headers();
+	errors += check_tails();
+
+	/* Shared blocks belong to no chain, the block maps refer to them */
+	refs = calloc(img.geo.total_data_blks, sizeof(uint32_t));
+	frozen = calloc(img.geo.total_data_blks, 1);
+	if (!refs || !frozen)
+		die("Cannot allocate reference counts");
+	errors += check_snapshots(frozen);
+	for (uint32_t b = 1; b < img.geo.total_data_blks; b++)
+		if (fat_refs(b))
+			img.owner[b] = SHARED_OWNER;
+
+	/* Walk every chain, files are handed out to the workers one by one */
+	for (int t = 0; t < nthreads; t++)
+		if (pthread_create(&workers[t], NULL, check_worker, NULL))
+			die("Cannot start worker thread");
+	for (int t = 0; t < nthreads; t++)
+		pthread_join(workers[t], NULL);
+
+	printf("Files:\n");
+	for (int i = 0; i < img.nfiles; i++) {
+		struct root_entry *ent = &img.root[i];
+		struct file_report *r = &img.report[i];
+		uint32_t expect = root_blocks(ent);
+
+		if (ent->filename[0] == '\0')
+			continue;
+
+		if (r->bad_start)
+			printf("%s: first data block %u out of range\n",
+			       ent->filename, root_first(ent));
+		if (r->bad_link)
+			printf("%s: chain breaks after %u blocks\n",
+			       ent->filename, r->blocks);
+		if (r->cycle)
+			printf("%s: chain loops back on itself\n", ent->filename);
+		if (r->cross_link)
+			printf("%s: chain is cross-linked with '%s'\n",
+			       ent->filename, r->cross_with == TAIL_OWNER ? "a tail block" :
+			       r->cross_with == SHARED_OWNER ? "a shared block" :
+			       r->cross_with == SNAP_OWNER ? "a snapshot" :
+			       img.root[r->cross_with].filename);
+		if (ent->flags & ROOT_PACKED) {
+			errors += check_file_errors(i);
+			printf("file: %s, size: %u, packed in tail[%u] at %u\n",
+			       ent->filename, ent->file_size, root_first(ent),
+			       ent->tail_off);
+			continue;
+		}
+		if (!check_file_errors(i) && (ent->flags & ROOT_COMPRESSED)) {
+			if (!(img.super.features & FEAT_COMPRESS))
+				printf("%s: compressed, but the volume has no compression\n",
+				       ent->filename);
+			expect = check_compressed(i);
+			if (!expect) {
+				printf("%s: compressed, but its extent table is invalid\n",
+				       ent->filename);
+				errors++;
+				continue;
+			}
+		}
+		if (!check_file_errors(i) && (ent->flags & ROOT_MAPPED)) {
+			expect = (expect * sizeof(uint32_t) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+			if (r->blocks == expect && check_mapped(i, refs)) {
+				printf("%s: mapped, but its block map is invalid\n",
+				       ent->filename);
+				errors++;
+				continue;
+			}
+		}
+		if (!check_file_errors(i) && r->blocks != expect) {
+			printf("%s: size %llu needs %u blocks, chain has %u\n",
+			       ent->filename, (unsigned long long)root_size(ent),
+			       expect, r->blocks);
+			errors++;
+		}
+		errors += check_file_errors(i);
+
+		printf("file: %s, size: %llu, blocks: %u, extents: %u, avg_run: %.1f%s\n",
+		       ent->filename, (unsigned long long)root_size(ent), r->blocks, r->extents,
+		       r->extents ? (double)r->blocks / r->extents : 0.0,
+		       ent->flags & ROOT_COMPRESSED ? ", compressed" :
+		       ent->flags & ROOT_MAPPED ? ", mapped" : "");
+	}
+
+	block_disk_close();
+
+	for (uint32_t b = 1; b < img.geo.total_data_blks; b++) {
+		if (!fat_refs(b))
+			continue;
+		shared++;
+		shared_refs += refs[b];
+		if (fat_refs(b) != refs[b]) {
+			printf("fat[%u]: shared block has %u references, "
+			       "block maps have %u\n", b, fat_refs(b), refs[b]);
+			errors++;
+		}
+	}
+	free(refs);
+
+	/* Blocks in use but reachable from no file, and free space layout */
+	for (uint32_t b = 1; b < img.geo.total_data_blks; b++) {
+		/* Freed blocks that snapshots still use are not free space */
+		if (fat_get(b) == 0 && frozen[b]) {
+			frozen_blocks++;
+			free_run = 0;
+			continue;
+		}
+		if (fat_get(b) == 0) {
+			free_blocks++;
+			if (free_run++ == 0)
+				free_extents++;
+			if (free_run > largest_free)
+				largest_free = free_run;
+			continue;
+		}
+		free_run = 0;
+		used++;
+		if (!img.owner[b]) {
+			printf("fat[%u]: allocated but not part of any file\n", b);
+			orphans++;
+		}
+	}
+	errors += orphans;
+	check_super_ext(free_blocks);
+
+	printf("Volume:\n");
+	printf("used_blocks=%u\n", used);
+	printf("orphan_blocks=%u\n", orphans);
+	if (shared)
+		printf("shared_blocks=%u (%u references)\n", shared, shared_refs);
+	if (frozen_blocks)
+		printf("snapshot_only_blocks=%u\n", frozen_blocks);
+	printf("free_blocks=%u\n", free_blocks);
+	printf("free_extents=%u\n", free_extents);
+	printf("largest_free_extent=%u\n", largest_free);
+	printf("%s: %d error(s)\n", argv[1], errors);
+
+	free(frozen);
+	free(img.fat);
+	free(img.owner);
+	free(img.dir);
+	free(img.root);
+	free(img.report);
+	return errors ? 1 : 0;
+}
@@ -0,0 +1,138 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <disk.h>
+
+#define die(...)				\
+do {							\
+	fprintf(stderr, __VA_ARGS__);	\
+	fprintf(stderr, "\n");		\
+	exit(1);					\
+} while (0)
+
+/* Blocks read at once, and largest run of a delta */
+#define RUN_MAX 64
+
+/* Start of a delta, as read by fs_apply */
+struct delta_header {
+	char magic[8];		/* "FSDELTA1" */
+	uint32_t base_epoch;	/* epoch the image must be at, 0 for a full image */
+	uint32_t epoch;		/* epoch of the image once the delta is applied */
+	uint64_t bcount;
+} __attribute__((packed));
+
+/* Run of blocks, followed by their contents unless they are all zeros */
+struct delta_run {
+	uint32_t start;
+	uint32_t count;		/* 0 ends the delta */
+	uint32_t zero;
+	uint32_t padding;
+} __attribute__((packed));
+
+static int is_zero(const uint8_t *block)
+{
+	for (size_t i = 0; i < BLOCK_SIZE; i++)
+		if (block[i])
+			return 0;
+	return 1;
+}
+
+/* Write the blocks of @buf starting at @start, split into zero and data runs */
+static size_t emit_runs(FILE *out, size_t start, size_t count, const uint8_t *buf)
+{
+	size_t zeros = 0;
+
+	for (size_t k = 0; k < count;) {
+		int zero = is_zero(buf + k * BLOCK_SIZE);
+		size_t n = 1;
+		struct delta_run run;
+
+		while (k + n < count && is_zero(buf + (k + n) * BLOCK_SIZE) == zero)
+			n++;
+		run.start = start + k;
+		run.count = n;
+		run.zero = zero;
+		run.padding = 0;
+		if (fwrite(&run, sizeof(run), 1, out) != 1 ||
+		    (!zero && fwrite(buf + k * BLOCK_SIZE, BLOCK_SIZE, n, out) != n))
+			die("Cannot write delta");
+		if (zero)
+			zeros += n;
+		k += n;
+	}
+	return zeros;
+}
+
+/*
+ * Write the blocks of a disk image that changed since the last export, then
+ * start a new epoch of changed block tracking. The first export of an image
+ * holds all of it, and starts tracking its changes.
+ */
+int main(int argc, char *argv[])
+{
+	struct delta_header hdr;
+	struct delta_run end = { 0, 0, 0, 0 };
+	uint8_t *buf = malloc(RUN_MAX * BLOCK_SIZE);
+	size_t bcount, changed = 0, zeros = 0;
+	FILE *out;
+	int base, epoch;
+
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s <diskname> <delta file>\n", argv[0]);
+		exit(1);
+	}
+	if (!buf)
+		die("Cannot allocate buffer");
+	if (block_disk_open(argv[1]))
+		die("Cannot open '%s'", argv[1]);
+	bcount = block_disk_count();
+	base = block_epoch();
+
+	out = fopen(argv[2], "wb");
+	if (!out)
+		die("Cannot create '%s'", argv[2]);
+	memcpy(hdr.magic, "FSDELTA1", 8);
+	hdr.base_epoch = base;
+	hdr.epoch = base + 1;
+	hdr.bcount = bcount;
+	if (fwrite(&hdr, sizeof(hdr), 1, out) != 1)
+		die("Cannot write delta");
+
+	/*
+	 * From the end of the disk backwards: data blocks come before the root
+	 * directory, FAT and superblock that point to them, so that a replica
+	 * interrupted while applying the delta does not refer to missing data
+	 */
+	for (size_t e = bcount; e > 0;) {
+		size_t s = e - 1;
+
+		if (!block_changed(s)) {
+			e--;
+			continue;
+		}
+		while (s > 0 && e - s < RUN_MAX && block_changed(s - 1) == 1)
+			s--;
+		if (block_read_range(s, e - s, buf))
+			die("Cannot read blocks %zu to %zu", s, e - 1);
+		zeros += emit_runs(out, s, e - s, buf);
+		changed += e - s;
+		e = s;
+	}
+	if (fwrite(&end, sizeof(end), 1, out) != 1 || fflush(out) ||
+	    fsync(fileno(out)) || fclose(out))
+		die("Cannot write delta");
+
+	/* Only once the delta is safely written can the changes be forgotten */
+	epoch = block_checkpoint(0);
+	if (epoch != base + 1)
+		die("Cannot start a new epoch of '%s'", argv[1]);
+	block_disk_close();
+	free(buf);
+
+	printf("Exported %zu of %zu blocks (%zu zero) of '%s', epoch %d to %d\n",
+	       changed, bcount, zeros, argv[1], base, epoch);
+	return 0;
+}
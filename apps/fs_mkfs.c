@@ -0,0 +1,183 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <disk.h>
+
+#define die(...)				\
+do {							\
+	fprintf(stderr, __VA_ARGS__);	\
+	fprintf(stderr, "\n");		\
+	exit(1);					\
+} while (0)
+
+/* Largest volume the 16-bit fields of an "ECS150FS" superblock can describe */
+#define FAT16_MAX_BLKS 0xffff
+/* Entries in one root directory block */
+#define DIR_BLK_FILES (BLOCK_SIZE / 32)
+/* Optional features of "ECS150FX" volumes */
+#define FEAT_TAILS 0x1
+#define FEAT_COMPRESS 0x2
+#define FEAT_DEDUP 0x4
+
+/*
+ * Superblock fields written by this tool; the allocation state that libfs
+ * saves after them is left zeroed, so the first mount computes it.
+ */
+struct super_head {
+	char signature[8];
+	uint16_t total_blks;
+	uint16_t root_dir_idx;
+	uint16_t data_blk_idx;
+	uint16_t total_data_blks;
+	uint8_t fat_blks;
+	uint8_t ext[28];
+	/* "ECS150FX" only */
+	uint32_t geo_total_blks;
+	uint32_t geo_root_dir_idx;
+	uint32_t geo_data_blk_idx;
+	uint32_t geo_total_data_blks;
+	uint32_t geo_fat_blks;
+	uint32_t geo_dir_blks;
+	uint32_t features;
+} __attribute__((packed));
+
+void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-f 16|32] [-d <files>] [-t] [-c] [-D] [-s] <diskname> "
+		"<data block count>\n", prog);
+	fprintf(stderr, "  -t  pack small files into shared tail blocks\n");
+	fprintf(stderr, "  -c  compress files when they are closed\n");
+	fprintf(stderr, "  -D  store identical data blocks only once\n");
+	fprintf(stderr, "  -s  keep a checksum of every block\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	uint8_t block[BLOCK_SIZE];
+	struct super_head *sb = (struct super_head *)block;
+	int width = 0, checksums = 0, created, opt;
+	uint64_t data_blks, fat_blks, total_blks, files = DIR_BLK_FILES;
+	uint64_t dir_blks = 1;
+	uint32_t features = 0;
+
+	while ((opt = getopt(argc, argv, "f:d:tcDs")) != -1) {
+		if (opt == 'f') {
+			width = atoi(optarg);
+			if (width != 16 && width != 32)
+				usage(argv[0]);
+		} else if (opt == 'd') {
+			files = strtoull(optarg, NULL, 0);
+		} else if (opt == 't') {
+			features |= FEAT_TAILS;
+		} else if (opt == 'c') {
+			features |= FEAT_COMPRESS;
+		} else if (opt == 'D') {
+			features |= FEAT_DEDUP;
+		} else if (opt == 's') {
+			checksums = 1;
+		} else {
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 2)
+		usage(argv[0]);
+
+	data_blks = strtoull(argv[optind + 1], NULL, 0);
+	if (data_blks < 2 || data_blks > INT32_MAX)
+		die("Data block count must be between 2 and %d", INT32_MAX);
+
+	/*
+	 * Larger directories are hashed over several blocks, each of which gives
+	 * up its first entry to a header; only "ECS150FX" volumes have them
+	 */
+	if (files > DIR_BLK_FILES) {
+		dir_blks = (files + DIR_BLK_FILES - 2) / (DIR_BLK_FILES - 1);
+		if (width == 16 || dir_blks > INT32_MAX / DIR_BLK_FILES)
+			die("A directory of %llu files needs a 32-bit FAT volume",
+			    (unsigned long long)files);
+		width = 32;
+	}
+
+	/* Features are unknown to the reference tools */
+	if (features) {
+		if (width == 16)
+			die("Tail packing, compression and deduplication need a 32-bit FAT volume");
+		width = 32;
+	}
+	/* Deduplicated files are stored through a block map of shared blocks */
+	if ((features & FEAT_DEDUP) && (features & (FEAT_TAILS | FEAT_COMPRESS)))
+		die("Deduplication cannot be combined with tail packing or compression");
+
+	/* Without -f, use the original format whenever the volume fits in it */
+	if (!width)
+		width = 2 + (data_blks * 2 + BLOCK_SIZE - 1) / BLOCK_SIZE +
+			data_blks <= FAT16_MAX_BLKS ? 16 : 32;
+	fat_blks = (data_blks * (width / 8) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	total_blks = 1 + fat_blks + dir_blks + data_blks;
+	if (width == 16 && (total_blks > FAT16_MAX_BLKS || fat_blks > UINT8_MAX))
+		die("%llu data blocks do not fit a 16-bit FAT, use -f 32",
+		    (unsigned long long)data_blks);
+
+	/* Sparse image: the data area and FAT stay holes until written */
+	created = block_disk_create(argv[optind], total_blks,
+				    checksums ? BLOCK_CREATE_SUMS : 0);
+	if (created < 0)
+		die("Cannot create '%s'", argv[optind]);
+
+	/* Striped disks come in whole stripes, the rest goes to data blocks */
+	if ((uint64_t)created > total_blks) {
+		data_blks += created - total_blks;
+		fat_blks = (data_blks * (width / 8) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		data_blks = created - 1 - fat_blks - dir_blks;
+		total_blks = created;
+		if (width == 16 && (total_blks > FAT16_MAX_BLKS || fat_blks > UINT8_MAX))
+			die("%llu blocks do not fit a 16-bit FAT, use -f 32",
+			    (unsigned long long)total_blks);
+	}
+	if (block_disk_open(argv[optind]))
+		die("Cannot open '%s'", argv[optind]);
+
+	memset(block, 0, BLOCK_SIZE);
+	if (width == 16) {
+		memcpy(sb->signature, "ECS150FS", 8);
+		sb->total_blks = total_blks;
+		sb->root_dir_idx = 1 + fat_blks;
+		sb->data_blk_idx = 2 + fat_blks;
+		sb->total_data_blks = data_blks;
+		sb->fat_blks = fat_blks;
+	} else {
+		memcpy(sb->signature, "ECS150FX", 8);
+		sb->geo_total_blks = total_blks;
+		sb->geo_root_dir_idx = 1 + fat_blks;
+		sb->geo_data_blk_idx = 1 + fat_blks + dir_blks;
+		sb->geo_total_data_blks = data_blks;
+		sb->geo_fat_blks = fat_blks;
+		sb->geo_dir_blks = dir_blks;
+		sb->features = features;
+	}
+	if (block_write(0, block))
+		die("Cannot write superblock");
+
+	/* FAT entry 0 is reserved and holds the end of chain marker */
+	memset(block, 0, BLOCK_SIZE);
+	memset(block, 0xff, width / 8);
+	if (block_write(1, block))
+		die("Cannot write FAT");
+
+	/* Empty root directory */
+	memset(block, 0, BLOCK_SIZE);
+	for (uint64_t i = 0; i < dir_blks; i++)
+		if (block_write(1 + fat_blks + i, block))
+			die("Cannot write root directory");
+
+	block_disk_close();
+	printf("Created %s volume '%s' with %llu data blocks and room for %llu files\n",
+	       width == 16 ? "ECS150FS" : "ECS150FX", argv[optind],
+	       (unsigned long long)data_blks,
+	       (unsigned long long)(dir_blks > 1 ? dir_blks * (DIR_BLK_FILES - 1) : DIR_BLK_FILES));
+	return 0;
+}
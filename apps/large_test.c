@@ -0,0 +1,118 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <fs.h>
+
+#define ASSERT(cond, func)                               \
+do {                                                     \
+	if (!(cond)) {                                       \
+		fprintf(stderr, "Function '%s' failed\n", func); \
+		exit(EXIT_FAILURE);                              \
+	}                                                    \
+} while (0)
+
+#define MiB (1024 * 1024L)
+#define LEN (2560 * MiB + 100)	/* more than an int can count */
+#define STEP (256 * MiB)	/* distance between markers */
+
+/* Put a marker every STEP bytes of a buffer of zeros, which takes no memory */
+static char *make_buf(char tag)
+{
+	char *buf = mmap(NULL, LEN, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	ASSERT(buf != MAP_FAILED, "mmap");
+	for (long off = 0; off < LEN; off += STEP)
+		snprintf(buf + off, 32, "%c%ld", tag, off);
+	return buf;
+}
+
+static void check_marker(int fd, off_t at, char tag, long off)
+{
+	char want[32], got[32];
+
+	snprintf(want, sizeof(want), "%c%ld", tag, off);
+	ASSERT(fs_pread64(fd, got, sizeof(got), at) == sizeof(got), "fs_pread64");
+	ASSERT(!strcmp(got, want), "fs_pread64");
+}
+
+/*
+ * Grow a file beyond 4 GiB with two single calls, on a 32-bit FAT volume
+ * of at least 1.4 million blocks, such as `fs_mkfs.x -f 32 big.fs 1400000`:
+ * sizes and offsets must keep their upper bits, also once remounted or
+ * cloned, and the int calls must stop short instead of overflowing.
+ */
+int main(int argc, char *argv[])
+{
+	char *a, *b, small[64];
+	off_t size = 2 * (off_t)LEN;
+	int fd;
+
+	if (argc < 2) {
+		printf("Usage: %s <diskimage>\n", argv[0]);
+		exit(1);
+	}
+	a = make_buf('a');
+	b = make_buf('b');
+
+	ASSERT(!fs_mount(argv[1]), "fs_mount");
+	ASSERT(!fs_create("large"), "fs_create");
+	fd = fs_open("large");
+	ASSERT(fd >= 0, "fs_open");
+	ASSERT(fs_write64(fd, a, LEN) == LEN, "fs_write64");
+	ASSERT(fs_stat64(fd) == LEN && fs_stat(fd) == -1, "fs_stat64");
+	ASSERT(fs_write64(fd, b, LEN) == LEN, "fs_write64");
+	ASSERT(fs_stat64(fd) == size, "fs_stat64");
+	ASSERT(!fs_close(fd), "fs_close");
+	ASSERT(!fs_umount(), "fs_umount");
+
+	/* The size survives unmounting, past 4 GiB */
+	ASSERT(!fs_mount(argv[1]), "fs_mount");
+	fd = fs_open("large");
+	ASSERT(fd >= 0, "fs_open");
+	ASSERT(fs_stat64(fd) == size, "fs_stat64");
+	for (long off = 0; off < LEN; off += STEP) {
+		check_marker(fd, off, 'a', off);
+		check_marker(fd, LEN + off, 'b', off);
+	}
+
+	/* Offsets past 4 GiB, through the descriptor */
+	ASSERT(!fs_lseek64(fd, size - 50), "fs_lseek64");
+	ASSERT(fs_read64(fd, small, sizeof(small)) == 50, "fs_read64");
+	ASSERT(fs_lseek64(fd, size + 1) == -1 && fs_lseek64(fd, -1) == -1, "fs_lseek64");
+	ASSERT(fs_pwrite64(fd, "tail", 4, size) == 4, "fs_pwrite64");
+	ASSERT(fs_pread64(fd, small, 10, size - 2) == 6, "fs_pread64");
+	ASSERT(!memcmp(small + 2, "tail", 4), "fs_pread64");
+	size += 4;
+
+	/* The int calls stop before their count overflows */
+	ASSERT(fs_pwrite(fd, a, LEN, 0) == 0x7ffff000, "fs_pwrite");
+	ASSERT(fs_pread(fd, small, 10, (size_t)size - 10) == 10, "fs_pread");
+	ASSERT(!memcmp(small + 6, "tail", 4), "fs_pread");
+	check_marker(fd, 7 * STEP, 'a', 7 * STEP);
+	check_marker(fd, 8 * STEP, 'a', 8 * STEP);
+	ASSERT(fs_pread64(fd, a, 10, -1) == -1, "fs_pread64");
+	ASSERT(!fs_close(fd), "fs_close");
+
+	/* A clone gets all of it */
+	ASSERT(!fs_clone("large", "copy"), "fs_clone");
+	fd = fs_open("copy");
+	ASSERT(fd >= 0, "fs_open");
+	ASSERT(fs_stat64(fd) == size, "fs_stat64");
+	check_marker(fd, 8 * STEP, 'a', 8 * STEP);
+	check_marker(fd, LEN + 9 * STEP, 'b', 9 * STEP);
+	ASSERT(fs_pread64(fd, small, 10, size - 10) == 10, "fs_pread64");
+	ASSERT(!memcmp(small + 6, "tail", 4), "fs_pread64");
+	ASSERT(!fs_close(fd), "fs_close");
+	ASSERT(!fs_delete("copy"), "fs_delete");
+	ASSERT(!fs_delete("large"), "fs_delete");
+	ASSERT(!fs_umount(), "fs_umount");
+
+	munmap(a, LEN);
+	munmap(b, LEN);
+	printf("large_test: all checks passed\n");
+	return 0;
+}
@@ -0,0 +1,148 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+#define ASSERT(cond, func)                               \
+do {                                                     \
+	if (!(cond)) {                                       \
+		fprintf(stderr, "Function '%s' failed\n", func); \
+		exit(EXIT_FAILURE);                              \
+	}                                                    \
+} while (0)
+
+#define BLK 4096
+#define BLOCKS 12
+#define LEN (BLOCKS * BLK)
+#define SMALL 300
+
+#define FEAT_TAILS 0x1
+#define FEAT_COMPRESS 0x2
+#define FEAT_DEDUP 0x4
+
+/* Start of the superblock, as far as the features of the volume */
+struct super_start {
+	char signature[8];
+	uint16_t counts[4];
+	uint8_t fat_blks;
+	uint8_t ext[28];
+	uint8_t geo[24];
+	uint32_t features;
+} __attribute__((packed));
+
+/* Features of the volume in image file @diskname, -1 if it holds none */
+static int volume_features(const char *diskname)
+{
+	struct super_start super;
+	int fd = open(diskname, O_RDONLY), features = -1;
+
+	if (fd < 0)
+		return -1;
+	if (pread(fd, &super, sizeof(super), 0) == sizeof(super)) {
+		if (!memcmp(super.signature, "ECS150FX", 8))
+			features = super.features;
+		else if (!memcmp(super.signature, "ECS150FS", 8))
+			features = 0;
+	}
+	close(fd);
+	return features;
+}
+
+/*
+ * Map a file whose blocks are interleaved with another one's, and a small
+ * file, on a volume of any format: the mappings must show the files as
+ * written. What they show later depends on the format: the first file is
+ * defragmented and mapped from the image, where it sees later writes unless
+ * they go to new blocks, as they do on a deduplicating volume. The small one
+ * is copied if it is packed, and keeps what it held. Closing a file on a
+ * compressing volume moves its blocks, so its mapping is then only known to
+ * stay valid.
+ */
+int main(int argc, char *argv[])
+{
+	char *data = malloc(LEN), *shown = malloc(LEN), *p, *q;
+	int fd, other, features, image, small_image;
+
+	if (argc < 2) {
+		printf("Usage: %s <image file of a volume>\n", argv[0]);
+		exit(1);
+	}
+	for (int i = 0; i < LEN; i++)
+		data[i] = 'a' + (i * 11 + i / BLK) % 26;
+	features = volume_features(argv[1]);
+	ASSERT(features != -1, "volume_features");
+	image = !(features & FEAT_DEDUP);
+	small_image = !(features & FEAT_TAILS);
+
+	ASSERT(!fs_mount(argv[1]), "fs_mount");
+	ASSERT(!fs_create("mapped") && !fs_create("other"), "fs_create");
+	fd = fs_open("mapped");
+	other = fs_open("other");
+	ASSERT(fd >= 0 && other >= 0, "fs_open");
+	for (int b = 0; b < BLOCKS; b++) {
+		ASSERT(fs_write(fd, data + b * BLK, BLK) == BLK, "fs_write");
+		ASSERT(fs_write(other, data, BLK) == BLK, "fs_write");
+	}
+	ASSERT(!fs_close(other), "fs_close");
+
+	/* Out of the image once the file is in one piece, or a copy */
+	p = fs_mmap(fd, 100, LEN - 200);
+	ASSERT(p, "fs_mmap");
+	ASSERT(!memcmp(p, data + 100, LEN - 200), "fs_mmap");
+	ASSERT(fs_pwrite(fd, "XYZ", 3, 5 * BLK) == 3, "fs_pwrite");
+	ASSERT(!fs_sync(), "fs_sync");
+	memcpy(shown, data, LEN);
+	memcpy(data + 5 * BLK, "XYZ", 3);
+	if (image)
+		memcpy(shown + 5 * BLK, "XYZ", 3);
+	ASSERT(!memcmp(p, shown + 100, LEN - 200), "fs_mmap");
+
+	/* A second mapping of part of it, not on a block boundary */
+	q = fs_mmap(fd, 3 * BLK + 7, 2 * BLK);
+	ASSERT(q, "fs_mmap");
+	ASSERT(!memcmp(q, data + 3 * BLK + 7, 2 * BLK), "fs_mmap");
+	ASSERT(!fs_munmap(q, 2 * BLK), "fs_munmap");
+
+	/* Ranges outside the file, and stale descriptors */
+	ASSERT(!fs_mmap(fd, 0, 0), "fs_mmap");
+	ASSERT(!fs_mmap(fd, LEN - 10, 11), "fs_mmap");
+	ASSERT(!fs_mmap(fd, -1, 10), "fs_mmap");
+	ASSERT(!fs_close(fd), "fs_close");
+	ASSERT(!fs_mmap(fd, 0, 10), "fs_mmap");
+	ASSERT(fs_munmap(NULL, 10) == -1, "fs_munmap");
+
+	/* A small file, copied if it is packed */
+	ASSERT(!fs_create("small"), "fs_create");
+	fd = fs_open("small");
+	ASSERT(fd >= 0, "fs_open");
+	ASSERT(fs_write(fd, data, SMALL) == SMALL, "fs_write");
+	ASSERT(!fs_close(fd), "fs_close");
+	fd = fs_open("small");
+	ASSERT(fd >= 0, "fs_open");
+	q = fs_mmap(fd, 10, SMALL - 10);
+	ASSERT(q, "fs_mmap");
+	ASSERT(!memcmp(q, data + 10, SMALL - 10), "fs_mmap");
+	ASSERT(fs_pwrite(fd, "XYZ", 3, 20) == 3, "fs_pwrite");
+	if (!small_image)
+		ASSERT(!memcmp(q, data + 10, SMALL - 10), "fs_mmap");
+	ASSERT(!fs_close(fd), "fs_close");
+
+	/* Mappings outlive the file system */
+	ASSERT(!fs_umount(), "fs_umount");
+	if (!image || !(features & FEAT_COMPRESS))
+		ASSERT(!memcmp(p, shown + 100, LEN - 200), "fs_mmap");
+	if (small_image)
+		memcpy(data + 20, "XYZ", 3);
+	ASSERT(!memcmp(q, data + 10, SMALL - 10), "fs_mmap");
+	ASSERT(!fs_munmap(p, LEN - 200), "fs_munmap");
+	ASSERT(!fs_munmap(q, SMALL - 10), "fs_munmap");
+
+	free(data);
+	free(shown);
+	printf("mmap_test: all checks passed\n");
+	return 0;
+}
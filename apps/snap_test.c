@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fs.h>
+
+#define ASSERT(cond, func)                               \
+do {                                                     \
+	if (!(cond)) {                                       \
+		fprintf(stderr, "Function '%s' failed\n", func); \
+		exit(EXIT_FAILURE);                              \
+	}                                                    \
+} while (0)
+
+#define BLK 4096
+#define BIG_LEN (5 * BLK + 321)
+#define SMALL_LEN 200
+
+static void write_file(const char *name, const char *data, int len)
+{
+	int fd;
+
+	ASSERT(!fs_create(name), "fs_create");
+	fd = fs_open(name);
+	ASSERT(fd >= 0, "fs_open");
+	ASSERT(fs_write(fd, (void *)data, len) == len, "fs_write");
+	fs_close(fd);
+}
+
+static void check_contents(const char *name, const char *data, int len)
+{
+	char *check = malloc(len + 1);
+	int fd = fs_open(name);
+
+	ASSERT(fd >= 0, "fs_open");
+	ASSERT(fs_stat(fd) == len, "fs_stat");
+	ASSERT(fs_read(fd, check, len + 1) == len, "fs_read");
+	ASSERT(!memcmp(check, data, len), "fs_read");
+	fs_close(fd);
+	free(check);
+}
+
+/*
+ * Take a snapshot, then overwrite, extend, delete and create files: the
+ * snapshot must still read as the volume was, and the volume as it is now.
+ * Works on any 32-bit FAT volume, with or without tail packing, compression
+ * or deduplication.
+ */
+int main(int argc, char *argv[])
+{
+	char *big = malloc(BIG_LEN), *big2 = malloc(BIG_LEN + BLK);
+	char small[SMALL_LEN], other[SMALL_LEN];
+	int fd;
+
+	if (argc < 2) {
+		printf("Usage: %s <diskimage>\n", argv[0]);
+		exit(1);
+	}
+	for (int i = 0; i < BIG_LEN; i++)
+		big[i] = 'a' + (i * 13 + i / BLK) % 26;
+	for (int i = 0; i < SMALL_LEN; i++) {
+		small[i] = '0' + i % 10;
+		other[i] = 'z' - i % 26;
+	}
+
+	ASSERT(!fs_mount(argv[1]), "fs_mount");
+	write_file("big", big, BIG_LEN);
+	write_file("small", small, SMALL_LEN);
+	write_file("gone", other, SMALL_LEN);
+	ASSERT(!fs_snapshot("before"), "fs_snapshot");
+	ASSERT(fs_snapshot("before") == -1, "fs_snapshot");
+	ASSERT(fs_snapshot("") == -1, "fs_snapshot");
+	ASSERT(fs_defrag(NULL) == -1, "fs_defrag");
+
+	/* Change every file in a different way */
+	memcpy(big2, big, BIG_LEN);
+	memcpy(big2 + BLK - 2, "changed", 7);
+	memset(big2 + BIG_LEN, 'q', BLK);
+	fd = fs_open("big");
+	ASSERT(fd >= 0, "fs_open");
+	ASSERT(!fs_lseek(fd, BLK - 2), "fs_lseek");
+	ASSERT(fs_write(fd, "changed", 7) == 7, "fs_write");
+	ASSERT(!fs_lseek(fd, BIG_LEN), "fs_lseek");
+	ASSERT(fs_write(fd, big2 + BIG_LEN, BLK) == BLK, "fs_write");
+	fs_close(fd);
+	fd = fs_open("small");
+	ASSERT(fd >= 0, "fs_open");
+	ASSERT(fs_write(fd, other, 10) == 10, "fs_write");
+	fs_close(fd);
+	memcpy(small, other, 10);
+	ASSERT(!fs_delete("gone"), "fs_delete");
+	write_file("new", other, SMALL_LEN);
+	ASSERT(!fs_snapshot("after"), "fs_snapshot");
+	ASSERT(!fs_umount(), "fs_umount");
+
+	/* The snapshot is the volume before the changes, and read-only */
+	ASSERT(fs_mount_snapshot(argv[1], "none") == -1, "fs_mount_snapshot");
+	ASSERT(!fs_mount_snapshot(argv[1], "before"), "fs_mount_snapshot");
+	check_contents("big", big, BIG_LEN);
+	memcpy(small, "0123456789", 10);
+	check_contents("small", small, SMALL_LEN);
+	check_contents("gone", other, SMALL_LEN);
+	ASSERT(fs_open("new") == -1, "fs_open");
+	ASSERT(fs_create("new") == -1, "fs_create");
+	ASSERT(fs_delete("big") == -1, "fs_delete");
+	fd = fs_open("big");
+	ASSERT(fd >= 0, "fs_open");
+	ASSERT(fs_write(fd, "x", 1) == -1, "fs_write");
+	fs_close(fd);
+	ASSERT(!fs_umount(), "fs_umount");
+
+	/* Deleting it leaves the volume and the other snapshot alone */
+	memcpy(small, other, 10);
+	ASSERT(!fs_mount(argv[1]), "fs_mount");
+	check_contents("big", big2, BIG_LEN + BLK);
+	check_contents("small", small, SMALL_LEN);
+	check_contents("new", other, SMALL_LEN);
+	ASSERT(fs_open("gone") == -1, "fs_open");
+	ASSERT(!fs_snapshot_delete("before"), "fs_snapshot_delete");
+	ASSERT(fs_snapshot_delete("before") == -1, "fs_snapshot_delete");
+	ASSERT(!fs_delete("big"), "fs_delete");
+	ASSERT(!fs_umount(), "fs_umount");
+
+	ASSERT(!fs_mount_snapshot(argv[1], "after"), "fs_mount_snapshot");
+	check_contents("big", big2, BIG_LEN + BLK);
+	check_contents("new", other, SMALL_LEN);
+	ASSERT(!fs_umount(), "fs_umount");
+
+	/* Without snapshots, everything can be freed again */
+	ASSERT(!fs_mount(argv[1]), "fs_mount");
+	ASSERT(!fs_snapshot_delete("after"), "fs_snapshot_delete");
+	ASSERT(!fs_delete("small"), "fs_delete");
+	ASSERT(!fs_delete("new"), "fs_delete");
+	ASSERT(!fs_defrag(NULL), "fs_defrag");
+	ASSERT(!fs_umount(), "fs_umount");
+
+	free(big);
+	free(big2);
+	printf("snap_test: all checks passed\n");
+	return 0;
+}
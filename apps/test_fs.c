@@ -1,6 +1,9 @@
 #include <assert.h>
+#include <dirent.h>
 #include <fcntl.h>
+#include <libgen.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,6 +12,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <disk.h>
 #include <fs.h>
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
@@ -34,6 +38,211 @@ struct thread_arg {
 	char **argv;
 };
 
+/*
+ * Mount <disk>, or snapshot <name> of it (read-only) when given as
+ * <disk>@<name> and there is no file with that whole name.
+ */
+int mount_disk(const char *diskname)
+{
+	char path[PATH_MAX];
+	char *at = strrchr(diskname, '@');
+
+	if (!at || !access(diskname, F_OK) || at - diskname >= PATH_MAX)
+		return fs_mount(diskname);
+	memcpy(path, diskname, at - diskname);
+	path[at - diskname] = '\0';
+	return fs_mount_snapshot(path, at + 1);
+}
+
+/*
+ * Bounded transfer ring shared by a host-side thread and the thread driving
+ * libfs (which is not thread-safe, so only one side ever calls fs_*()). Slots
+ * are filled in place by the producer and drained in place by the consumer,
+ * so a transfer never holds more than XFER_SLOTS * XFER_CHUNK bytes.
+ */
+#define XFER_CHUNK	(64 * 1024)
+#define XFER_SLOTS	4
+
+enum xfer_kind {
+	XFER_FILE,	/* start of a new file: name and total size */
+	XFER_DATA,	/* next chunk of the current file */
+	XFER_END	/* no more files */
+};
+
+struct xfer_slot {
+	enum xfer_kind kind;
+	char name[FS_FILENAME_LEN];
+	size_t len;
+	char data[XFER_CHUNK];
+};
+
+struct xfer_ring {
+	struct xfer_slot slots[XFER_SLOTS];
+	int head, tail, count;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty, not_full;
+};
+
+void xfer_init(struct xfer_ring *ring)
+{
+	ring->head = ring->tail = ring->count = 0;
+	pthread_mutex_init(&ring->lock, NULL);
+	pthread_cond_init(&ring->not_empty, NULL);
+	pthread_cond_init(&ring->not_full, NULL);
+}
+
+void xfer_destroy(struct xfer_ring *ring)
+{
+	pthread_mutex_destroy(&ring->lock);
+	pthread_cond_destroy(&ring->not_empty);
+	pthread_cond_destroy(&ring->not_full);
+}
+
+/* Producer: wait for a free slot to fill */
+struct xfer_slot *xfer_reserve(struct xfer_ring *ring)
+{
+	pthread_mutex_lock(&ring->lock);
+	while (ring->count == XFER_SLOTS)
+		pthread_cond_wait(&ring->not_full, &ring->lock);
+	pthread_mutex_unlock(&ring->lock);
+	return &ring->slots[ring->tail];
+}
+
+/* Producer: hand the reserved slot over to the consumer */
+void xfer_commit(struct xfer_ring *ring)
+{
+	pthread_mutex_lock(&ring->lock);
+	ring->tail = (ring->tail + 1) % XFER_SLOTS;
+	ring->count++;
+	pthread_cond_signal(&ring->not_empty);
+	pthread_mutex_unlock(&ring->lock);
+}
+
+/* Consumer: wait for the next filled slot */
+struct xfer_slot *xfer_peek(struct xfer_ring *ring)
+{
+	pthread_mutex_lock(&ring->lock);
+	while (ring->count == 0)
+		pthread_cond_wait(&ring->not_empty, &ring->lock);
+	pthread_mutex_unlock(&ring->lock);
+	return &ring->slots[ring->head];
+}
+
+/* Consumer: give the drained slot back to the producer */
+void xfer_release(struct xfer_ring *ring)
+{
+	pthread_mutex_lock(&ring->lock);
+	ring->head = (ring->head + 1) % XFER_SLOTS;
+	ring->count--;
+	pthread_cond_signal(&ring->not_full);
+	pthread_mutex_unlock(&ring->lock);
+}
+
+void xfer_send_file(struct xfer_ring *ring, const char *name, size_t size)
+{
+	struct xfer_slot *slot = xfer_reserve(ring);
+
+	slot->kind = XFER_FILE;
+	memset(slot->name, 0, FS_FILENAME_LEN);
+	strncpy(slot->name, name, FS_FILENAME_LEN - 1);
+	slot->len = size;
+	xfer_commit(ring);
+}
+
+void xfer_send_end(struct xfer_ring *ring)
+{
+	struct xfer_slot *slot = xfer_reserve(ring);
+
+	slot->kind = XFER_END;
+	slot->len = 0;
+	xfer_commit(ring);
+}
+
+size_t get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret == LONG_MIN || ret == LONG_MAX)
+		die_perror("strtol");
+	return (size_t)ret;
+}
+
+/* Read exactly @len bytes from @fd unless EOF comes first */
+ssize_t read_full(int fd, void *buf, size_t len)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t n = read(fd, (char *)buf + done, len - done);
+		if (n < 0)
+			return -1;
+		if (n == 0)
+			break;
+		done += n;
+	}
+	return done;
+}
+
+int write_full(int fd, const void *buf, size_t len)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t n = write(fd, (const char *)buf + done, len - done);
+		if (n < 0)
+			return -1;
+		done += n;
+	}
+	return 0;
+}
+
+/*
+ * Minimal ustar support for import/export streams: only regular files are
+ * transferred, everything else in an incoming archive is skipped.
+ */
+#define TAR_BLOCK 512
+
+struct tar_header {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char pad[12];
+};
+
+void tar_fill_header(struct tar_header *hdr, const char *name, size_t size)
+{
+	unsigned int sum = 0;
+	unsigned char *p = (unsigned char *)hdr;
+
+	memset(hdr, 0, sizeof(*hdr));
+	strncpy(hdr->name, name, sizeof(hdr->name) - 1);
+	snprintf(hdr->mode, sizeof(hdr->mode), "%07o", 0644);
+	snprintf(hdr->uid, sizeof(hdr->uid), "%07o", 0);
+	snprintf(hdr->gid, sizeof(hdr->gid), "%07o", 0);
+	snprintf(hdr->size, sizeof(hdr->size), "%011zo", size);
+	snprintf(hdr->mtime, sizeof(hdr->mtime), "%011o", 0);
+	hdr->typeflag = '0';
+	memcpy(hdr->magic, "ustar", 6);
+	memcpy(hdr->version, "00", 2);
+
+	memset(hdr->chksum, ' ', sizeof(hdr->chksum));
+	for (size_t i = 0; i < sizeof(*hdr); i++)
+		sum += p[i];
+	snprintf(hdr->chksum, sizeof(hdr->chksum), "%06o", sum);
+}
+
 void thread_fs_script(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -87,7 +296,7 @@ void thread_fs_script(void *arg)
 			break;
 
 		if (strcmp(command, "MOUNT") == 0) {
-			if (fs_mount(diskname))
+			if (mount_disk(diskname))
 				die("Cannot mount disk");
 			else {
 				printf("MOUNT successful.\n");
@@ -282,7 +491,7 @@ void thread_fs_stat(void *arg)
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
 
-	if (fs_mount(diskname))
+	if (mount_disk(diskname))
 		die("Cannot mount diskname");
 
 	fs_fd = fs_open(filename);
@@ -316,20 +525,41 @@ void thread_fs_stat(void *arg)
 	printf("Size of file '%s' is %d bytes\n", filename, stat);
 }
 
+/* Drain DATA slots to stdout while the libfs side reads the next chunk */
+void *cat_consumer(void *arg)
+{
+	struct xfer_ring *ring = arg;
+
+	for (;;) {
+		struct xfer_slot *slot = xfer_peek(ring);
+		enum xfer_kind kind = slot->kind;
+
+		if (kind == XFER_DATA && write_full(STDOUT_FILENO, slot->data, slot->len))
+			die_perror("write");
+		xfer_release(ring);
+		if (kind == XFER_END)
+			break;
+	}
+	return NULL;
+}
+
 void thread_fs_cat(void *arg)
 {
 	struct thread_arg *t_arg = arg;
-	char *diskname, *filename, *buf;
+	char *diskname, *filename;
+	struct xfer_ring *ring;
+	pthread_t consumer;
 	int fs_fd;
-	int stat, read;
+	off_t stat;
+	size_t offset = 0, len, read = 0;
 
 	if (t_arg->argc < 2)
-		die("need <diskname> <filename>");
+		die("need <diskname> <filename> [<offset> [<len>]]");
 
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
 
-	if (fs_mount(diskname))
+	if (mount_disk(diskname))
 		die("Cannot mount diskname");
 
 	fs_fd = fs_open(filename);
@@ -338,24 +568,61 @@ void thread_fs_cat(void *arg)
 		die("Cannot open file");
 	}
 
-	stat = fs_stat(fs_fd);
+	stat = fs_stat64(fs_fd);
 	if (stat < 0) {
 		fs_umount();
 		die("Cannot stat file");
 	}
 	if (!stat) {
+		fs_close(fs_fd);
+		fs_umount();
 		/* Nothing to read, file is empty */
 		printf("Empty file\n");
 		return;
 	}
-	buf = malloc(stat);
-	if (!buf) {
-		perror("malloc");
+
+	/* Optional byte range, defaulting to the whole file */
+	if (t_arg->argc > 2)
+		offset = get_argv(t_arg->argv[2]);
+	len = stat - (offset < (size_t)stat ? offset : (size_t)stat);
+	if (t_arg->argc > 3 && get_argv(t_arg->argv[3]) < len)
+		len = get_argv(t_arg->argv[3]);
+	if (fs_lseek64(fs_fd, offset)) {
+		fs_close(fs_fd);
 		fs_umount();
-		die("Cannot malloc");
+		die("Cannot seek to offset %zu", offset);
+	}
+
+	printf("Read file '%s' (%zu/%lld bytes)\n", filename, len, (long long)stat);
+	printf("Content of the file:\n");
+	fflush(stdout);
+
+	/* Stream the range in fixed-size chunks: memory use does not depend on
+	 * the file size and output starts as soon as the first chunk is read */
+	ring = malloc(sizeof(*ring));
+	if (!ring)
+		die_perror("malloc");
+	xfer_init(ring);
+	if (pthread_create(&consumer, NULL, cat_consumer, ring))
+		die("Cannot start output thread");
+
+	while (read < len) {
+		struct xfer_slot *slot = xfer_reserve(ring);
+		size_t want = len - read < XFER_CHUNK ? len - read : XFER_CHUNK;
+		ssize_t n = fs_read64(fs_fd, slot->data, want);
+
+		if (n <= 0)
+			break;
+		slot->kind = XFER_DATA;
+		slot->len = n;
+		xfer_commit(ring);
+		read += n;
 	}
+	xfer_send_end(ring);
+	pthread_join(consumer, NULL);
 
-	read = fs_read(fs_fd, buf, stat);
+	xfer_destroy(ring);
+	free(ring);
 
 	if (fs_close(fs_fd)) {
 		fs_umount();
@@ -365,12 +632,8 @@ void thread_fs_cat(void *arg)
 	if (fs_umount())
 		die("cannot unmount diskname");
 
-	printf("Read file '%s' (%d/%d bytes)\n", filename, read, stat);
-	printf("Content of the file:\n");
-	fwrite(buf, 1, stat, stdout);
-	fflush(stdout);
-
-	free(buf);
+	if (read != len)
+		die("Short read (%zu/%zu bytes)", read, len);
 }
 
 void thread_fs_rm(void *arg)
@@ -384,7 +647,7 @@ void thread_fs_rm(void *arg)
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
 
-	if (fs_mount(diskname))
+	if (mount_disk(diskname))
 		die("Cannot mount diskname");
 
 	if (fs_delete(filename)) {
@@ -398,13 +661,89 @@ void thread_fs_rm(void *arg)
 	printf("Removed file '%s'\n", filename);
 }
 
+void thread_fs_cp(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *src, *dst;
+
+	if (t_arg->argc < 3)
+		die("need <diskname> <filename> <new filename>");
+
+	diskname = t_arg->argv[0];
+	src = t_arg->argv[1];
+	dst = t_arg->argv[2];
+
+	if (mount_disk(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_clone(src, dst)) {
+		fs_umount();
+		die("Cannot copy file");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Copied file '%s' to '%s'\n", src, dst);
+}
+
+void thread_fs_snap(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *name;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <snapshot>");
+
+	diskname = t_arg->argv[0];
+	name = t_arg->argv[1];
+
+	if (mount_disk(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_snapshot(name)) {
+		fs_umount();
+		die("Cannot take snapshot");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Took snapshot '%s'\n", name);
+}
+
+void thread_fs_rmsnap(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *name;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <snapshot>");
+
+	diskname = t_arg->argv[0];
+	name = t_arg->argv[1];
+
+	if (mount_disk(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_snapshot_delete(name)) {
+		fs_umount();
+		die("Cannot delete snapshot");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Removed snapshot '%s'\n", name);
+}
+
 void thread_fs_add(void *arg)
 {
 	struct thread_arg *t_arg = arg;
 	char *diskname, *filename, *buf;
 	int fd, fs_fd;
 	struct stat st;
-	int written;
+	ssize_t written;
 
 	if (t_arg->argc < 2)
 		die("Usage: <diskname> <host filename>");
@@ -430,7 +769,7 @@ void thread_fs_add(void *arg)
 	 * - mount, create a new file, copy content of host file into this new
 	 *   file, close the new file, and umount
 	 */
-	if (fs_mount(diskname))
+	if (mount_disk(diskname))
 		die("Cannot mount diskname");
 
 	if (fs_create(filename)) {
@@ -444,7 +783,8 @@ void thread_fs_add(void *arg)
 		die("Cannot open file");
 	}
 
-	written = fs_write(fs_fd, buf, st.st_size);
+	/* One call, however large the file */
+	written = fs_write64(fs_fd, buf, st.st_size);
 
 	if (fs_close(fs_fd)) {
 		fs_umount();
@@ -454,13 +794,426 @@ void thread_fs_add(void *arg)
 	if (fs_umount())
 		die("Cannot unmount diskname");
 
-	printf("Wrote file '%s' (%d/%zu bytes)\n", filename, written,
+	printf("Wrote file '%s' (%zd/%zu bytes)\n", filename, written,
 		   st.st_size);
 
 	munmap(buf, st.st_size);
 	close(fd);
 }
 
+struct import_arg {
+	struct xfer_ring *ring;
+	int argc;
+	char **argv;
+};
+
+/* Stream one host file descriptor into the ring as a FILE record + chunks */
+void import_send_fd(struct xfer_ring *ring, const char *name, int fd,
+					size_t size)
+{
+	size_t left = size;
+
+	xfer_send_file(ring, name, size);
+	while (left > 0) {
+		struct xfer_slot *slot = xfer_reserve(ring);
+		size_t want = left < XFER_CHUNK ? left : XFER_CHUNK;
+		ssize_t n = read_full(fd, slot->data, want);
+
+		if (n <= 0)
+			die("short read on '%s'", name);
+		slot->kind = XFER_DATA;
+		slot->len = n;
+		xfer_commit(ring);
+		left -= n;
+	}
+}
+
+void import_send_path(struct xfer_ring *ring, const char *path)
+{
+	struct stat st;
+	char *copy, *name;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		die_perror("open");
+	if (fstat(fd, &st))
+		die_perror("fstat");
+
+	copy = strdup(path);
+	name = basename(copy);
+	if (strlen(name) >= FS_FILENAME_LEN)
+		die("Filename too long for file system: %s", name);
+
+	import_send_fd(ring, name, fd, st.st_size);
+	free(copy);
+	close(fd);
+}
+
+void import_send_dir(struct xfer_ring *ring, const char *path)
+{
+	DIR *dir = opendir(path);
+	struct dirent *ent;
+	char full[PATH_MAX];
+	struct stat st;
+
+	if (!dir)
+		die_perror("opendir");
+
+	while ((ent = readdir(dir)) != NULL) {
+		snprintf(full, sizeof(full), "%s/%s", path, ent->d_name);
+		if (stat(full, &st) || !S_ISREG(st.st_mode))
+			continue;
+		import_send_path(ring, full);
+	}
+	closedir(dir);
+}
+
+void import_send_tar(struct xfer_ring *ring, int fd)
+{
+	struct tar_header hdr;
+	char skip[TAR_BLOCK];
+
+	while (read_full(fd, &hdr, TAR_BLOCK) == TAR_BLOCK) {
+		size_t size, pad;
+		char *name;
+
+		/* Two zero blocks mark the end of the archive */
+		if (hdr.name[0] == '\0')
+			break;
+
+		size = strtoul(hdr.size, NULL, 8);
+		pad = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+		name = strrchr(hdr.name, '/');
+		name = name ? name + 1 : hdr.name;
+
+		if ((hdr.typeflag == '0' || hdr.typeflag == '\0') &&
+			name[0] != '\0' && strlen(name) < FS_FILENAME_LEN) {
+			import_send_fd(ring, name, fd, size);
+		} else {
+			test_fs_error("skipping '%s'", hdr.name);
+			pad += size;
+		}
+
+		while (pad > 0) {
+			size_t n = pad < TAR_BLOCK ? pad : TAR_BLOCK;
+			if (read_full(fd, skip, n) != (ssize_t)n)
+				die("truncated tar stream");
+			pad -= n;
+		}
+	}
+}
+
+/* Host side of an import: read every source and feed the ring */
+void *import_producer(void *arg)
+{
+	struct import_arg *i_arg = arg;
+	struct stat st;
+
+	for (int i = 0; i < i_arg->argc; i++) {
+		const char *path = i_arg->argv[i];
+
+		if (strcmp(path, "-") == 0) {
+			import_send_tar(i_arg->ring, STDIN_FILENO);
+			continue;
+		}
+		if (stat(path, &st))
+			die_perror("stat");
+		if (S_ISDIR(st.st_mode))
+			import_send_dir(i_arg->ring, path);
+		else if (S_ISREG(st.st_mode))
+			import_send_path(i_arg->ring, path);
+		else
+			test_fs_error("skipping '%s': not a regular file", path);
+	}
+	xfer_send_end(i_arg->ring);
+	return NULL;
+}
+
+void thread_fs_import(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct import_arg i_arg;
+	struct xfer_ring *ring;
+	pthread_t producer;
+	char *diskname;
+	int fs_fd = -1;
+	int files = 0;
+	size_t total = 0;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host file|host dir|- (tar on stdin)>...");
+
+	diskname = t_arg->argv[0];
+
+	ring = malloc(sizeof(*ring));
+	if (!ring)
+		die_perror("malloc");
+	xfer_init(ring);
+
+	/* Mount once for the whole batch */
+	if (mount_disk(diskname))
+		die("Cannot mount diskname");
+
+	i_arg.ring = ring;
+	i_arg.argc = t_arg->argc - 1;
+	i_arg.argv = &t_arg->argv[1];
+	if (pthread_create(&producer, NULL, import_producer, &i_arg))
+		die("Cannot start import thread");
+
+	for (;;) {
+		struct xfer_slot *slot = xfer_peek(ring);
+		enum xfer_kind kind = slot->kind;
+
+		if (kind == XFER_FILE || kind == XFER_END) {
+			if (fs_fd >= 0 && fs_close(fs_fd)) {
+				fs_umount();
+				die("Cannot close file");
+			}
+			fs_fd = -1;
+		}
+
+		if (kind == XFER_FILE) {
+			if (fs_create(slot->name)) {
+				fs_umount();
+				die("Cannot create file '%s'", slot->name);
+			}
+			fs_fd = fs_open(slot->name);
+			if (fs_fd < 0) {
+				fs_umount();
+				die("Cannot open file '%s'", slot->name);
+			}
+			files++;
+		} else if (kind == XFER_DATA) {
+			int written = fs_write(fs_fd, slot->data, slot->len);
+			if (written < 0 || (size_t)written != slot->len) {
+				fs_close(fs_fd);
+				fs_umount();
+				die("Disk full after %zu bytes", total +
+					(written > 0 ? written : 0));
+			}
+			total += written;
+		}
+
+		xfer_release(ring);
+		if (kind == XFER_END)
+			break;
+	}
+
+	pthread_join(producer, NULL);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Imported %d files (%zu bytes)\n", files, total);
+
+	xfer_destroy(ring);
+	free(ring);
+}
+
+struct export_arg {
+	struct xfer_ring *ring;
+	const char *dest;
+};
+
+/* Host side of an export: drain the ring into a directory or tar on stdout */
+void *export_consumer(void *arg)
+{
+	struct export_arg *e_arg = arg;
+	int to_tar = strcmp(e_arg->dest, "-") == 0;
+	int out = to_tar ? STDOUT_FILENO : -1;
+	char zeros[TAR_BLOCK] = { 0 };
+	size_t pad = 0;
+
+	for (;;) {
+		struct xfer_slot *slot = xfer_peek(e_arg->ring);
+		enum xfer_kind kind = slot->kind;
+
+		if (kind != XFER_DATA) {
+			if (to_tar && pad && write_full(out, zeros, pad))
+				die_perror("write");
+			if (!to_tar && out >= 0)
+				close(out);
+		}
+
+		if (kind == XFER_FILE) {
+			if (to_tar) {
+				struct tar_header hdr;
+
+				tar_fill_header(&hdr, slot->name, slot->len);
+				if (write_full(out, &hdr, TAR_BLOCK))
+					die_perror("write");
+				pad = (TAR_BLOCK - slot->len % TAR_BLOCK) % TAR_BLOCK;
+			} else {
+				char path[PATH_MAX];
+
+				snprintf(path, sizeof(path), "%s/%s", e_arg->dest,
+						 slot->name);
+				out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+				if (out < 0)
+					die_perror("open");
+			}
+		} else if (kind == XFER_DATA) {
+			if (write_full(out, slot->data, slot->len))
+				die_perror("write");
+		} else {
+			if (to_tar) {
+				if (write_full(out, zeros, TAR_BLOCK) ||
+					write_full(out, zeros, TAR_BLOCK))
+					die_perror("write");
+			}
+			xfer_release(e_arg->ring);
+			break;
+		}
+		xfer_release(e_arg->ring);
+	}
+	return NULL;
+}
+
+void thread_fs_export(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct export_arg e_arg;
+	struct xfer_ring *ring;
+	pthread_t consumer;
+	char *diskname;
+	int files = 0;
+	size_t total = 0;
+
+	if (t_arg->argc < 3)
+		die("Usage: <diskname> <host dir|- (tar on stdout)> <filename>...");
+
+	diskname = t_arg->argv[0];
+
+	ring = malloc(sizeof(*ring));
+	if (!ring)
+		die_perror("malloc");
+	xfer_init(ring);
+
+	if (mount_disk(diskname))
+		die("Cannot mount diskname");
+
+	e_arg.ring = ring;
+	e_arg.dest = t_arg->argv[1];
+	if (pthread_create(&consumer, NULL, export_consumer, &e_arg))
+		die("Cannot start export thread");
+
+	for (int i = 2; i < t_arg->argc; i++) {
+		char *filename = t_arg->argv[i];
+		int fs_fd;
+		off_t stat;
+
+		fs_fd = fs_open(filename);
+		if (fs_fd < 0) {
+			fs_umount();
+			die("Cannot open file '%s'", filename);
+		}
+		stat = fs_stat64(fs_fd);
+		if (stat < 0) {
+			fs_close(fs_fd);
+			fs_umount();
+			die("Cannot stat file '%s'", filename);
+		}
+
+		xfer_send_file(ring, filename, stat);
+		for (off_t left = stat; left > 0;) {
+			struct xfer_slot *slot = xfer_reserve(ring);
+			size_t want = left < XFER_CHUNK ? (size_t)left : XFER_CHUNK;
+			ssize_t read = fs_read64(fs_fd, slot->data, want);
+
+			if (read <= 0) {
+				fs_close(fs_fd);
+				fs_umount();
+				die("Cannot read file '%s'", filename);
+			}
+			slot->kind = XFER_DATA;
+			slot->len = read;
+			xfer_commit(ring);
+			left -= read;
+			total += read;
+		}
+
+		if (fs_close(fs_fd)) {
+			fs_umount();
+			die("Cannot close file");
+		}
+		files++;
+	}
+	xfer_send_end(ring);
+	pthread_join(consumer, NULL);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	/* Keep stdout clean when it carries the tar stream */
+	fprintf(strcmp(e_arg.dest, "-") ? stdout : stderr,
+			"Exported %d files (%zu bytes)\n", files, total);
+
+	xfer_destroy(ring);
+	free(ring);
+}
+
+void thread_fs_defrag(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename = NULL;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<filename>]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1)
+		filename = t_arg->argv[1];
+
+	if (mount_disk(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_defrag(filename)) {
+		fs_umount();
+		die("Cannot defragment %s", filename ? filename : "volume");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Defragmented %s\n", filename ? filename : "volume");
+}
+
+void thread_fs_scrub(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	unsigned int rate = 0;
+	int bad;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<blocks per second>]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1)
+		rate = strtoul(t_arg->argv[1], NULL, 0);
+
+	if (mount_disk(diskname))
+		die("Cannot mount diskname");
+
+	if (block_scrub_start(rate)) {
+		fs_umount();
+		die("Cannot scrub volume");
+	}
+
+	/* One pass over the whole volume */
+	while (block_scrub_passes() < 1)
+		usleep(1000);
+	bad = block_scrub_stop();
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	if (bad)
+		die("Scrubbed volume: %d bad block(s)", bad);
+	printf("Scrubbed volume: no bad blocks\n");
+}
+
 void thread_fs_ls(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -471,7 +1224,7 @@ void thread_fs_ls(void *arg)
 
 	diskname = t_arg->argv[0];
 
-	if (fs_mount(diskname))
+	if (mount_disk(diskname))
 		die("Cannot mount diskname");
 
 	fs_ls();
@@ -490,7 +1243,7 @@ void thread_fs_info(void *arg)
 
 	diskname = t_arg->argv[0];
 
-	if (fs_mount(diskname))
+	if (mount_disk(diskname))
 		die("Cannot mount diskname");
 
 	fs_info();
@@ -499,14 +1252,6 @@ void thread_fs_info(void *arg)
 		die("Cannot unmount diskname");
 }
 
-size_t get_argv(char *argv)
-{
-	long int ret = strtol(argv, NULL, 0);
-	if (ret == LONG_MIN || ret == LONG_MAX)
-		die_perror("strtol");
-	return (size_t)ret;
-}
-
 static struct {
 	const char *name;
 	void(*func)(void *);
@@ -514,9 +1259,16 @@ static struct {
 	{ "info",	thread_fs_info },
 	{ "ls",		thread_fs_ls },
 	{ "add",	thread_fs_add },
+	{ "import",	thread_fs_import },
+	{ "export",	thread_fs_export },
 	{ "rm",		thread_fs_rm },
+	{ "cp",		thread_fs_cp },
 	{ "cat",	thread_fs_cat },
 	{ "stat",	thread_fs_stat },
+	{ "defrag",	thread_fs_defrag },
+	{ "snap",	thread_fs_snap },
+	{ "rmsnap",	thread_fs_rmsnap },
+	{ "scrub",	thread_fs_scrub },
 	{ "script",	thread_fs_script }
 };
 
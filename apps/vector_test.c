@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fs.h>
+
+#define ASSERT(cond, func)                               \
+do {                                                     \
+	if (!(cond)) {                                       \
+		fprintf(stderr, "Function '%s' failed\n", func); \
+		exit(EXIT_FAILURE);                              \
+	}                                                    \
+} while (0)
+
+#define PAYLOAD_LEN (3 * 4096 + 100)
+
+int main(int argc, char *argv[])
+{
+	int ret;
+	int fd;
+	char header[10] = "RECORD:01|";
+	char *payload, *check;
+	char small[16];
+	struct iovec iov[2];
+
+	if (argc < 2) {
+		printf("Usage: %s <diskimage>\n", argv[0]);
+		exit(1);
+	}
+
+	payload = malloc(PAYLOAD_LEN);
+	check = malloc(sizeof(header) + PAYLOAD_LEN);
+	for (int i = 0; i < PAYLOAD_LEN; i++)
+		payload[i] = 'a' + i % 26;
+
+	ret = fs_mount(argv[1]);
+	ASSERT(!ret, "fs_mount");
+
+	ret = fs_create("vecfile");
+	ASSERT(!ret, "fs_create");
+	fd = fs_open("vecfile");
+	ASSERT(fd >= 0, "fs_open");
+
+	/* Header and payload submitted in one call */
+	iov[0].iov_base = header;
+	iov[0].iov_len = sizeof(header);
+	iov[1].iov_base = payload;
+	iov[1].iov_len = PAYLOAD_LEN;
+	ret = fs_writev(fd, iov, 2);
+	ASSERT(ret == sizeof(header) + PAYLOAD_LEN, "fs_writev");
+	ASSERT(fs_stat(fd) == ret, "fs_stat");
+
+	/* Positional read does not move the offset, which is at the end */
+	ret = fs_pread(fd, check, sizeof(header) + PAYLOAD_LEN, 0);
+	ASSERT(ret == sizeof(header) + PAYLOAD_LEN, "fs_pread");
+	ASSERT(!memcmp(check, header, sizeof(header)), "fs_pread");
+	ASSERT(!memcmp(check + sizeof(header), payload, PAYLOAD_LEN), "fs_pread");
+	ret = fs_read(fd, small, sizeof(small));
+	ASSERT(ret == 0, "fs_pread");
+
+	/* Positional write in the middle of a block */
+	ret = fs_pwrite(fd, "0123456789", 10, 4090);
+	ASSERT(ret == 10, "fs_pwrite");
+	ret = fs_pwrite(fd, "x", 1, fs_stat(fd) + 1);
+	ASSERT(ret == -1, "fs_pwrite");
+
+	/* Scatter back into header/payload sized buffers */
+	fs_lseek(fd, 0);
+	memset(check, 0, sizeof(header) + PAYLOAD_LEN);
+	iov[0].iov_base = check;
+	iov[1].iov_base = check + sizeof(header);
+	ret = fs_readv(fd, iov, 2);
+	ASSERT(ret == sizeof(header) + PAYLOAD_LEN, "fs_readv");
+	ASSERT(!memcmp(check, header, sizeof(header)), "fs_readv");
+	ASSERT(!memcmp(check + 4090, "0123456789", 10), "fs_readv");
+	ASSERT(!memcmp(check + 4100, payload + 4090, PAYLOAD_LEN - 4090), "fs_readv");
+
+	fs_close(fd);
+	ret = fs_delete("vecfile");
+	ASSERT(!ret, "fs_delete");
+	fs_umount();
+
+	printf("vector_test: all checks passed\n");
+	return 0;
+}
@@ -0,0 +1,20 @@
+#ifndef _CRC32C_H
+#define _CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * crc32c - Compute a CRC-32C (Castagnoli) checksum
+ * @crc: Checksum of the data before @buf, 0 to start a new one
+ * @buf: Data to checksum
+ * @len: Size of @buf
+ *
+ * Uses the SSE4.2 crc32 instruction when the processor has it, and a table
+ * driven implementation otherwise; both give the same results.
+ *
+ * Return: the checksum of the data so far.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+#endif /* _CRC32C_H */
@@ -1,10 +1,20 @@
+#define _GNU_SOURCE
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "crc32c.h"
 #include "disk.h"
 
 #define block_error(fmt, ...) \
@@ -13,51 +23,1649 @@
 /* Invalid file descriptor */
 #define INVALID_FD -1
 
+/* Changed block tracking file, next to the image */
+#define CBT_SUFFIX ".cbt"
+#define CBT_MAGIC 0x31544243 /* "CBT1" */
+
+/* Start of the tracking file, followed by the bitmap of changed blocks */
+struct cbt_header {
+	uint32_t magic;
+	uint32_t epoch;
+	uint64_t bcount;
+	/* Cleared while the disk is open: if the process dies, the bitmap
+	 * misses changes and cannot be trusted */
+	uint32_t clean;
+	uint32_t padding;
+} __attribute__((packed));
+
+/* Block checksum file, next to the image */
+#define SUM_SUFFIX ".sum"
+#define SUM_MAGIC 0x314d5553 /* "SUM1" */
+
+/* In BLOCK_VERIFY_SAMPLED mode, one read in this many is checked */
+#define VERIFY_SAMPLE 16
+
+/* Start of the checksum file, followed by the checksum of every block, then
+ * by the bitmap of blocks whose checksum is known */
+struct sum_header {
+	uint32_t magic;
+	/* Cleared while the disk is open: if the process dies, the checksums
+	 * miss the last writes and cannot be trusted */
+	uint32_t clean;
+	uint64_t bcount;
+} __attribute__((packed));
+
+/* In direct I/O, blocks go through aligned bounce buffers of this many
+ * blocks, of which this many spares are kept */
+#define DIRECT_CHUNK 16
+#define DIRECT_POOL 4
+
+#define ALIGNED(p)	(((uintptr_t)(p) & (BLOCK_SIZE - 1)) == 0)
+
+/* Buffers of at least this size are backed by huge pages where the host can */
+#define HUGE_PAGE (2 << 20)
+
+/* Most member images of a striped volume, and default blocks per stripe */
+#define STRIPE_MAX 16
+#define STRIPE_UNIT 16
+
+/* Most blocks a batch holds back before sending them, and writes of at least
+ * this many blocks, which go straight to the disk */
+#define QUEUE_MAX 256
+#define QUEUE_BYPASS 64
+
+/* Transfer of a member image of a striped volume */
+struct member_io {
+	struct iovec *iov;
+	int iovcnt;
+	off_t off;
+	int write;
+	int ret;
+};
+
+/* Member image of a striped volume, with a thread that transfers its blocks
+ * while the other members transfer theirs */
+struct member {
+	int fd;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* Transfer to do, NULL once done */
+	struct member_io *io;
+	int stop;
+	int started;
+};
+
+/* Write held back by a batch or by the write-back cache */
+struct queued_write {
+	size_t block;
+	/* Slot of the queue buffer holding the contents */
+	uint8_t *data;
+};
+
+/* Writes held back, one block each */
+struct write_queue {
+	struct queued_write *q;
+	size_t n;
+	uint8_t *buf;
+	/* One bit per block, set if the queue has a write to it */
+	uint8_t *pending;
+};
+
+/* Storage behind a virtual disk, chosen by a prefix of the disk's name */
+struct backend {
+	const char *prefix;
+	/* Extra flags to open the image with */
+	int open_flags;
+	/* Changes outlive the disk, so that the tracking and checksum files
+	 * next to the image can describe them */
+	int persistent;
+	/* Create the image(s) for at least @count blocks, and name the file
+	 * that the tracking and checksum files go next to; NULL for a single
+	 * image file */
+	int (*create)(const char *path, size_t count, char **base);
+	/* Set the file descriptor, block count, holes and base name */
+	int (*open)(const char *path);
+	void (*close)(void);
+	int (*read)(size_t block, size_t count, void *buf);
+	int (*write)(size_t block, size_t count, const void *buf);
+	/* 0 if the blocks were released, 1 if they stay as they are */
+	int (*discard)(size_t block, size_t count);
+	/* Make the blocks written so far survive a crash */
+	int (*sync)(void);
+	/* Map blocks read-only from the image, NULL if they cannot be */
+	void *(*map)(size_t block, size_t count);
+};
+
 /* Disk instance description */
 struct disk {
 	/* File descriptor */
 	int fd;
+	const struct backend *be;
+	/* Image that the tracking and checksum files go next to */
+	char *base;
 	/* Block count */
 	size_t bcount;
+	/* One bit per block, set if the block is backed by data in the image
+	 * file, clear if it is a hole that reads back as zeros */
+	uint8_t *mapped;
+	/* Host file system supports punching holes */
+	int can_punch;
+	/* Contents of the in-memory backends */
+	uint8_t *mem;
+	/* Spare bounce buffers of the direct I/O backend */
+	void *pool[DIRECT_POOL];
+	int pool_free;
+	pthread_mutex_t pool_lock;
+	/* Member images of a striped volume (the first one is fd), and the
+	 * blocks of a stripe */
+	struct member *members;
+	int nmembers;
+	size_t unit;
+	/* Writes held back by batches or by the write-back cache, and those
+	 * being written out of it. queue_lock guards both queues, flush_lock
+	 * is held while writing, so that the flushing queue stays empty */
+	struct write_queue dirty;
+	struct write_queue flushing;
+	size_t queue_max;
+	uint8_t *merge_buf;
+	pthread_mutex_t queue_lock;
+	pthread_mutex_t flush_lock;
+	/* Nesting depth of the batches, and first error of the writes sent
+	 * since it was last reported */
+	int batching;
+	int queue_err;
+	/* Write-back cache: the thread flushing it, and when the oldest of the
+	 * dirty blocks was written */
+	pthread_t flusher;
+	pthread_cond_t flusher_wake;
+	pthread_cond_t flushed;
+	int writeback;
+	int flusher_stop;
+	unsigned int expire_ms;
+	struct timespec dirty_since;
+	/* Tracking file, or INVALID_FD if changes are not tracked */
+	int cbt_fd;
+	char *cbt_path;
+	uint32_t epoch;
+	/* One bit per block, set if the block was written or released since
+	 * the last checkpoint */
+	uint8_t *changed;
+	/* Checksum file, or INVALID_FD if blocks are not checksummed */
+	int sum_fd;
+	uint32_t *sums;
+	/* One bit per block, set if its checksum is known */
+	uint8_t *summed;
+	/* BLOCK_VERIFY_* mode, and reads so far for sampling */
+	int verify;
+	unsigned int reads;
+	/* Held while the scrubber checks a block, and while a block and its
+	 * checksum are updated, so that it never sees one without the other */
+	pthread_mutex_t sum_lock;
+	/* Background scrubber */
+	pthread_t scrub;
+	int scrubbing;
+	unsigned int scrub_rate;
+	int scrub_stop;
+	int scrub_bad;
+	int scrub_passes;
+};
+
+#define MAPPED_TEST(b)	(disk.mapped[(b) / 8] & (1 << ((b) % 8)))
+#define MAPPED_SET(b)	(disk.mapped[(b) / 8] |= (1 << ((b) % 8)))
+#define MAPPED_CLEAR(b)	(disk.mapped[(b) / 8] &= ~(1 << ((b) % 8)))
+#define CHANGED_TEST(b)	(disk.changed[(b) / 8] & (1 << ((b) % 8)))
+#define CHANGED_SET(b)	(disk.changed[(b) / 8] |= (1 << ((b) % 8)))
+#define SUMMED_TEST(b)	(disk.summed[(b) / 8] & (1 << ((b) % 8)))
+#define SUMMED_SET(b)	(disk.summed[(b) / 8] |= (1 << ((b) % 8)))
+#define SUMMED_CLEAR(b)	(disk.summed[(b) / 8] &= ~(1 << ((b) % 8)))
+#define PENDING_TEST(wq, b)	((wq)->pending[(b) / 8] & (1 << ((b) % 8)))
+#define PENDING_SET(wq, b)	((wq)->pending[(b) / 8] |= (1 << ((b) % 8)))
+#define PENDING_CLEAR(wq, b)	((wq)->pending[(b) / 8] &= ~(1 << ((b) % 8)))
+
+/* Currently open virtual disk (invalid by default) */
+static struct disk disk = {
+	.fd = INVALID_FD,
+	.cbt_fd = INVALID_FD,
+	.sum_fd = INVALID_FD,
+	.verify = BLOCK_VERIFY_ALWAYS,
+	.sum_lock = PTHREAD_MUTEX_INITIALIZER,
+	.pool_lock = PTHREAD_MUTEX_INITIALIZER,
+	.queue_lock = PTHREAD_MUTEX_INITIALIZER,
+	.flush_lock = PTHREAD_MUTEX_INITIALIZER,
+	.flushed = PTHREAD_COND_INITIALIZER,
 };
 
-/* Currently open virtual disk (invalid by default) */
-static struct disk disk = { .fd = INVALID_FD };
+/* Name of a file kept next to the image, NULL if out of memory */
+static char *sidecar_path(const char *diskname, const char *suffix)
+{
+	char *path = malloc(strlen(diskname) + strlen(suffix) + 1);
+
+	if (path) {
+		strcpy(path, diskname);
+		strcat(path, suffix);
+	}
+	return path;
+}
+
+/* Record that blocks changed, for the next incremental export */
+static void mark_changed(size_t block, size_t count)
+{
+	if (disk.cbt_fd == INVALID_FD)
+		return;
+	for (size_t b = block; b < block + count; b++)
+		CHANGED_SET(b);
+}
+
+/* Write the header (and the bitmap when closing) of the tracking file */
+static int cbt_save(int clean)
+{
+	struct cbt_header hdr = {
+		.magic = CBT_MAGIC,
+		.epoch = disk.epoch,
+		.bcount = disk.bcount,
+		.clean = clean,
+	};
+	size_t len = (disk.bcount + 7) / 8;
+
+	if (clean && pwrite(disk.cbt_fd, disk.changed, len, sizeof(hdr)) != (ssize_t)len)
+		return -1;
+	if (pwrite(disk.cbt_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    fdatasync(disk.cbt_fd))
+		return -1;
+	return 0;
+}
+
+/*
+ * Resume tracking changes if the image has a tracking file. A bitmap that was
+ * not saved by a clean close may miss changes, so every block counts as
+ * changed instead. The file is then marked in use until the disk is closed.
+ */
+static void cbt_open(const char *diskname)
+{
+	struct cbt_header hdr;
+	size_t len = (disk.bcount + 7) / 8;
+	int fd;
+
+	disk.cbt_path = sidecar_path(diskname, CBT_SUFFIX);
+	if (!disk.cbt_path)
+		return;
+	if ((fd = open(disk.cbt_path, O_RDWR)) < 0)
+		return;
+	if (!(disk.changed = calloc(len, 1))) {
+		close(fd);
+		return;
+	}
+
+	disk.cbt_fd = fd;
+	if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    hdr.magic != CBT_MAGIC || hdr.bcount != disk.bcount) {
+		block_error("changes of '%s' were not tracked, starting over",
+			    diskname);
+		hdr.epoch = 0;
+		hdr.clean = 0;
+	}
+	disk.epoch = hdr.epoch;
+	if (!hdr.clean || pread(fd, disk.changed, len, sizeof(hdr)) != (ssize_t)len)
+		memset(disk.changed, 0xff, len);
+	if (cbt_save(0))
+		perror("cbt");
+}
+
+static void cbt_close(void)
+{
+	if (disk.cbt_fd != INVALID_FD) {
+		if (cbt_save(1))
+			perror("cbt");
+		close(disk.cbt_fd);
+	}
+	free(disk.changed);
+	free(disk.cbt_path);
+	disk.cbt_fd = INVALID_FD;
+	disk.changed = NULL;
+	disk.cbt_path = NULL;
+	disk.epoch = 0;
+}
+
+/* Write the header (and the checksums when closing) of the checksum file */
+static int sum_save(int clean)
+{
+	struct sum_header hdr = {
+		.magic = SUM_MAGIC,
+		.clean = clean,
+		.bcount = disk.bcount,
+	};
+	size_t len = disk.bcount * sizeof(uint32_t);
+	size_t bits = (disk.bcount + 7) / 8;
+
+	if (clean &&
+	    (pwrite(disk.sum_fd, disk.sums, len, sizeof(hdr)) != (ssize_t)len ||
+	     pwrite(disk.sum_fd, disk.summed, bits, sizeof(hdr) + len) != (ssize_t)bits))
+		return -1;
+	if (pwrite(disk.sum_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    fdatasync(disk.sum_fd))
+		return -1;
+	return 0;
+}
+
+/*
+ * Start checksumming blocks if the image has a checksum file; an empty one
+ * turns checksums on. Checksums that were not saved by a clean close are
+ * dropped, and blocks get new ones as they are written or first read.
+ */
+static void sum_open(const char *diskname)
+{
+	struct sum_header hdr;
+	size_t len = disk.bcount * sizeof(uint32_t);
+	size_t bits = (disk.bcount + 7) / 8;
+	char *path = sidecar_path(diskname, SUM_SUFFIX);
+	int fd = path ? open(path, O_RDWR) : -1;
+
+	free(path);
+	if (fd < 0)
+		return;
+	disk.sums = malloc(len);
+	disk.summed = calloc(bits, 1);
+	if (!disk.sums || !disk.summed) {
+		free(disk.sums);
+		free(disk.summed);
+		disk.sums = NULL;
+		disk.summed = NULL;
+		close(fd);
+		return;
+	}
+
+	disk.sum_fd = fd;
+	if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    hdr.magic != SUM_MAGIC || hdr.bcount != disk.bcount) {
+		hdr.clean = 0;
+	} else if (!hdr.clean) {
+		block_error("checksums of '%s' were not saved, starting over",
+			    diskname);
+	}
+	if (hdr.clean &&
+	    (pread(fd, disk.sums, len, sizeof(hdr)) != (ssize_t)len ||
+	     pread(fd, disk.summed, bits, sizeof(hdr) + len) != (ssize_t)bits))
+		memset(disk.summed, 0, bits);
+	if (sum_save(0))
+		perror("sum");
+}
+
+static void sum_close(void)
+{
+	if (disk.sum_fd != INVALID_FD) {
+		if (sum_save(1))
+			perror("sum");
+		close(disk.sum_fd);
+	}
+	free(disk.sums);
+	free(disk.summed);
+	disk.sum_fd = INVALID_FD;
+	disk.sums = NULL;
+	disk.summed = NULL;
+}
+
+/* Record the checksums of blocks just written, with sum_lock held */
+static void sum_update(size_t block, size_t count, const void *buf)
+{
+	if (disk.sum_fd == INVALID_FD)
+		return;
+	for (size_t i = 0; i < count; i++) {
+		disk.sums[block + i] = crc32c(0, (const uint8_t *)buf + i * BLOCK_SIZE,
+					      BLOCK_SIZE);
+		SUMMED_SET(block + i);
+	}
+}
+
+/*
+ * Check blocks just read against their checksums, as often as the verify mode
+ * asks. A block without a checksum yet is trusted, and gets one.
+ */
+static int sum_verify(size_t block, size_t count, const void *buf)
+{
+	int check;
+
+	if (disk.sum_fd == INVALID_FD)
+		return 0;
+	check = disk.verify == BLOCK_VERIFY_ALWAYS ||
+		(disk.verify == BLOCK_VERIFY_SAMPLED &&
+		 disk.reads++ % VERIFY_SAMPLE == 0);
+
+	for (size_t b = block; b < block + count; b++) {
+		const uint8_t *data = (const uint8_t *)buf + (b - block) * BLOCK_SIZE;
+
+		/* Holes read back as zeros without any I/O, nothing to check */
+		if (!MAPPED_TEST(b))
+			continue;
+		if (!SUMMED_TEST(b)) {
+			pthread_mutex_lock(&disk.sum_lock);
+			sum_update(b, 1, data);
+			pthread_mutex_unlock(&disk.sum_lock);
+		} else if (check && crc32c(0, data, BLOCK_SIZE) != disk.sums[b]) {
+			block_error("checksum mismatch on block %zu", b);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Block of the disk stored as block @b of image @member */
+static size_t volume_block(int member, size_t b)
+{
+	if (!disk.nmembers)
+		return b;
+	return (b / disk.unit * disk.nmembers + member) * disk.unit + b % disk.unit;
+}
+
+/* Find which blocks of an image of @bcount blocks hold data and which ones are
+ * holes */
+static void map_data_extents(int fd, int member, size_t bcount)
+{
+	off_t end = (off_t)bcount * BLOCK_SIZE;
+	off_t data = 0, hole;
+
+	while (data < end) {
+		data = lseek(fd, data, SEEK_DATA);
+		if (data < 0) {
+			/* ENXIO: only holes left. Anything else: the host
+			 * cannot tell, so treat the whole image as data */
+			if (errno != ENXIO)
+				memset(disk.mapped, 0xff, (disk.bcount + 7) / 8);
+			return;
+		}
+		hole = lseek(fd, data, SEEK_HOLE);
+		if (hole < 0 || hole > end)
+			hole = end;
+
+		/* A block partially covered by data counts as data */
+		for (size_t b = data / BLOCK_SIZE;
+		     b < (size_t)(hole + BLOCK_SIZE - 1) / BLOCK_SIZE; b++)
+			MAPPED_SET(volume_block(member, b));
+		data = hole;
+	}
+}
+
+/* 1 if every block of the range is a hole */
+static int range_is_hole(size_t block, size_t count)
+{
+	for (size_t b = block; b < block + count; b++)
+		if (MAPPED_TEST(b))
+			return 0;
+	return 1;
+}
+
+/* Open an image file and check its size; -1 if it cannot be used */
+static int image_open(const char *path, int flags, size_t *bcount)
+{
+	struct stat st;
+	int fd = open(path, O_RDWR | flags, 0644);
+
+	if (fd < 0 && errno == EINVAL && flags) {
+		block_error("'%s' cannot bypass the page cache, using it", path);
+		fd = open(path, O_RDWR, 0644);
+	}
+	if (fd < 0) {
+		perror("open");
+		return -1;
+	}
+
+	if (fstat(fd, &st)) {
+		perror("fstat");
+		close(fd);
+		return -1;
+	}
+
+	/* The disk image's size should be a multiple of the block size */
+	if (st.st_size % BLOCK_SIZE != 0) {
+		block_error("size '%zu' is not multiple of '%d'",
+			    st.st_size, BLOCK_SIZE);
+		close(fd);
+		return -1;
+	}
+
+	*bcount = st.st_size / BLOCK_SIZE;
+	return fd;
+}
+
+/* Sparse image: all blocks are holes until written */
+static int image_create(const char *path, size_t count)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (fd < 0 || ftruncate(fd, (off_t)count * BLOCK_SIZE)) {
+		perror(path);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
+
+/*
+ * Image file backend. pread() and pwrite() leave the file offset alone, so
+ * that the scrubber can read blocks while the disk is in use.
+ */
+static int file_open(const char *path)
+{
+	size_t bcount;
+	int fd = image_open(path, disk.be->open_flags, &bcount);
+
+	if (fd < 0)
+		return -1;
+	disk.mapped = calloc((bcount + 7) / 8, 1);
+	disk.base = strdup(path);
+	if (!disk.mapped || !disk.base) {
+		perror("calloc");
+		close(fd);
+		return -1;
+	}
+
+	disk.fd = fd;
+	disk.bcount = bcount;
+	disk.can_punch = 1;
+	disk.nmembers = 0;
+	map_data_extents(fd, 0, bcount);
+	return 0;
+}
+
+static void file_close(void)
+{
+	close(disk.fd);
+}
+
+static int file_read(size_t block, size_t count, void *buf)
+{
+	size_t done = 0;
+
+	/* Large reads may be split by the host, keep going until done */
+	while (done < count * BLOCK_SIZE) {
+		ssize_t ret = pread(disk.fd, (char *)buf + done,
+				    count * BLOCK_SIZE - done,
+				    (off_t)block * BLOCK_SIZE + done);
+		if (ret <= 0) {
+			if (ret < 0)
+				perror("read");
+			else
+				block_error("unexpected end of disk image");
+			return -1;
+		}
+		done += ret;
+	}
+	return 0;
+}
+
+static int file_write(size_t block, size_t count, const void *buf)
+{
+	size_t done = 0;
+
+	/* Large writes may be split by the host, keep going until done */
+	while (done < count * BLOCK_SIZE) {
+		ssize_t ret = pwrite(disk.fd, (const char *)buf + done,
+				     count * BLOCK_SIZE - done,
+				     (off_t)block * BLOCK_SIZE + done);
+		if (ret <= 0) {
+			perror("write");
+			return -1;
+		}
+		done += ret;
+	}
+	return 0;
+}
+
+static int file_discard(size_t block, size_t count)
+{
+	if (!disk.can_punch)
+		return 1;
+
+	if (fallocate(disk.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      (off_t)block * BLOCK_SIZE, (off_t)count * BLOCK_SIZE) < 0) {
+		if (errno == EOPNOTSUPP || errno == ENOSYS) {
+			/* Not an error, the blocks just stay allocated */
+			disk.can_punch = 0;
+			return 1;
+		}
+		perror("fallocate");
+		return -1;
+	}
+	return 0;
+}
+
+static int file_sync(void)
+{
+	if (fdatasync(disk.fd)) {
+		perror("fdatasync");
+		return -1;
+	}
+	return 0;
+}
+
+/* Holes map as zeros, like they read */
+static void *fd_map(int fd, off_t off, size_t count)
+{
+	void *addr = mmap(NULL, count * BLOCK_SIZE, PROT_READ, MAP_SHARED, fd, off);
+
+	return addr == MAP_FAILED ? NULL : addr;
+}
+
+static void *file_map(size_t block, size_t count)
+{
+	return fd_map(disk.fd, (off_t)block * BLOCK_SIZE, count);
+}
+
+/*
+ * Direct I/O backend: the image is opened with O_DIRECT, so that the host page
+ * cache does not hold a second copy of the blocks libfs caches. Transfers must
+ * use aligned memory; other buffers go through a pool of bounce buffers.
+ */
+static void *pool_get(void)
+{
+	void *buf = NULL;
+
+	pthread_mutex_lock(&disk.pool_lock);
+	if (disk.pool_free)
+		buf = disk.pool[--disk.pool_free];
+	pthread_mutex_unlock(&disk.pool_lock);
+	if (!buf && posix_memalign(&buf, BLOCK_SIZE, DIRECT_CHUNK * BLOCK_SIZE)) {
+		block_error("cannot allocate bounce buffer");
+		buf = NULL;
+	}
+	return buf;
+}
+
+static void pool_put(void *buf)
+{
+	pthread_mutex_lock(&disk.pool_lock);
+	if (disk.pool_free < DIRECT_POOL) {
+		disk.pool[disk.pool_free++] = buf;
+		buf = NULL;
+	}
+	pthread_mutex_unlock(&disk.pool_lock);
+	free(buf);
+}
+
+static void direct_close(void)
+{
+	while (disk.pool_free)
+		free(disk.pool[--disk.pool_free]);
+	file_close();
+}
+
+static int direct_read(size_t block, size_t count, void *buf)
+{
+	char *bounce;
+	int ret = 0;
+
+	if (ALIGNED(buf))
+		return file_read(block, count, buf);
+	if (!(bounce = pool_get()))
+		return -1;
+	for (size_t i = 0; i < count && !ret; i += DIRECT_CHUNK) {
+		size_t n = count - i < DIRECT_CHUNK ? count - i : DIRECT_CHUNK;
+
+		ret = file_read(block + i, n, bounce);
+		if (!ret)
+			memcpy((char *)buf + i * BLOCK_SIZE, bounce, n * BLOCK_SIZE);
+	}
+	pool_put(bounce);
+	return ret;
+}
+
+static int direct_write(size_t block, size_t count, const void *buf)
+{
+	char *bounce;
+	int ret = 0;
+
+	if (ALIGNED(buf))
+		return file_write(block, count, buf);
+	if (!(bounce = pool_get()))
+		return -1;
+	for (size_t i = 0; i < count && !ret; i += DIRECT_CHUNK) {
+		size_t n = count - i < DIRECT_CHUNK ? count - i : DIRECT_CHUNK;
+
+		memcpy(bounce, (const char *)buf + i * BLOCK_SIZE, n * BLOCK_SIZE);
+		ret = file_write(block + i, n, bounce);
+	}
+	pool_put(bounce);
+	return ret;
+}
+
+/*
+ * In-memory backends: the image is read in memory when the disk is opened, and
+ * blocks never touch the host again until the disk is closed, when they are
+ * either dropped or saved back to the image.
+ */
+static int mem_open(const char *path)
+{
+	if (file_open(path))
+		return -1;
+	if (!(disk.mem = calloc(disk.bcount, BLOCK_SIZE))) {
+		perror("calloc");
+		file_close();
+		return -1;
+	}
+
+	/* Holes are already zeros */
+	for (size_t b = 0; b < disk.bcount;) {
+		size_t n = 0;
+
+		while (b + n < disk.bcount && MAPPED_TEST(b + n))
+			n++;
+		if (n && file_read(b, n, disk.mem + b * BLOCK_SIZE)) {
+			free(disk.mem);
+			disk.mem = NULL;
+			file_close();
+			return -1;
+		}
+		b += n ? n : 1;
+	}
+	return 0;
+}
+
+static void mem_close(void)
+{
+	free(disk.mem);
+	disk.mem = NULL;
+	file_close();
+}
+
+static int mem_read(size_t block, size_t count, void *buf)
+{
+	memcpy(buf, disk.mem + block * BLOCK_SIZE, count * BLOCK_SIZE);
+	return 0;
+}
+
+static int mem_write(size_t block, size_t count, const void *buf)
+{
+	memcpy(disk.mem + block * BLOCK_SIZE, buf, count * BLOCK_SIZE);
+	return 0;
+}
+
+static int mem_discard(size_t block, size_t count)
+{
+	memset(disk.mem + block * BLOCK_SIZE, 0, count * BLOCK_SIZE);
+	return 0;
+}
+
+/* Write the blocks back to the image, with holes where they were released */
+static int mem_save(void)
+{
+	for (size_t b = 0; b < disk.bcount;) {
+		int mapped = MAPPED_TEST(b) != 0, ret = 1;
+		size_t n = 1;
+
+		while (b + n < disk.bcount && (MAPPED_TEST(b + n) != 0) == mapped)
+			n++;
+		if (!mapped)
+			ret = file_discard(b, n);
+		if (ret == 1)
+			ret = file_write(b, n, disk.mem + b * BLOCK_SIZE);
+		if (ret)
+			return -1;
+		b += n;
+	}
+	return file_sync();
+}
+
+static void memsave_close(void)
+{
+	if (mem_save())
+		block_error("cannot save disk to its image");
+	mem_close();
+}
+
+/*
+ * Striped backend: the disk is cut into stripes of disk.unit blocks, which go
+ * to the member images in turn, so that large transfers keep all of them busy.
+ * The name lists the images as "[<unit>:]<image>,<image>...".
+ */
+static char *stripe_parse(const char *path, char **names, int *n, size_t *unit)
+{
+	char *list = strdup(path), *p, *end, *save;
+
+	if (!list)
+		return NULL;
+	p = list;
+	*unit = STRIPE_UNIT;
+	if (*p >= '0' && *p <= '9') {
+		size_t u = strtoul(p, &end, 10);
+
+		if (*end == ':') {
+			*unit = u;
+			p = end + 1;
+		}
+	}
+
+	*n = 0;
+	for (char *name = strtok_r(p, ",", &save); name;
+	     name = strtok_r(NULL, ",", &save)) {
+		if (*n == STRIPE_MAX)
+			break;
+		names[(*n)++] = name;
+	}
+	if (!*n || !*unit || strtok_r(NULL, ",", &save)) {
+		block_error("invalid striped volume '%s'", path);
+		free(list);
+		return NULL;
+	}
+	return list;
+}
+
+/* Member image holding a block of the disk, and the block's offset in it */
+static int stripe_locate(size_t block, off_t *off)
+{
+	size_t stripe = block / disk.unit;
+
+	*off = (off_t)((stripe / disk.nmembers) * disk.unit + block % disk.unit) *
+	       BLOCK_SIZE;
+	return stripe % disk.nmembers;
+}
+
+/* Transfer a whole vector, however the host splits it */
+static int member_rw(int fd, struct iovec *iov, int iovcnt, off_t off, int write)
+{
+	while (iovcnt > 0) {
+		int n = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+		ssize_t ret = write ? pwritev(fd, iov, n, off) : preadv(fd, iov, n, off);
+
+		if (ret <= 0) {
+			if (ret < 0)
+				perror(write ? "write" : "read");
+			else
+				block_error("unexpected end of disk image");
+			return -1;
+		}
+		off += ret;
+		while (ret > 0) {
+			if ((size_t)ret >= iov->iov_len) {
+				ret -= iov->iov_len;
+				iov++;
+				iovcnt--;
+			} else {
+				iov->iov_base = (char *)iov->iov_base + ret;
+				iov->iov_len -= ret;
+				ret = 0;
+			}
+		}
+	}
+	return 0;
+}
+
+static void *member_thread(void *arg)
+{
+	struct member *m = arg;
+
+	pthread_mutex_lock(&m->lock);
+	for (;;) {
+		struct member_io *io;
+
+		while (!m->io && !m->stop)
+			pthread_cond_wait(&m->cond, &m->lock);
+		if (!m->io)
+			break;
+		io = m->io;
+		pthread_mutex_unlock(&m->lock);
+		io->ret = member_rw(m->fd, io->iov, io->iovcnt, io->off, io->write);
+		pthread_mutex_lock(&m->lock);
+		m->io = NULL;
+		pthread_cond_broadcast(&m->cond);
+	}
+	pthread_mutex_unlock(&m->lock);
+	return NULL;
+}
+
+/*
+ * The stripes of a range of blocks are consecutive on each member, so each
+ * member gets a single transfer. The first member is done by the caller, the
+ * others by their own threads at the same time.
+ */
+static int stripe_io(size_t block, size_t count, void *buf, int write)
+{
+	struct member_io io[STRIPE_MAX];
+	size_t cap = count / (disk.unit * disk.nmembers) + 3;
+	struct iovec *iov;
+	int first = -1, ret;
+	off_t off;
+
+	/* Within a stripe: a single member, no need for threads */
+	if (block % disk.unit + count <= disk.unit) {
+		struct iovec one = { buf, count * BLOCK_SIZE };
+		int m = stripe_locate(block, &off);
+
+		return member_rw(disk.members[m].fd, &one, 1, off, write);
+	}
+
+	if (!(iov = malloc(disk.nmembers * cap * sizeof(*iov)))) {
+		perror("malloc");
+		return -1;
+	}
+	for (int m = 0; m < disk.nmembers; m++) {
+		io[m].iov = iov + m * cap;
+		io[m].iovcnt = 0;
+		io[m].write = write;
+		io[m].ret = 0;
+	}
+	for (size_t done = 0; done < count;) {
+		size_t n = disk.unit - (block + done) % disk.unit;
+		int m = stripe_locate(block + done, &off);
+
+		if (n > count - done)
+			n = count - done;
+		if (first == -1)
+			first = m;
+		if (!io[m].iovcnt)
+			io[m].off = off;
+		io[m].iov[io[m].iovcnt].iov_base = (char *)buf + done * BLOCK_SIZE;
+		io[m].iov[io[m].iovcnt++].iov_len = n * BLOCK_SIZE;
+		done += n;
+	}
+
+	for (int m = 0; m < disk.nmembers; m++) {
+		if (m == first || !io[m].iovcnt)
+			continue;
+		pthread_mutex_lock(&disk.members[m].lock);
+		disk.members[m].io = &io[m];
+		pthread_cond_broadcast(&disk.members[m].cond);
+		pthread_mutex_unlock(&disk.members[m].lock);
+	}
+	ret = member_rw(disk.members[first].fd, io[first].iov, io[first].iovcnt,
+			io[first].off, write);
+	for (int m = 0; m < disk.nmembers; m++) {
+		if (m == first || !io[m].iovcnt)
+			continue;
+		pthread_mutex_lock(&disk.members[m].lock);
+		while (disk.members[m].io)
+			pthread_cond_wait(&disk.members[m].cond, &disk.members[m].lock);
+		pthread_mutex_unlock(&disk.members[m].lock);
+		ret |= io[m].ret;
+	}
+	free(iov);
+	return ret ? -1 : 0;
+}
+
+static int stripe_read(size_t block, size_t count, void *buf)
+{
+	return stripe_io(block, count, buf, 0);
+}
+
+static int stripe_write(size_t block, size_t count, const void *buf)
+{
+	return stripe_io(block, count, (void *)buf, 1);
+}
+
+static int stripe_discard(size_t block, size_t count)
+{
+	if (!disk.can_punch)
+		return 1;
+
+	for (size_t done = 0; done < count;) {
+		size_t n = disk.unit - (block + done) % disk.unit;
+		off_t off;
+		int m = stripe_locate(block + done, &off);
+
+		if (n > count - done)
+			n = count - done;
+		if (fallocate(disk.members[m].fd,
+			      FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			      off, (off_t)n * BLOCK_SIZE) < 0) {
+			if (errno == EOPNOTSUPP || errno == ENOSYS) {
+				disk.can_punch = 0;
+				return 1;
+			}
+			perror("fallocate");
+			return -1;
+		}
+		done += n;
+	}
+	return 0;
+}
+
+/* Only blocks of a single stripe unit follow each other in a member */
+static void *stripe_map(size_t block, size_t count)
+{
+	off_t off;
+	int m = stripe_locate(block, &off);
+
+	if (block / disk.unit != (block + count - 1) / disk.unit)
+		return NULL;
+	return fd_map(disk.members[m].fd, off, count);
+}
+
+static int stripe_sync(void)
+{
+	for (int m = 0; m < disk.nmembers; m++) {
+		if (fdatasync(disk.members[m].fd)) {
+			perror("fdatasync");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Members are all given the same number of whole stripes */
+static int stripe_create(const char *path, size_t count, char **base)
+{
+	char *names[STRIPE_MAX], *list;
+	size_t unit, per;
+	int n;
+
+	if (!(list = stripe_parse(path, names, &n, &unit)))
+		return -1;
+	per = (count + unit * n - 1) / (unit * n) * unit;
+	if (per * n > INT_MAX) {
+		block_error("striped volume '%s' is too large", path);
+		free(list);
+		return -1;
+	}
+	for (int m = 0; m < n; m++) {
+		if (image_create(names[m], per)) {
+			free(list);
+			return -1;
+		}
+	}
+	*base = strdup(names[0]);
+	free(list);
+	return per * n;
+}
+
+static void stripe_close(void)
+{
+	for (int m = 0; m < disk.nmembers; m++) {
+		struct member *mb = &disk.members[m];
+
+		if (mb->started) {
+			pthread_mutex_lock(&mb->lock);
+			mb->stop = 1;
+			pthread_cond_broadcast(&mb->cond);
+			pthread_mutex_unlock(&mb->lock);
+			pthread_join(mb->thread, NULL);
+		}
+		pthread_mutex_destroy(&mb->lock);
+		pthread_cond_destroy(&mb->cond);
+		close(mb->fd);
+	}
+	free(disk.members);
+	disk.members = NULL;
+	disk.nmembers = 0;
+}
+
+static int stripe_open(const char *path)
+{
+	char *names[STRIPE_MAX], *list;
+	size_t unit, per = 0;
+	int n, fail = 0;
+
+	if (!(list = stripe_parse(path, names, &n, &unit)))
+		return -1;
+	if (!(disk.members = calloc(n, sizeof(*disk.members)))) {
+		perror("calloc");
+		free(list);
+		return -1;
+	}
+
+	/* Members that cannot be used have no thread either */
+	for (int m = 0; m < n; m++) {
+		struct member *mb = &disk.members[m];
+		size_t bcount = 0;
+
+		pthread_mutex_init(&mb->lock, NULL);
+		pthread_cond_init(&mb->cond, NULL);
+		mb->fd = fail ? -1 : image_open(names[m], 0, &bcount);
+		disk.nmembers = m + 1;
+		if (mb->fd < 0) {
+			fail = 1;
+			continue;
+		}
+		if (!m)
+			per = bcount;
+		if (bcount != per || bcount % unit) {
+			block_error("'%s' is not a member of '%s'", names[m], path);
+			fail = 1;
+			continue;
+		}
+		if (pthread_create(&mb->thread, NULL, member_thread, mb))
+			fail = 1;
+		else
+			mb->started = 1;
+	}
+
+	disk.unit = unit;
+	disk.bcount = per * n;
+	disk.can_punch = 1;
+	disk.mapped = calloc((disk.bcount + 7) / 8, 1);
+	disk.base = strdup(names[0]);
+	free(list);
+	if (fail || !disk.mapped || !disk.base) {
+		stripe_close();
+		return -1;
+	}
+
+	disk.fd = disk.members[0].fd;
+	for (int m = 0; m < n; m++)
+		map_data_extents(disk.members[m].fd, m, per);
+	return 0;
+}
+
+static const struct backend backends[] = {
+	{
+		.prefix = "direct:", .open_flags = O_DIRECT, .persistent = 1,
+		.open = file_open, .close = direct_close, .read = direct_read,
+		.write = direct_write, .discard = file_discard,
+		.sync = file_sync, .map = file_map,
+	},
+	{
+		.prefix = "mem:",
+		.open = mem_open, .close = mem_close, .read = mem_read,
+		.write = mem_write, .discard = mem_discard,
+	},
+	{
+		.prefix = "memsave:", .persistent = 1,
+		.open = mem_open, .close = memsave_close, .read = mem_read,
+		.write = mem_write, .discard = mem_discard, .sync = mem_save,
+	},
+	{
+		.prefix = "stripe:", .persistent = 1,
+		.create = stripe_create, .open = stripe_open,
+		.close = stripe_close, .read = stripe_read,
+		.write = stripe_write, .discard = stripe_discard,
+		.sync = stripe_sync, .map = stripe_map,
+	},
+	/* Anything else is the name of an image file */
+	{
+		.prefix = "", .persistent = 1,
+		.open = file_open, .close = file_close, .read = file_read,
+		.write = file_write, .discard = file_discard,
+		.sync = file_sync, .map = file_map,
+	},
+};
+
+/* Backend for a disk name, and the rest of the name */
+static const struct backend *find_backend(const char *diskname,
+					  const char **path)
+{
+	const struct backend *be = backends;
+
+	while (strncmp(diskname, be->prefix, strlen(be->prefix)))
+		be++;
+	*path = diskname + strlen(be->prefix);
+	return be;
+}
+
+/* Write blocks to the backend, then record them as data and summed */
+static int write_through(size_t block, size_t count, const void *buf)
+{
+	pthread_mutex_lock(&disk.sum_lock);
+	if (disk.be->write(block, count, buf)) {
+		pthread_mutex_unlock(&disk.sum_lock);
+		return -1;
+	}
+	for (size_t b = block; b < block + count; b++)
+		MAPPED_SET(b);
+	sum_update(block, count, buf);
+	pthread_mutex_unlock(&disk.sum_lock);
+
+	return 0;
+}
+
+static int queued_cmp(const void *a, const void *b)
+{
+	const struct queued_write *x = a, *y = b;
+
+	return (x->block > y->block) - (x->block < y->block);
+}
+
+static void queue_free(struct write_queue *wq)
+{
+	free(wq->q);
+	free(wq->buf);
+	free(wq->pending);
+	memset(wq, 0, sizeof(*wq));
+}
+
+/* Buffer of @count blocks that direct I/O can use as it is, NULL if out of
+ * memory */
+static void *blocks_alloc(size_t count)
+{
+	size_t len = count * BLOCK_SIZE;
+	void *buf;
+
+	if (posix_memalign(&buf, len >= HUGE_PAGE ? HUGE_PAGE : BLOCK_SIZE, len))
+		return NULL;
+	if (len >= HUGE_PAGE)
+		madvise(buf, len, MADV_HUGEPAGE);
+	return buf;
+}
+
+/* Set up both queues for @max blocks each, with queue_lock held */
+static int queue_alloc(size_t max)
+{
+	struct write_queue *wqs[] = { &disk.dirty, &disk.flushing };
+
+	for (int i = 0; i < 2; i++) {
+		struct write_queue *wq = wqs[i];
+
+		wq->q = malloc(max * sizeof(*wq->q));
+		wq->buf = blocks_alloc(max);
+		wq->pending = calloc((disk.bcount + 7) / 8, 1);
+		if (!wq->q || !wq->buf || !wq->pending)
+			goto fail;
+		for (size_t k = 0; k < max; k++)
+			wq->q[k].data = wq->buf + k * BLOCK_SIZE;
+	}
+	disk.merge_buf = blocks_alloc(max);
+	if (!disk.merge_buf)
+		goto fail;
+	disk.queue_max = max;
+	return 0;
+
+fail:
+	queue_free(&disk.dirty);
+	queue_free(&disk.flushing);
+	return -1;
+}
+
+/* Queued write to @block, NULL if there is none; with queue_lock held */
+static struct queued_write *queue_find(struct write_queue *wq, size_t block)
+{
+	if (!wq->n || !PENDING_TEST(wq, block))
+		return NULL;
+	for (size_t i = 0; i < wq->n; i++)
+		if (wq->q[i].block == block)
+			return &wq->q[i];
+	return NULL;
+}
+
+/* Latest contents of @block held back, NULL if there are none */
+static const uint8_t *queue_lookup(size_t block)
+{
+	struct queued_write *q = queue_find(&disk.dirty, block);
+
+	if (!q)
+		q = queue_find(&disk.flushing, block);
+	return q ? q->data : NULL;
+}
+
+/* Number of blocks of a range with contents held back */
+static size_t queue_count(size_t block, size_t count)
+{
+	size_t n = 0;
+
+	if (!disk.dirty.n && !disk.flushing.n)
+		return 0;
+	for (size_t b = block; b < block + count; b++)
+		if (queue_lookup(b))
+			n++;
+	return n;
+}
+
+/* Copy the writes of a range held back over what was read of it */
+static void queue_overlay(size_t block, size_t count, void *buf)
+{
+	/* The dirty queue is newer than the one being flushed */
+	struct write_queue *wqs[] = { &disk.flushing, &disk.dirty };
+
+	for (int i = 0; i < 2; i++) {
+		for (size_t k = 0; k < wqs[i]->n; k++) {
+			struct queued_write *q = &wqs[i]->q[k];
+
+			if (q->block >= block && q->block < block + count)
+				memcpy((uint8_t *)buf + (q->block - block) * BLOCK_SIZE,
+				       q->data, BLOCK_SIZE);
+		}
+	}
+}
+
+/* Forget the dirty blocks of a range that is about to be overwritten */
+static void queue_drop(size_t block, size_t count)
+{
+	struct write_queue *wq = &disk.dirty;
+
+	for (size_t i = 0; i < wq->n;) {
+		struct queued_write *q = &wq->q[i];
+		uint8_t *slot = q->data;
+
+		if (q->block < block || q->block >= block + count) {
+			i++;
+			continue;
+		}
+		/* The last write takes its place, and gives it its slot */
+		PENDING_CLEAR(wq, q->block);
+		*q = wq->q[--wq->n];
+		wq->q[wq->n].data = slot;
+	}
+}
+
+/*
+ * Write the dirty blocks in one sweep up the disk, neighbouring blocks merged
+ * into single writes. They move to the flushing queue first, so that blocks
+ * can be queued and read while they are written. Return -1 if a write failed.
+ */
+static int queue_flush(void)
+{
+	struct write_queue *wq = &disk.flushing, swap;
+	int ret = 0;
+
+	pthread_mutex_lock(&disk.flush_lock);
+	pthread_mutex_lock(&disk.queue_lock);
+	if (!disk.dirty.n) {
+		pthread_mutex_unlock(&disk.queue_lock);
+		pthread_mutex_unlock(&disk.flush_lock);
+		return 0;
+	}
+	swap = disk.flushing;
+	disk.flushing = disk.dirty;
+	disk.dirty = swap;
+	qsort(wq->q, wq->n, sizeof(*wq->q), queued_cmp);
+	pthread_mutex_unlock(&disk.queue_lock);
+
+	for (size_t i = 0, n; i < wq->n; i += n) {
+		struct queued_write *q = &wq->q[i];
+		const uint8_t *buf = q->data;
+		int gather = 0;
+
+		for (n = 1; i + n < wq->n && q[n].block == q->block + n; n++)
+			if (q[n].data != q->data + n * BLOCK_SIZE)
+				gather = 1;
+		/* Blocks queued in order are already next to each other */
+		if (gather) {
+			for (size_t k = 0; k < n; k++)
+				memcpy(disk.merge_buf + k * BLOCK_SIZE, q[k].data,
+				       BLOCK_SIZE);
+			buf = disk.merge_buf;
+		}
+		if (write_through(q->block, n, buf)) {
+			block_error("cannot write blocks %zu to %zu", q->block,
+				    q->block + n - 1);
+			ret = -1;
+		}
+	}
+
+	pthread_mutex_lock(&disk.queue_lock);
+	for (size_t i = 0; i < wq->n; i++)
+		PENDING_CLEAR(wq, wq->q[i].block);
+	wq->n = 0;
+	if (ret)
+		disk.queue_err = -1;
+	pthread_cond_broadcast(&disk.flushed);
+	pthread_mutex_unlock(&disk.queue_lock);
+	pthread_mutex_unlock(&disk.flush_lock);
 
-int block_disk_open(const char *diskname)
+	return ret;
+}
+
+/* Hold back a write, until the end of the batch or until it is flushed */
+static int queue_write(size_t block, size_t count, const void *buf)
 {
-	int fd;
-	struct stat st;
+	struct write_queue *wq = &disk.dirty;
+	int ret;
 
-	if (!diskname) {
-		block_error("invalid file diskname");
+	/* Large writes gain nothing from waiting. Holding flush_lock keeps
+	 * older contents of the blocks from being flushed over them */
+	if (count >= QUEUE_BYPASS) {
+		pthread_mutex_lock(&disk.flush_lock);
+		pthread_mutex_lock(&disk.queue_lock);
+		queue_drop(block, count);
+		pthread_mutex_unlock(&disk.queue_lock);
+		ret = write_through(block, count, buf);
+		pthread_mutex_unlock(&disk.flush_lock);
+		return ret;
+	}
+
+	pthread_mutex_lock(&disk.queue_lock);
+	for (size_t k = 0; k < count; k++) {
+		struct queued_write *q = queue_find(wq, block + k);
+
+		/* A full queue makes the writer wait for the flusher, or write
+		 * the queue itself when there is none */
+		while (!q && wq->n == disk.queue_max) {
+			if (disk.writeback) {
+				pthread_cond_signal(&disk.flusher_wake);
+				pthread_cond_wait(&disk.flushed, &disk.queue_lock);
+			} else {
+				pthread_mutex_unlock(&disk.queue_lock);
+				queue_flush();
+				pthread_mutex_lock(&disk.queue_lock);
+			}
+		}
+		if (!q) {
+			if (!wq->n) {
+				clock_gettime(CLOCK_MONOTONIC, &disk.dirty_since);
+				if (disk.writeback)
+					pthread_cond_signal(&disk.flusher_wake);
+			}
+			q = &wq->q[wq->n++];
+			q->block = block + k;
+			PENDING_SET(wq, block + k);
+		}
+		/* A block written again before it is flushed goes out once */
+		memcpy(q->data, (const uint8_t *)buf + k * BLOCK_SIZE, BLOCK_SIZE);
+	}
+	/* Past half full, the flusher does not wait for blocks to expire */
+	if (disk.writeback && wq->n >= disk.queue_max / 2)
+		pthread_cond_signal(&disk.flusher_wake);
+	pthread_mutex_unlock(&disk.queue_lock);
+
+	return 0;
+}
+
+/* Sleep while the scrubber is ahead of @rate blocks per second */
+static void scrub_throttle(const struct timespec *start, size_t done,
+			   unsigned int rate)
+{
+	struct timespec now, pause;
+	double ahead;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ahead = (double)done / rate - (now.tv_sec - start->tv_sec) -
+		(now.tv_nsec - start->tv_nsec) / 1e9;
+	if (ahead > 0.001) {
+		pause.tv_sec = ahead;
+		pause.tv_nsec = (ahead - pause.tv_sec) * 1e9;
+		nanosleep(&pause, NULL);
+	}
+}
+
+/*
+ * Read every block backed by data over and over, and check it against its
+ * checksum. Each bad block is reported once, and scrub_bad is the number
+ * found by the last pass.
+ */
+static void *scrub_thread(void *arg)
+{
+	void *buf;
+	uint8_t *reported = calloc((disk.bcount + 7) / 8, 1);
+	int last = 0;
+
+	/* Aligned, so that direct I/O needs no bounce buffer */
+	(void)arg;
+	if (posix_memalign(&buf, BLOCK_SIZE, BLOCK_SIZE))
+		buf = NULL;
+	while (buf && reported &&
+	       !__atomic_load_n(&disk.scrub_stop, __ATOMIC_RELAXED)) {
+		struct timespec start;
+		size_t done = 0;
+		int found = 0;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (size_t b = 0; b < disk.bcount; b++) {
+			int checked = 0, bad = 0;
+
+			if (__atomic_load_n(&disk.scrub_stop, __ATOMIC_RELAXED))
+				break;
+			/* Blocks written again but held back are stale on disk,
+			 * their checksum follows them once they are flushed */
+			pthread_mutex_lock(&disk.queue_lock);
+			pthread_mutex_lock(&disk.sum_lock);
+			if (MAPPED_TEST(b) && SUMMED_TEST(b) && !queue_lookup(b)) {
+				checked = 1;
+				bad = disk.be->read(b, 1, buf) ||
+				      crc32c(0, buf, BLOCK_SIZE) != disk.sums[b];
+			}
+			pthread_mutex_unlock(&disk.sum_lock);
+			pthread_mutex_unlock(&disk.queue_lock);
+
+			if (bad) {
+				if (!(reported[b / 8] & (1 << (b % 8))))
+					block_error("checksum mismatch on block %zu", b);
+				reported[b / 8] |= 1 << (b % 8);
+				found++;
+			}
+			if (checked && disk.scrub_rate)
+				scrub_throttle(&start, ++done, disk.scrub_rate);
+		}
+
+		/* A pass cut short only counts if it already found more */
+		if (!__atomic_load_n(&disk.scrub_stop, __ATOMIC_RELAXED)) {
+			last = found;
+			__atomic_add_fetch(&disk.scrub_passes, 1, __ATOMIC_RELAXED);
+		} else if (found > last) {
+			last = found;
+		}
+	}
+	disk.scrub_bad = last;
+	free(reported);
+	free(buf);
+	return NULL;
+}
+
+/*
+ * Flush the write-back cache once its oldest block has been dirty for
+ * expire_ms, or as soon as it is half full.
+ */
+static void *flusher_thread(void *arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&disk.queue_lock);
+	while (!disk.flusher_stop) {
+		struct timespec deadline = disk.dirty_since, now;
+
+		if (!disk.dirty.n) {
+			pthread_cond_wait(&disk.flusher_wake, &disk.queue_lock);
+			continue;
+		}
+		deadline.tv_sec += disk.expire_ms / 1000;
+		deadline.tv_nsec += (disk.expire_ms % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (disk.dirty.n < disk.queue_max / 2 &&
+		    (now.tv_sec < deadline.tv_sec ||
+		     (now.tv_sec == deadline.tv_sec && now.tv_nsec < deadline.tv_nsec))) {
+			pthread_cond_timedwait(&disk.flusher_wake, &disk.queue_lock,
+					       &deadline);
+			continue;
+		}
+		pthread_mutex_unlock(&disk.queue_lock);
+		queue_flush();
+		pthread_mutex_lock(&disk.queue_lock);
+	}
+	pthread_mutex_unlock(&disk.queue_lock);
+	return NULL;
+}
+
+/* Flush every block held back, then make the disk survive a crash */
+static int disk_sync(void)
+{
+	int ret = queue_flush();
+
+	if (disk.be->sync && disk.be->sync())
+		ret = -1;
+	return ret;
+}
+
+/* First error of the writes held back since the last report, 0 if none */
+static int queue_report(void)
+{
+	int ret;
+
+	pthread_mutex_lock(&disk.queue_lock);
+	ret = disk.queue_err;
+	disk.queue_err = 0;
+	pthread_mutex_unlock(&disk.queue_lock);
+	return ret;
+}
+
+int block_disk_create(const char *diskname, size_t count, int flags)
+{
+	const struct backend *be;
+	const char *path;
+	char *base = NULL, *sidecar;
+	int ret;
+
+	if (!diskname || !count || count > INT_MAX) {
+		block_error("invalid disk name or block count");
 		return -1;
 	}
 
-	if (disk.fd != INVALID_FD) {
-		block_error("disk already open");
+	be = find_backend(diskname, &path);
+	if (be->create) {
+		ret = be->create(path, count, &base);
+	} else {
+		ret = image_create(path, count) ? -1 : (int)count;
+		base = strdup(path);
+	}
+	if (ret < 0 || !base) {
+		free(base);
 		return -1;
 	}
 
-	if ((fd = open(diskname, O_RDWR, 0644)) < 0) {
-		perror("open");
+	/* A new disk has no history of changes, nor checksums unless asked for
+	 * (an empty file turns them on) */
+	if ((sidecar = sidecar_path(base, CBT_SUFFIX))) {
+		unlink(sidecar);
+		free(sidecar);
+	}
+	if ((sidecar = sidecar_path(base, SUM_SUFFIX))) {
+		unlink(sidecar);
+		if (flags & BLOCK_CREATE_SUMS) {
+			int fd = open(sidecar, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+			if (fd < 0)
+				ret = -1;
+			else
+				close(fd);
+		}
+		free(sidecar);
+	}
+	free(base);
+
+	return ret;
+}
+
+int block_disk_open(const char *diskname)
+{
+	const struct backend *be;
+	const char *path;
+
+	if (!diskname) {
+		block_error("invalid file diskname");
 		return -1;
 	}
 
-	if (fstat(fd, &st)) {
-		perror("fstat");
+	if (disk.fd != INVALID_FD) {
+		block_error("disk already open");
 		return -1;
 	}
 
-	/* The disk image's size should be a multiple of the block size */
-	if (st.st_size % BLOCK_SIZE != 0) {
-		block_error("size '%zu' is not multiple of '%d'",
-			    st.st_size, BLOCK_SIZE);
+	be = find_backend(diskname, &path);
+	disk.be = be;
+	if (be->open(path)) {
+		free(disk.mapped);
+		free(disk.base);
+		disk.mapped = NULL;
+		disk.base = NULL;
+		disk.fd = INVALID_FD;
 		return -1;
 	}
 
-	disk.fd = fd;
-	disk.bcount = st.st_size / BLOCK_SIZE;
+	/* Changes that are dropped at close have no history to keep */
+	if (be->persistent) {
+		cbt_open(disk.base);
+		sum_open(disk.base);
+	}
+	disk.reads = 0;
 
 	return 0;
 }
@@ -69,9 +1677,28 @@ int block_disk_close(void)
 		return -1;
 	}
 
-	close(disk.fd);
+	if (disk.scrubbing)
+		block_scrub_stop();
+	/* The cache and a batch left open still get their writes */
+	if (disk.writeback)
+		block_writeback_stop();
+	queue_flush();
+	disk.be->close();
+	cbt_close();
+	sum_close();
+	free(disk.mapped);
+	free(disk.base);
+	queue_free(&disk.dirty);
+	queue_free(&disk.flushing);
+	free(disk.merge_buf);
 
 	disk.fd = INVALID_FD;
+	disk.mapped = NULL;
+	disk.base = NULL;
+	disk.merge_buf = NULL;
+	disk.queue_max = 0;
+	disk.batching = 0;
+	disk.queue_err = 0;
 
 	return 0;
 }
@@ -99,22 +1726,305 @@ int block_write(size_t block, const void *buf)
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	mark_changed(block, 1);
+	if (disk.batching || disk.writeback)
+		return queue_write(block, 1, buf);
+
+	/* Perform the actual write into the disk image */
+	return write_through(block, 1, buf);
+}
+
+int block_read(size_t block, void *buf)
+{
+	const uint8_t *held;
+	int ret = 0;
+
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (block >= disk.bcount) {
+		block_error("block index out of bounds (%zu/%zu)",
+			    block, disk.bcount);
 		return -1;
 	}
 
-	/* Perform the actual write into the disk image */
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
+	/* Reads do not wait for writes held back, they take the latest
+	 * contents from them. queue_lock keeps them from being flushed until
+	 * the read is done */
+	pthread_mutex_lock(&disk.queue_lock);
+	held = queue_lookup(block);
+	if (held) {
+		memcpy(buf, held, BLOCK_SIZE);
+	} else if (!MAPPED_TEST(block)) {
+		/* Never-written blocks read back as zeros, no need to ask the host */
+		memset(buf, 0, BLOCK_SIZE);
+	} else {
+		/* Perform the actual read from the disk image */
+		ret = disk.be->read(block, 1, buf) ? -1 : sum_verify(block, 1, buf);
+	}
+	pthread_mutex_unlock(&disk.queue_lock);
+
+	return ret;
+}
+
+
+int block_write_range(size_t block, size_t count, const void *buf)
+{
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (block + count > disk.bcount || block + count < block) {
+		block_error("block range out of bounds (%zu+%zu/%zu)",
+			    block, count, disk.bcount);
+		return -1;
+	}
+
+	mark_changed(block, count);
+	if (disk.batching || disk.writeback)
+		return queue_write(block, count, buf);
+
+	return write_through(block, count, buf);
+}
+
+int block_read_range(size_t block, size_t count, void *buf)
+{
+	size_t held;
+	int ret = 0;
+
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (block + count > disk.bcount || block + count < block) {
+		block_error("block range out of bounds (%zu+%zu/%zu)",
+			    block, count, disk.bcount);
+		return -1;
+	}
+
+	/* Reads do not wait for writes held back, they read around them */
+	pthread_mutex_lock(&disk.queue_lock);
+	held = queue_count(block, count);
+	if (held == count) {
+		/* Nothing to read */
+	} else if (range_is_hole(block, count)) {
+		memset(buf, 0, count * BLOCK_SIZE);
+	} else if (disk.be->read(block, count, buf)) {
+		ret = -1;
+	} else if (!held) {
+		ret = sum_verify(block, count, buf);
+	} else {
+		/* Blocks being flushed may be half written */
+		for (size_t b = block; b < block + count && !ret; b++)
+			if (!queue_lookup(b))
+				ret = sum_verify(b, 1, (uint8_t *)buf + (b - block) * BLOCK_SIZE);
+	}
+	if (!ret && held)
+		queue_overlay(block, count, buf);
+	pthread_mutex_unlock(&disk.queue_lock);
+
+	return ret;
+}
+
+int block_discard(size_t block, size_t count)
+{
+	int ret;
+
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (block + count > disk.bcount || block + count < block) {
+		block_error("block range out of bounds (%zu+%zu/%zu)",
+			    block, count, disk.bcount);
+		return -1;
+	}
+
+	/* Writes held back go out first, in case the blocks they hold point
+	 * to the ones released */
+	if (queue_flush())
 		return -1;
+
+	if (range_is_hole(block, count))
+		return 0;
+
+	/* Blocks that cannot be released keep their contents */
+	pthread_mutex_lock(&disk.sum_lock);
+	ret = disk.be->discard(block, count);
+	if (ret) {
+		pthread_mutex_unlock(&disk.sum_lock);
+		return ret < 0 ? -1 : 0;
+	}
+
+	for (size_t b = block; b < block + count; b++) {
+		MAPPED_CLEAR(b);
+		if (disk.sum_fd != INVALID_FD)
+			SUMMED_CLEAR(b);
 	}
+	pthread_mutex_unlock(&disk.sum_lock);
+	mark_changed(block, count);
 
 	return 0;
 }
 
-int block_read(size_t block, void *buf)
+int block_batch_start(void)
+{
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	/* The queues are set up by the first batch of the disk */
+	if (!disk.queue_max && queue_alloc(QUEUE_MAX))
+		return -1;
+
+	disk.batching++;
+	return 0;
+}
+
+int block_batch_end(void)
+{
+	if (disk.fd == INVALID_FD || !disk.batching) {
+		block_error("no batch started");
+		return -1;
+	}
+
+	/* The write-back cache flushes the batch when it sees fit */
+	if (--disk.batching)
+		return 0;
+	if (!disk.writeback)
+		queue_flush();
+
+	return queue_report();
+}
+
+int block_writeback_start(unsigned int expire_ms, size_t dirty_max)
+{
+	pthread_condattr_t attr;
+
+	if (disk.fd == INVALID_FD || disk.writeback) {
+		block_error("no disk currently open, or already caching");
+		return -1;
+	}
+	if (dirty_max < 2) {
+		block_error("cache of %zu blocks is too small", dirty_max);
+		return -1;
+	}
+
+	/* The batch queues make way for queues of the cache's size */
+	if (queue_flush())
+		return -1;
+	if (disk.queue_max != dirty_max) {
+		queue_free(&disk.dirty);
+		queue_free(&disk.flushing);
+		free(disk.merge_buf);
+		disk.merge_buf = NULL;
+		disk.queue_max = 0;
+		if (queue_alloc(dirty_max))
+			return -1;
+	}
+
+	/* Deadlines are taken from the monotonic clock */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&disk.flusher_wake, &attr);
+	pthread_condattr_destroy(&attr);
+	disk.expire_ms = expire_ms;
+	disk.flusher_stop = 0;
+	if (pthread_create(&disk.flusher, NULL, flusher_thread, NULL)) {
+		pthread_cond_destroy(&disk.flusher_wake);
+		return -1;
+	}
+	disk.writeback = 1;
+
+	return 0;
+}
+
+int block_writeback_stop(void)
+{
+	if (disk.fd == INVALID_FD || !disk.writeback) {
+		block_error("no write-back cache");
+		return -1;
+	}
+
+	pthread_mutex_lock(&disk.queue_lock);
+	disk.flusher_stop = 1;
+	pthread_cond_signal(&disk.flusher_wake);
+	pthread_mutex_unlock(&disk.queue_lock);
+	pthread_join(disk.flusher, NULL);
+	pthread_cond_destroy(&disk.flusher_wake);
+	disk.writeback = 0;
+
+	/* Whatever is left is written now */
+	queue_flush();
+
+	return queue_report();
+}
+
+int block_flush(void)
+{
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	queue_flush();
+
+	return queue_report();
+}
+
+void *block_map(size_t block, size_t count)
+{
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return NULL;
+	}
+
+	if (!count || block + count > disk.bcount || block + count < block) {
+		block_error("block range out of bounds (%zu+%zu/%zu)",
+			    block, count, disk.bcount);
+		return NULL;
+	}
+
+	/* The mapping shows the image, which must hold the blocks first */
+	if (!disk.be->map || queue_flush())
+		return NULL;
+
+	return disk.be->map(block, count);
+}
+
+int block_sync(void)
+{
+	int ret;
+
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	ret = disk_sync();
+	if (queue_report())
+		ret = -1;
+
+	return ret;
+}
+
+int block_epoch(void)
+{
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	return disk.cbt_fd == INVALID_FD ? 0 : (int)disk.epoch;
+}
+
+int block_changed(size_t block)
 {
 	if (disk.fd == INVALID_FD) {
 		block_error("no disk currently open");
@@ -127,18 +2037,105 @@ int block_read(size_t block, void *buf)
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	return disk.cbt_fd == INVALID_FD || CHANGED_TEST(block) ? 1 : 0;
+}
+
+int block_checkpoint(int epoch)
+{
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (epoch < 0 || (epoch && epoch <= block_epoch())) {
+		block_error("epoch %d does not come after %d", epoch, block_epoch());
+		return -1;
+	}
+
+	/* The blocks of the epoch that ends must be on disk before it is forgotten */
+	if (disk_sync())
+		return -1;
+
+	/* The first checkpoint starts tracking */
+	if (disk.cbt_fd == INVALID_FD) {
+		if (!disk.cbt_path ||
+		    !(disk.changed = calloc((disk.bcount + 7) / 8, 1)))
+			return -1;
+		disk.cbt_fd = open(disk.cbt_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (disk.cbt_fd < 0) {
+			perror("open");
+			free(disk.changed);
+			disk.changed = NULL;
+			return -1;
+		}
+	}
+
+	disk.epoch = epoch ? (uint32_t)epoch : disk.epoch + 1;
+	memset(disk.changed, 0, (disk.bcount + 7) / 8);
+	if (cbt_save(0)) {
+		perror("cbt");
+		return -1;
+	}
+
+	return disk.epoch;
+}
+
+int block_verify(int mode)
+{
+	int old = disk.verify;
+
+	if (mode < BLOCK_VERIFY_OFF || mode > BLOCK_VERIFY_ALWAYS) {
+		block_error("invalid verify mode %d", mode);
+		return -1;
+	}
+
+	disk.verify = mode;
+	return old;
+}
+
+int block_scrub_start(unsigned int rate)
+{
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (disk.sum_fd == INVALID_FD || disk.scrubbing) {
+		block_error("no checksums to scrub, or already scrubbing");
 		return -1;
 	}
 
-	/* Perform the actual read from the disk image */
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("read");
+	disk.scrub_rate = rate;
+	disk.scrub_stop = 0;
+	disk.scrub_bad = 0;
+	disk.scrub_passes = 0;
+	if (pthread_create(&disk.scrub, NULL, scrub_thread, NULL)) {
+		block_error("cannot start scrubbing");
 		return -1;
 	}
+	disk.scrubbing = 1;
 
 	return 0;
 }
 
+int block_scrub_passes(void)
+{
+	if (!disk.scrubbing)
+		return -1;
+
+	return __atomic_load_n(&disk.scrub_passes, __ATOMIC_RELAXED);
+}
+
+int block_scrub_stop(void)
+{
+	if (!disk.scrubbing) {
+		block_error("not scrubbing");
+		return -1;
+	}
+
+	__atomic_store_n(&disk.scrub_stop, 1, __ATOMIC_RELAXED);
+	pthread_join(disk.scrub, NULL);
+	disk.scrubbing = 0;
+
+	return disk.scrub_bad;
+}
@@ -14,11 +14,41 @@
  * blocks can be read from it with block_read() or written to it with
  * block_write().
  *
+ * A prefix of @diskname picks how blocks are stored:
+ * "direct:<file>" bypasses the host page cache (O_DIRECT), so that latency
+ * does not depend on how much memory the host can spare for caching;
+ * "mem:<file>" reads the whole image in memory, and drops the changes when
+ * the disk is closed, for tests and benchmarks without any I/O;
+ * "memsave:<file>" does the same, but saves the changes back to the image
+ * when the disk is closed or checkpointed;
+ * "stripe:[<unit>:]<file>,<file>..." spreads the disk over several images of
+ * the same size, <unit> blocks (16 by default) at a time in turn, and
+ * transfers ranges of blocks to all of them at once.
+ * Without a prefix, blocks are read and written through the image file.
+ *
  * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
  * or is already open. 0 otherwise.
  */
 int block_disk_open(const char *diskname);
 
+/* Flags of block_disk_create() */
+#define BLOCK_CREATE_SUMS	1
+
+/**
+ * block_disk_create - Create virtual disk file
+ * @diskname: Name of the virtual disk file, as given to block_disk_open()
+ * @count: Number of blocks of the disk
+ * @flags: %BLOCK_CREATE_SUMS to keep a checksum of every block
+ *
+ * Create the image file(s) of virtual disk @diskname, replacing any that
+ * exist, with all blocks reading back as zeros. A striped disk is rounded up
+ * to a whole number of stripes on each of its images.
+ *
+ * Return: -1 if @diskname or @count is invalid, or if the image files cannot
+ * be created. Otherwise the number of blocks of the new disk.
+ */
+int block_disk_create(const char *diskname, size_t count, int flags);
+
 /**
  * block_disk_close - Close virtual disk file
  *
@@ -60,5 +90,240 @@ int block_write(size_t block, const void *buf);
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_write_range - Write consecutive blocks to disk
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer to write in the blocks
+ *
+ * Write the content of buffer @buf (@count * %BLOCK_SIZE bytes) in the virtual
+ * disk's blocks @block to @block + @count - 1, as a single I/O operation.
+ *
+ * Return: -1 if any block of the range is out of bounds or inaccessible or if
+ * the writing operation fails. 0 otherwise.
+ */
+int block_write_range(size_t block, size_t count, const void *buf);
+
+/**
+ * block_read_range - Read consecutive blocks from disk
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled with content of blocks
+ *
+ * Read the content of virtual disk's blocks @block to @block + @count - 1
+ * (@count * %BLOCK_SIZE bytes) into buffer @buf, as a single I/O operation.
+ *
+ * Return: -1 if any block of the range is out of bounds or inaccessible, or if
+ * the reading operation fails. 0 otherwise.
+ */
+int block_read_range(size_t block, size_t count, void *buf);
+
+/**
+ * block_discard - Release blocks of the disk
+ * @block: Index of the first block to release
+ * @count: Number of blocks to release
+ *
+ * Tell the virtual disk that the content of blocks @block to
+ * @block + @count - 1 is no longer needed. The host storage backing them is
+ * released when the host supports it (the image file becomes sparse), and the
+ * blocks read back as zeros afterwards. Reading blocks that were never written
+ * or that were released does not perform any I/O.
+ *
+ * Return: -1 if any block of the range is out of bounds or inaccessible or if
+ * the operation fails. 0 otherwise.
+ */
+int block_discard(size_t block, size_t count);
+
+/**
+ * block_batch_start - Start holding writes back in a batch
+ *
+ * Until the matching block_batch_end(), block_write() and block_write_range()
+ * queue the blocks they are given instead of writing them, except for large
+ * ranges, which go to the disk at once. A block written again while it is
+ * queued is only written once. Reads do not wait for the queue: they go to
+ * the disk at once, and take the blocks that have a write queued from the
+ * queue. Batches nest, only the outermost one sends the writes.
+ *
+ * Return: -1 if there was no virtual disk file opened, or if the queue cannot
+ * be allocated. 0 otherwise.
+ */
+int block_batch_start(void);
+
+/**
+ * block_batch_end - Send the writes of a batch
+ *
+ * Sort the queued writes by block number and send them in one sweep up the
+ * disk, with neighbouring blocks merged into single writes. A full queue, a
+ * call to block_discard() or block_checkpoint(), and closing the disk send the
+ * writes queued so far as well. With the write-back cache on, the writes stay
+ * in the cache instead.
+ *
+ * Return: -1 if no batch was started, or if a write sent since the last
+ * report failed. 0 otherwise.
+ */
+int block_batch_end(void);
+
+/**
+ * block_writeback_start - Turn the write-back cache on
+ * @expire_ms: Longest time in milliseconds that a written block stays in the
+ * cache
+ * @dirty_max: Most blocks that the cache holds
+ *
+ * From now on, block_write() and block_write_range() only copy the blocks they
+ * are given to the cache and return, except for large ranges, which still go
+ * to the disk at once. A background thread writes the whole cache, sorted and
+ * merged as in block_batch_end(), once its oldest block has been there for
+ * @expire_ms, or as soon as the cache is half full. Writers only wait for it
+ * when the cache is full. Reads take the blocks that are in the cache from it.
+ *
+ * Return: -1 if there was no virtual disk file opened, if the cache is already
+ * on, or if it cannot be allocated. 0 otherwise.
+ */
+int block_writeback_start(unsigned int expire_ms, size_t dirty_max);
+
+/**
+ * block_writeback_stop - Turn the write-back cache off
+ *
+ * Write the blocks left in the cache and stop its thread. Closing the virtual
+ * disk file does the same.
+ *
+ * Return: -1 if the cache was not on, or if a write from the cache failed
+ * since the last report. 0 otherwise.
+ */
+int block_writeback_stop(void);
+
+/**
+ * block_flush - Write the blocks held back so far
+ *
+ * Write the blocks held in the write-back cache or in a batch now, so that
+ * they reach the virtual disk file before any block written after this call.
+ * Unlike block_sync(), the host may still cache them.
+ *
+ * Return: -1 if there was no virtual disk file opened, or if a write failed
+ * since the last report. 0 otherwise.
+ */
+int block_flush(void);
+
+/**
+ * block_sync - Make the blocks written so far durable
+ *
+ * Write the blocks held in the write-back cache or in a batch, then flush the
+ * virtual disk file to the host storage, so that every block written so far
+ * survives a crash.
+ *
+ * Return: -1 if there was no virtual disk file opened, or if a write failed
+ * since the last report. 0 otherwise.
+ */
+int block_sync(void);
+
+/**
+ * block_map - Map consecutive blocks of the disk in memory
+ * @block: Index of the first block to map
+ * @count: Number of blocks to map
+ *
+ * Write the blocks held back as block_flush() does, then map blocks @block to
+ * @block + @count - 1 read-only in the address space of the caller, straight
+ * from the image file, without copying them. Later writes show in the mapping
+ * once they reach the image. Blocks read through the mapping are not checked
+ * against their checksums. The mapping is released with munmap(), and stays
+ * valid after the disk is closed.
+ *
+ * Return: NULL if there was no virtual disk file opened, if any block of the
+ * range is out of bounds, or if the blocks cannot be mapped: the in-memory
+ * backends have no image to map, and only blocks of the same stripe unit can
+ * be mapped together on a striped disk. Otherwise the address of the mapping.
+ */
+void *block_map(size_t block, size_t count);
+
+/**
+ * block_checkpoint - Start a new epoch of changed block tracking
+ * @epoch: Number of the new epoch, 0 for the one after the current epoch
+ *
+ * Flush the blocks written so far to the host storage, then forget which
+ * blocks of the virtual disk changed: from now on, block_changed() only
+ * reports the blocks written or released after this call. The first checkpoint of a virtual disk file starts tracking its
+ * changes, which are then kept across opens in file "<diskname>.cbt". If a
+ * process dies with the disk open, every block counts as changed until the
+ * next checkpoint.
+ *
+ * Return: -1 if there was no virtual disk file opened, or if @epoch does not
+ * come after the current epoch, or if the tracking file cannot be written.
+ * Otherwise the number of the new epoch.
+ */
+int block_checkpoint(int epoch);
+
+/**
+ * block_epoch - Get the current epoch of changed block tracking
+ *
+ * Return: -1 if there was no virtual disk file opened, 0 if the changes of the
+ * virtual disk are not tracked, otherwise the number of the epoch started by
+ * the last checkpoint.
+ */
+int block_epoch(void);
+
+/**
+ * block_changed - Tell whether a block changed since the last checkpoint
+ * @block: Index of the block
+ *
+ * Return: -1 if there was no virtual disk file opened or if @block is out of
+ * bounds. 1 if block @block was written or released since the last
+ * checkpoint, or if the changes of the virtual disk are not tracked. 0
+ * otherwise.
+ */
+int block_changed(size_t block);
+
+/* Checksum verification modes, for block_verify() */
+#define BLOCK_VERIFY_OFF	0
+#define BLOCK_VERIFY_SAMPLED	1
+#define BLOCK_VERIFY_ALWAYS	2
+
+/**
+ * block_verify - Choose how often blocks read are checked against checksums
+ * @mode: %BLOCK_VERIFY_ALWAYS to check every block read (the default),
+ * %BLOCK_VERIFY_SAMPLED to check one read in sixteen, or %BLOCK_VERIFY_OFF
+ *
+ * A virtual disk file that has a "<diskname>.sum" file next to it keeps a
+ * CRC-32C checksum of each of its blocks there; an empty file turns checksums
+ * on. Checksums are updated by every write, whatever the mode. A block read
+ * that does not match its checksum makes block_read() and block_read_range()
+ * fail. Blocks written before checksums were turned on, or when a process died
+ * with the disk open, get theirs when they are next written or read.
+ *
+ * Return: -1 if @mode is invalid, otherwise the previous mode.
+ */
+int block_verify(int mode);
+
+/**
+ * block_scrub_start - Start checking the whole disk in the background
+ * @rate: Most blocks to check per second, 0 for no limit
+ *
+ * Start a thread that reads every block of the virtual disk holding data over
+ * and over, and checks it against its checksum, so that corruption is found
+ * before the blocks are needed. Each block that does not match is reported
+ * once on stderr.
+ *
+ * Return: -1 if there was no virtual disk file opened, if its blocks are not
+ * checksummed or if it is already being scrubbed. 0 otherwise.
+ */
+int block_scrub_start(unsigned int rate);
+
+/**
+ * block_scrub_passes - Get the progress of scrubbing
+ *
+ * Return: -1 if the disk is not being scrubbed, otherwise the number of
+ * complete passes over the disk so far.
+ */
+int block_scrub_passes(void);
+
+/**
+ * block_scrub_stop - Stop checking the disk in the background
+ *
+ * Closing the virtual disk file stops scrubbing as well.
+ *
+ * Return: -1 if the disk is not being scrubbed, otherwise the number of blocks
+ * that did not match their checksum during the last pass over the disk.
+ */
+int block_scrub_stop(void);
+
 #endif /* _DISK_H */
 
@@ -1,19 +1,110 @@
 #include <assert.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
+#include "crc32c.h"
 #include "disk.h"
 #include "fs.h"
+#include "lz.h"
 
 /* Useful macros*/
-#define FAT_ENTRIES 2048;
-//#define FAT_EOC 0xffff;
+#define FAT_ENTRIES 2048   // entries per FAT block, 16-bit FAT
+#define FAT32_ENTRIES 1024 // entries per FAT block, 32-bit FAT
+#define FAT16_EOC 0xffff
+#define FAT32_EOC 0xffffffff
+
+// superblock extension, stored in what used to be padding
+#define SUPER_EXT_MAGIC 0x31545845 // "EXT1"
+#define SUPER_EXT_VERSION 1
+
+// optional features of "ECS150FX" volumes, chosen when formatting
+#define FEAT_TAILS 0x1    // small files are packed into shared tail blocks
+#define FEAT_COMPRESS 0x2 // files are compressed when they get closed
+#define FEAT_DEDUP 0x4    // identical data blocks are stored once
+
+// small files are packed into tail blocks when they get closed
+#define ROOT_PACKED 0x1            // root entry flag: file lives in a tail block
+#define TAIL_MAGIC 0x4c494154     // "TAIL"
+#define PACK_MAX (BLOCK_SIZE / 2) // largest file that gets packed
+
+// larger files are compressed block by block when they get closed
+#define ROOT_COMPRESSED 0x2     // root entry flag: chain holds a compressed stream
+#define ROOT_INCOMPRESSIBLE 0x4 // compression did not pay off since the last write
+#define CZ_MAGIC 0x315a4c43     // "CLZ1"
+#define CZ_RAW 0x1              // extent flag: block stored as is
+#define CZ_CACHE_SLOTS 32       // decompressed blocks kept in memory
+#define CZ_INDEX_SLOTS 8        // compressed files whose index is kept in memory
+
+// files can map their blocks to shared data blocks, whose FAT entry holds a
+// reference count instead of a link (32-bit FAT volumes only)
+#define ROOT_MAPPED 0x8          // root entry flag: chain holds a block map
+#define FAT32_SHARED 0x80000000  // FAT entry flag: shared block, low bits are references
+#define SHARED_REFS_MAX 0x7ffffffe
+#define MAP_ENTRIES (BLOCK_SIZE / 4) // block map entries per block
+#define DD_MAP_SLOTS 8               // mapped files whose map is kept in memory
+#define DD_LOAD_BATCH 64             // shared blocks read at once to fingerprint them
+
+// snapshots keep a frozen copy of the FAT and root directory, whose blocks the
+// volume then leaves alone (32-bit FAT volumes only)
+#define SNAP_MAX 8              // snapshots of a volume
+#define SNAP_MAGIC 0x50414e53  // "SNAP"
+
+// blocks written to a mounted volume are cached, and flushed in the background
+#define WRITEBACK_EXPIRE_MS 3000 // longest a block stays in the cache
+#define WRITEBACK_BLOCKS 1024    // blocks the cache holds
+
+// block buffers come from a pool instead of being allocated by every call,
+// page-aligned so that direct I/O can use them as they are
+#define BUF_POOL 32    // spare buffers the pool keeps
+#define BUF_ALIGN 4096 // host page size
+
+// most bytes that the calls returning an int transfer at once; the *64 ones
+// have no such limit
+#define IO_MAX 0x7ffff000
+
+// descriptors live in chunks that never move, so that the table can grow while
+// descriptors are being used; the low bits of a descriptor are its slot, the
+// others the generation of the slot, which changes whenever it is closed
+#define FD_CHUNK 256                                // descriptors per chunk
+#define FD_CHUNKS (FS_OPEN_MAX_COUNT / FD_CHUNK)   // most chunks of the table
+#define FD_SLOT_BITS 16                             // FS_OPEN_MAX_COUNT slots
+#define FD_GEN_MASK 0x7fff                          // keeps descriptors positive
+static_assert(FS_OPEN_MAX_COUNT == 1 << FD_SLOT_BITS, "a descriptor's slot is its low bits");
 
 /* Structs */
 
+// allocation state saved by a clean unmount so the next mount does not have to
+// scan the FAT and root directory; only trusted when the checksum matches and
+// the volume was not modified since (clean == 1)
+struct super_ext{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t clean;      // cleared on disk before the first change of a session
+	uint32_t free_blks;  // free FAT entries
+	uint32_t free_roots; // free root directory entries
+	uint32_t alloc_hint; // next-fit allocation cursor
+	uint32_t root_sum;   // fingerprint of the root directory these were saved with
+	uint32_t checksum;   // over all the fields above
+} __attribute__((packed));
+
+// geometry of volumes with a 32-bit FAT (signature "ECS150FX"), which do not
+// fit in the 16-bit fields of the original superblock
+struct super_geo{
+	uint32_t total_blks;
+	uint32_t root_dir_idx;
+	uint32_t data_blk_idx;
+	uint32_t total_data_blks;
+	uint32_t fat_blks;
+	uint32_t dir_blks;   // blocks of the root directory, 0 is the same as 1
+} __attribute__((packed));
+
 // very first block of the disk, contains information about filesystem
 struct super_block{
 	uint64_t signature;  // 8 bytes, signature must be equal to "ECS150FS"
@@ -22,8 +113,14 @@ struct super_block{
 	uint16_t data_blk_idx; // 2 bytes
 	uint16_t total_data_blks; // 2 bytes
 	uint8_t fat_blks; // 1 bytes
-	uint8_t padding[4079]; // 4079 bytes
-}; 
+	struct super_ext ext; // 28 bytes
+	struct super_geo geo; // 24 bytes, only used by "ECS150FX" volumes
+	uint32_t features;    // FEAT_* flags, only used by "ECS150FX" volumes
+	uint32_t tail_blk;    // tail block being filled, saved with the allocation state
+	uint32_t snap_blk[SNAP_MAX]; // first block of each snapshot, 0 for a free slot
+	uint32_t snap_seq;           // snapshots taken so far
+	uint8_t padding[4071 - sizeof(struct super_ext) - sizeof(struct super_geo) - 4 * (SNAP_MAX + 1)];
+} __attribute__((packed));
 
 // linked list structure for FAT blocks
 struct fat_blocks{
@@ -38,689 +135,3465 @@ struct root_entry{
 	char filename[16];
 	uint32_t file_size;
 	uint16_t first_data_idx;
-	int8_t padding[10];
+	uint16_t first_data_hi; // upper half of first_data_idx on 32-bit FAT volumes
+	uint8_t flags;          // ROOT_* flags
+	uint8_t reserved;
+	uint16_t tail_off;      // where the file starts in its tail block, if packed
+	uint32_t size_hi;       // upper half of file_size on 32-bit FAT volumes
 };
 
+// start of a tail block: file tails are appended after it, and the block is
+// freed once the last of them goes away
+struct tail_header{
+	uint32_t magic;
+	uint16_t live; // packed files stored in the block
+	uint16_t end;  // offset where the next tail goes
+} __attribute__((packed));
+
 // array structure for root entries
 struct root_blocks{
 	struct root_entry entries[FS_FILE_MAX_COUNT];
 };
 
+// first slot of each block of a hashed root directory (more than one block):
+// files are stored in the block their name hashes to, or in the next block
+// with a free slot, and overflow counts the files that went past this one
+struct dir_header{
+	uint32_t used;     // files stored in this block
+	uint32_t overflow; // files that hash here but are stored further on
+	uint8_t padding[24];
+} __attribute__((packed));
+
+// start of the chain of a compressed file, followed by one extent per block of
+// the file; the compressed blocks come after, from the next block boundary
+struct cz_header{
+	uint32_t magic;
+	uint32_t blocks; // blocks of the uncompressed file
+} __attribute__((packed));
+
+struct cz_extent{
+	uint32_t off;   // from the start of the compressed blocks
+	uint16_t len;   // compressed size
+	uint16_t flags; // CZ_* flags
+} __attribute__((packed));
+
+// first block of the chain of a snapshot, which goes on with its copy of the
+// FAT and then of the root directory
+struct snap_header{
+	uint32_t magic;
+	uint32_t seq; // snap_seq of the volume when the snapshot was taken
+	char name[FS_FILENAME_LEN];
+	uint32_t fat_blks;
+	uint32_t dir_blks;
+} __attribute__((packed));
+
 struct data_blocks{
 	int8_t data[4096]; // 1 byte
 };
 
 struct disk_blocks{
 	struct super_block super;
-	struct root_blocks root;
-	struct fat_blocks *fat_blks;
-	struct data_blocks *data_blks;
+	struct root_blocks **dir; // root directory blocks, read on first use
+	uint8_t *dir_dirty;       // root directory blocks changed since the last metadata write
 	struct fat_entry *fat_entries;
+	uint32_t *fat32_entries; // same memory as fat_entries, on 32-bit FAT volumes
+	uint8_t *fat_dirty;      // FAT blocks changed since the last metadata write
+
+	// geometry, from the superblock fields matching the FAT width
+	int fat32;
+	uint32_t total_blks;
+	uint32_t root_dir_idx;
+	uint32_t data_blk_idx;
+	uint32_t total_data_blks;
+	uint32_t fat_blks;
+	uint32_t fat_per_blk;
+	uint32_t dir_blks;
+	int dir_hashed;  // directory blocks start with a struct dir_header
+	int dir_per_blk; // file entries per directory block
+	int dir_entries; // file entries in the whole directory
+	uint32_t features;
+
+	uint8_t *frozen; // data blocks still used by a snapshot, NULL if there is none
+	int read_only;   // a snapshot is mounted instead of the volume
+};
+
+// last block of a chain that was looked up, so that sequential accesses do not
+// walk the chain from its first block every time
+struct chain_hint{
+	int blk_num; // position in the chain, -1 if unknown
+	int blk_idx; // data block index at that position
 };
 
 struct file_descriptor{
-	int offset;
-	int status; //0 is open, 1 is closed
-	char *filename;
+	size_t offset;
+	int status;    // 1 while open, 0 while in the free list
+	int gen;       // generation of the slot, part of the descriptor
+	int next_free; // next slot of the free list, plus one
+	int root_idx;  // directory entry of the file, which cannot move while open
+};
+
+// state shared by all the descriptors open on a file
+struct open_file{
+	int refs; // descriptors open on the file, 0 if it is not open
+	struct chain_hint hint;
 };
 
 // Global Variables
 int fat_blk_free;  // Keeps track of free fat blocks
 int rdir_blk_free; // Keeps track of free root blocks
+int alloc_hint;    // where the next data block allocation starts looking
+int tail_blk;      // tail block new small files are packed into, -1 if none
+int volume_dirty;  // superblock on disk already says the volume is not clean
 struct disk_blocks cur_disk; // global var for fs_info
-int fd_count; // count the current number of file descriptors?
-struct file_descriptor file_desc[FS_OPEN_MAX_COUNT]; // keep all fds here
+int fd_count; // descriptors currently open
+struct file_descriptor *fd_chunks[FD_CHUNKS]; // descriptor table, by slot
+int fd_slots;       // slots in the chunks allocated so far
+uint64_t fd_free;   // free list: tag in the high half, first slot plus one in the low half
+pthread_mutex_t fd_grow_lock = PTHREAD_MUTEX_INITIALIZER;
+// held by every public call, so that threads sharing the volume take turns
+// with its metadata; recursive, as some calls are made of others
+pthread_mutex_t fs_lock;
+pthread_once_t fs_lock_once = PTHREAD_ONCE_INIT;
+struct open_file *open_files; // by directory entry, for the mounted volume
+
+// decompressed blocks of compressed files, by file and block number
+struct cz_cache_slot{
+	int root_idx; // -1 if unused
+	uint32_t blk;
+	char data[BLOCK_SIZE];
+};
+struct cz_cache_slot cz_cache[CZ_CACHE_SLOTS];
+
+// extent tables of compressed files being read
+struct cz_index_slot{
+	int root_idx; // -1 if unused
+	uint32_t blocks;
+	struct cz_extent *ext;
+};
+struct cz_index_slot cz_index[CZ_INDEX_SLOTS];
+int cz_index_next; // slot replaced next
+
+// block maps of mapped files being accessed, kept in step with the disk
+struct dd_map_slot{
+	int root_idx; // -1 if unused
+	uint32_t n;   // blocks of the file
+	uint32_t cap;
+	uint32_t *blk;
+};
+struct dd_map_slot dd_maps[DD_MAP_SLOTS];
+int dd_map_next; // slot replaced next
+
+// fingerprints of the shared blocks of a deduplicating volume, hashed into
+// buckets of blocks linked by block index; built by the first write
+struct dd_index{
+	int loaded;
+	uint32_t mask; // buckets - 1
+	int *head;     // first block of each bucket, -1 if empty
+	int *next;     // next block in the same bucket, by block index
+	uint32_t *fp;  // fingerprint of each indexed block, by block index
+};
+struct dd_index dd_index;
+
+// spare block buffers, shared by every thread using the volume
+void *buf_pool[BUF_POOL];
+int buf_pool_free;
+pthread_mutex_t buf_pool_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /* Helper Functions */
 
-// helper functions for phase 1
-// return how many fat entries are still free
-int free_fats()
+// page-aligned buffer of n blocks, NULL if out of memory
+void *blk_alloc(size_t n)
 {
-	int free_count = 0;
-	// read through fat blocks, look at fat entries
-	for (int i = 0; i < cur_disk.super.total_data_blks; i++)
-	{
-			if (cur_disk.fat_entries[i].entry == 0) //entry is assigned value
-			{
-				free_count++;
-			}
-	}
-	return free_count;
+	void *buf;
+	return posix_memalign(&buf, BUF_ALIGN, n * BLOCK_SIZE) ? NULL : buf;
 }
 
-// Function to help find the number of free spots in the root block
-int free_roots()
+// one-block buffer from the pool, to give back with blk_put()
+char *blk_get(void)
 {
-	int free_count = FS_FILE_MAX_COUNT;
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
-	{
-		if (cur_disk.root.entries[i].filename[0] != '\0')
-		{
-			free_count--;
-		}
-		else if (cur_disk.root.entries[i].filename[0] == '\0')
-		{
-			return free_count;
-		}
-	}
-	return 0;
+	char *buf = NULL;
+	pthread_mutex_lock(&buf_pool_lock);
+	if (buf_pool_free > 0) buf = buf_pool[--buf_pool_free];
+	pthread_mutex_unlock(&buf_pool_lock);
+	return buf ? buf : blk_alloc(1);
+}
+
+char *blk_get_zero(void)
+{
+	char *buf = blk_get();
+	if (buf) memset(buf, 0, BLOCK_SIZE);
+	return buf;
 }
 
-// Function to help find a free spot in the fat blocks
-int find_free_fat_spot()
+void blk_put(void *buf)
 {
-	for(int i = 0; i < cur_disk.super.total_data_blks; i++)
+	if (!buf) return;
+	pthread_mutex_lock(&buf_pool_lock);
+	if (buf_pool_free < BUF_POOL)
 	{
-		if(cur_disk.fat_entries[i].entry == 0)
-			return i;
+		buf_pool[buf_pool_free++] = buf;
+		buf = NULL;
 	}
-	//If cannot find a free spot return -1
-	return -1;
+	pthread_mutex_unlock(&buf_pool_lock);
+	free(buf);
+}
+
+// free the spare buffers, once the volume is unmounted
+void blk_pool_drain(void)
+{
+	pthread_mutex_lock(&buf_pool_lock);
+	while (buf_pool_free > 0) free(buf_pool[--buf_pool_free]);
+	pthread_mutex_unlock(&buf_pool_lock);
+}
+
+void fs_lock_init(void)
+{
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&fs_lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+int fs_lock_take(void)
+{
+	pthread_once(&fs_lock_once, fs_lock_init);
+	pthread_mutex_lock(&fs_lock);
+	return 1;
 }
 
-// Function to help find a free spot in the root block
-int find_free_root_spot()
+void fs_lock_release(int *held)
 {
-	int free_spot = 0;
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	if (*held) pthread_mutex_unlock(&fs_lock);
+}
+
+// first statement of every public call: fs_lock is held until it returns
+#define FS_LOCKED int fs_locked __attribute__((cleanup(fs_lock_release))) = fs_lock_take(); (void)fs_locked
+
+// FNV-1a hash, used to fingerprint small pieces of metadata
+uint32_t fnv1a(const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < len; i++)
 	{
-		if (cur_disk.root.entries[i].filename[0] == '\0')
-		{
-			free_spot = i;
-			return free_spot;
-		}
+		hash = (hash ^ p[i]) * 16777619u;
 	}
-	// If -1 return then there are no more free spots in the root
-	return -1;
+	return hash;
 }
 
-// helper functions for phase 2
-int file_exist(const char *filename)
+// root directory block, read from the disk the first time it is needed
+struct root_blocks *dir_block(uint32_t blk)
 {
-	for (int i = 0; i < 128; i++)
+	if (!cur_disk.dir[blk])
 	{
-		if (strcmp(filename, cur_disk.root.entries[i].filename) == 0) return 1; //found
-		// else if (cur_disk.root.entries[i].filename[0] == '\0') return -1;
+		cur_disk.dir[blk] = blk_alloc(1);
+		block_read(cur_disk.root_dir_idx + blk, cur_disk.dir[blk]);
 	}
-	return 0; //not found
+	return cur_disk.dir[blk];
 }
 
-// helper functions for phase 3
-void print_fd_table(void)
+struct dir_header *dir_header(uint32_t blk)
 {
-	printf("File Descriptor Table:\n");
-	for(int i = 0; i < FS_OPEN_MAX_COUNT; i++)
+	return (struct dir_header *)&dir_block(blk)->entries[0];
+}
+
+// directory entry idx, numbered from 0 to cur_disk.dir_entries - 1
+struct root_entry *dir_entry(int idx)
+{
+	int blk = idx / cur_disk.dir_per_blk;
+	return &dir_block(blk)->entries[idx % cur_disk.dir_per_blk + cur_disk.dir_hashed];
+}
+
+// the block holding entry idx must be written with the next metadata update
+void dir_touch(int idx)
+{
+	cur_disk.dir_dirty[idx / cur_disk.dir_per_blk] = 1;
+}
+
+// block a file name hashes to in a hashed directory
+uint32_t dir_home(const char *filename)
+{
+	return fnv1a(filename, strlen(filename)) % cur_disk.dir_blks;
+}
+
+// directory entry of a file, or -1 if there is none: a hashed directory only
+// looks at the blocks between the one the name hashes to and the first one
+// that no file went past
+int dir_lookup(const char *filename)
+{
+	if (!cur_disk.dir_hashed)
 	{
-		if(file_desc[i].status)
+		for (int i = 0; i < cur_disk.dir_entries; i++)
 		{
-			// index: filename: [filename] | offset: [offset]
-			printf("%d: filename: %s | offset: %d\n", i, file_desc[i].filename, file_desc[i].offset);
+			struct root_entry *ent = dir_entry(i);
+			if (ent->filename[0] != '\0' && strcmp(ent->filename, filename) == 0) return i;
 		}
-		else
+		return -1;
+	}
+
+	uint32_t blk = dir_home(filename);
+	for (uint32_t n = 0; n < cur_disk.dir_blks; n++)
+	{
+		struct root_blocks *b = dir_block(blk);
+		for (int slot = 1; slot <= cur_disk.dir_per_blk; slot++)
 		{
-			// index: open
-			printf("%d: open\n", i);
+			if (b->entries[slot].filename[0] != '\0' && strcmp(b->entries[slot].filename, filename) == 0)
+				return blk * cur_disk.dir_per_blk + slot - 1;
 		}
+		if (dir_header(blk)->overflow == 0) break;
+		blk = (blk + 1) % cur_disk.dir_blks;
 	}
+	return -1;
 }
 
-// helper functions for phase 4
-// returns the index of the data block corresponding to the file's offset
-int data_blk_index(int fd)
+// claim a cleared directory entry for a new file, return its index or -1 if
+// the directory is full
+int dir_insert(const char *filename)
 {
-	for (int j = 0; j < 128; j++)
+	int idx = -1;
+
+	if (!cur_disk.dir_hashed)
 	{
-		if (strcmp(cur_disk.root.entries[j].filename, file_desc[fd].filename) == 0)
+		for (int i = 0; i < cur_disk.dir_entries && idx == -1; i++)
 		{
-			// go through fat entries
-			uint16_t fat_idx = cur_disk.root.entries[j].first_data_idx;
-			if (fat_idx == 0xffff) return -1; // this means file is new, unwritten and pointing to nothing
-			int offset_check = file_desc[fd].offset;
-			if (cur_disk.fat_entries[fat_idx].entry == 0xffff)
-			{
-				return fat_idx;
-			}
-			while (offset_check > 4096)
+			if (dir_entry(i)->filename[0] == '\0') idx = i;
+		}
+	}
+	else
+	{
+		uint32_t home = dir_home(filename), blk = home;
+		for (uint32_t n = 0; n < cur_disk.dir_blks; n++, blk = (blk + 1) % cur_disk.dir_blks)
+		{
+			if (dir_header(blk)->used == (uint32_t)cur_disk.dir_per_blk) continue;
+			for (int slot = 1; slot <= cur_disk.dir_per_blk; slot++)
 			{
-				fat_idx = cur_disk.fat_entries[fat_idx].entry;
-				offset_check -= 4096;
+				if (dir_block(blk)->entries[slot].filename[0] == '\0')
+				{
+					idx = blk * cur_disk.dir_per_blk + slot - 1;
+					break;
+				}
 			}
-			return fat_idx;
+			break;
+		}
+		if (idx == -1) return -1;
+		// lookups of this name now have to go past the full blocks
+		for (blk = home; blk != idx / (uint32_t)cur_disk.dir_per_blk; blk = (blk + 1) % cur_disk.dir_blks)
+		{
+			dir_header(blk)->overflow++;
+			cur_disk.dir_dirty[blk] = 1;
 		}
+		dir_header(blk)->used++;
 	}
-	return -1;
+	if (idx == -1) return -1;
+
+	memset(dir_entry(idx), 0, sizeof(struct root_entry));
+	strcpy(dir_entry(idx)->filename, filename);
+	dir_touch(idx);
+	return idx;
 }
 
-// allocate new data block and link it at the end of the data's block chain, return new index
-int alloc_data_blk(int fd, uint16_t prev_idx)
+// clear the directory entry of a deleted file
+void dir_remove(int idx)
 {
-	// allocation must follow first-fit strategy (first block availible from the beginning of the FAT)
-	for (int i = 1; i < cur_disk.super.total_data_blks; i++)
+	if (cur_disk.dir_hashed)
 	{
-		if (cur_disk.fat_entries[i].entry == 0)
+		uint32_t blk = dir_home(dir_entry(idx)->filename);
+		for (; blk != idx / (uint32_t)cur_disk.dir_per_blk; blk = (blk + 1) % cur_disk.dir_blks)
 		{
-			cur_disk.fat_entries[prev_idx].entry = cur_disk.fat_entries[i].entry;
-			cur_disk.fat_entries[i].entry = 0xffff;
-			return cur_disk.fat_entries[i].entry;
+			dir_header(blk)->overflow--;
+			cur_disk.dir_dirty[blk] = 1;
 		}
+		dir_header(blk)->used--;
 	}
-	return 0;
+	memset(dir_entry(idx), 0, sizeof(struct root_entry));
+	dir_touch(idx);
 }
 
-/* TODO: Phase 1 - VOLUME MOUNTING */
-
-int fs_mount(const char *diskname)
+// FAT accessors, chains use -1 as end of chain whatever the FAT width
+int fat_next(int idx)
 {
-	if (!diskname) 
-	{
-		printf("Disk name was NULL\n");
-		return -1;
-	}
-	/* Open Virtual Disk*/
-	// added "#include <unistd.h>" to use O_RDWR
-	int disk_check = block_disk_open(diskname);
-	if (disk_check != 0)
+	if (cur_disk.fat32)
 	{
-		printf("Unsuccessful disk open\n");
-		return -1;
+		uint32_t next = cur_disk.fat32_entries[idx];
+		return next == FAT32_EOC ? -1 : (int)next;
 	}
+	uint16_t next = cur_disk.fat_entries[idx].entry;
+	return next == FAT16_EOC ? -1 : next;
+}
 
-	/* Read the metadata (superblock, fat, root directory)*/
-	// 1) Superblock - 1st 8 bytes
-	struct super_block obj;
-	block_read(0, &obj);
-	cur_disk.super = obj;
+int fat_is_free(int idx)
+{
+	if (cur_disk.fat32) return cur_disk.fat32_entries[idx] == 0;
+	return cur_disk.fat_entries[idx].entry == 0;
+}
 
-	// 2.2 FAT blocks - each block is 2048 entries, each entry is 16 bits
-	cur_disk.fat_entries = malloc(sizeof(struct fat_entry) * cur_disk.super.fat_blks * 2048);
-	for(int i = 0; i < cur_disk.super.fat_blks; i++)
-	{
-		block_read(1+i, &cur_disk.fat_entries[i*2048]);
-	}
+// set the FAT entry of idx, next == -1 ends the chain and next == 0 frees idx
+void fat_set(int idx, int next)
+{
+	if (cur_disk.fat32) cur_disk.fat32_entries[idx] = next == -1 ? FAT32_EOC : (uint32_t)next;
+	else cur_disk.fat_entries[idx].entry = next == -1 ? FAT16_EOC : next;
+	cur_disk.fat_dirty[idx / cur_disk.fat_per_blk] = 1;
+}
+
+// references to a shared block, 0 if idx is not one
+uint32_t fat_refs(int idx)
+{
+	if (!cur_disk.fat32) return 0;
+	uint32_t entry = cur_disk.fat32_entries[idx];
+	return entry != FAT32_EOC && (entry & FAT32_SHARED) ? entry & ~FAT32_SHARED : 0;
+}
 
-	// 3) Root directory - 1 block, 32-byte entry per file
+void fat_set_refs(int idx, uint32_t refs)
+{
+	cur_disk.fat32_entries[idx] = FAT32_SHARED | refs;
+	cur_disk.fat_dirty[idx / cur_disk.fat_per_blk] = 1;
+}
 
-	struct root_blocks r_blocks;
-	block_read(cur_disk.super.root_dir_idx, &r_blocks);
-	cur_disk.root = r_blocks;
+// 1 if a snapshot still uses data block idx, which must then neither be
+// written nor reused
+int blk_frozen(int idx)
+{
+	return cur_disk.frozen && (cur_disk.frozen[idx / 8] >> (idx % 8) & 1);
+}
 
-	// 4) Data Blocks - from 1st data block index to the end
-	cur_disk.data_blks = malloc(sizeof(struct data_blocks) * cur_disk.super.total_data_blks);
+// give a data block back to the FAT; one that a snapshot still uses only
+// becomes free once the snapshot is deleted
+void free_data_blk(int idx)
+{
+	fat_set(idx, 0);
+	if (!blk_frozen(idx)) fat_blk_free++;
+}
 
-	for(int i = cur_disk.super.data_blk_idx; i < cur_disk.super.total_data_blks; i++)
+// first data block of a root entry, -1 for an empty file
+int root_first(int root_idx)
+{
+	struct root_entry *ent = dir_entry(root_idx);
+	if (cur_disk.fat32)
 	{
-		block_read(i, &cur_disk.data_blks[i]);
+		uint32_t first = ent->first_data_idx | (uint32_t)ent->first_data_hi << 16;
+		return first == FAT32_EOC ? -1 : (int)first;
 	}
+	return ent->first_data_idx == FAT16_EOC ? -1 : ent->first_data_idx;
+}
 
-	return 0;
+void root_set_first(int root_idx, int idx)
+{
+	struct root_entry *ent = dir_entry(root_idx);
+	dir_touch(root_idx);
+	uint32_t first = idx == -1 ? (cur_disk.fat32 ? FAT32_EOC : FAT16_EOC) : (uint32_t)idx;
+	ent->first_data_idx = first & 0xffff;
+	ent->first_data_hi = cur_disk.fat32 ? first >> 16 : 0;
 }
 
-int fs_umount(void)
+// size of a file, beyond 4 GiB on 32-bit FAT volumes
+size_t root_size(int root_idx)
 {
-	/* Chack if virtual disk os open */
-	if (block_disk_count() == -1) return -1;
+	struct root_entry *ent = dir_entry(root_idx);
+	return ent->file_size | (cur_disk.fat32 ? (size_t)ent->size_hi << 32 : 0);
+}
 
-	/* May not have to do all the block writing here, prof said we could do it in parts
-	when we make changes in the other functions which may be faster than doing it all
-	at once at the end. However, we can do this if we, for the life of us, can't get it
-	right in smaller parts */
+void root_set_size(int root_idx, size_t size)
+{
+	struct root_entry *ent = dir_entry(root_idx);
+	dir_touch(root_idx);
+	ent->file_size = size & 0xffffffff;
+	ent->size_hi = cur_disk.fat32 ? size >> 32 : 0;
+}
 
-	/*
-	// Writing in current FAT blocks
-	for(int i = 0; i < cur_disk.super.fat_blks; i++)
+// helper functions for phase 1
+// return how many fat entries are still free
+int free_fats()
+{
+	int free_count = 0;
+	// read through fat blocks, look at fat entries
+	for (uint32_t i = 0; i < cur_disk.total_data_blks; i++)
 	{
-		block_write(1+i, &cur_disk.fat_blks[i]);
+			if (fat_is_free(i) && !blk_frozen(i)) //entry is not assigned a value
+			{
+				free_count++;
+			}
 	}
+	return free_count;
+}
 
-	// Writing in current Root block
-	block_write(cur_disk.super.root_dir_idx, &cur_disk.root);
-
-	//Writing in current data blocks
-	for(int i = cur_disk.super.data_blk_idx; i < cur_disk.super.total_data_blks; i++)
+// Function to help find the number of free spots in the root block
+int free_roots()
+{
+	int free_count = cur_disk.dir_entries;
+	for (int i = 0; i < cur_disk.dir_entries; i++)
 	{
-		block_write(i, &cur_disk.data_blks[i]);
+		if (dir_entry(i)->filename[0] != '\0')
+		{
+			free_count--;
+		}
 	}
-	*/
-
-	//free allocated space and close disk
-	free(cur_disk.fat_blks);
-	free(cur_disk.data_blks);
-	block_disk_close();
-	return 0;
+	return free_count;
 }
 
-int fs_info(void)
+// checksum of the superblock extension (everything but the checksum itself)
+uint32_t super_ext_checksum(const struct super_ext *ext)
 {
-	if (!block_disk_count()) return -1;
-	/* Show Info about Volume */
-	// there should be a global class that contains the current vd info
-	// we would then read from it if available, and print the info
-	printf("FS Info:\n");
-	printf("total_blk_count=%i\n", cur_disk.super.total_blks);
-	printf("fat_blk_count=%i\n", cur_disk.super.fat_blks);
-	printf("rdir_blk=%i\n", cur_disk.super.root_dir_idx);
-	printf("data_blk=%i\n", cur_disk.super.data_blk_idx);
-	printf("data_blk_count=%i\n", cur_disk.super.total_data_blks);
-	fat_blk_free = free_fats();
-	rdir_blk_free = free_roots();
-	printf("fat_free_ratio=%i/%i\n", fat_blk_free, cur_disk.super.total_data_blks);
-	printf("rdir_free_ratio=%i/%i\n", rdir_blk_free, 128);                          
-
-	return 0;
+	return fnv1a(ext, offsetof(struct super_ext, checksum));
 }
 
-/* TODO: Phase 2 - FILE CREATION/DELETION */
-
-int fs_create(const char *filename)
+// load the allocation state from the superblock extension when it can be
+// trusted, recompute it from the FAT and root directory otherwise
+void load_alloc_state(void)
 {
-	/* TODO: Phase 2 */
-	if (block_disk_count() == -1 || !filename)
-	{
-		printf("No disk mounted \n");
-		return -1;
-	}
-	if (strlen(filename) > FS_FILENAME_LEN)
+	struct super_ext *ext = &cur_disk.super.ext;
+
+	if (ext->magic == SUPER_EXT_MAGIC && ext->version == SUPER_EXT_VERSION &&
+		ext->checksum == super_ext_checksum(ext) && ext->clean &&
+		ext->free_blks < cur_disk.total_data_blks &&
+		ext->alloc_hint < cur_disk.total_data_blks &&
+		// a writer that does not know about the extension (e.g. the reference
+		// implementation) leaves it "clean", but cannot allocate or free
+		// blocks without changing the root directory
+		ext->root_sum == fnv1a(dir_block(0), BLOCK_SIZE))
 	{
-		printf("Name too long \n");
-		return -1;
+		fat_blk_free = ext->free_blks;
+		rdir_blk_free = ext->free_roots;
+		alloc_hint = ext->alloc_hint;
+		tail_blk = cur_disk.super.tail_blk > 0 && cur_disk.super.tail_blk < cur_disk.total_data_blks ?
+			(int)cur_disk.super.tail_blk : -1;
+		// until the first change, the superblock on disk describes this volume
+		volume_dirty = 0;
 	}
-	// check in root directory if the filename already exists, if so return -1
-	if (file_exist(filename) == 1)
+	else
 	{
-		printf("File already exists \n");
-		return -1;
+		fat_blk_free = free_fats();
+		rdir_blk_free = free_roots();
+		alloc_hint = 1;
+		tail_blk = -1;
+		// save the recomputed state at unmount, even if nothing changes
+		volume_dirty = 1;
 	}
+}
 
-	// Create New File
+// write the superblock with the current allocation state
+void write_super(int clean)
+{
+	struct super_ext *ext = &cur_disk.super.ext;
+
+	ext->magic = SUPER_EXT_MAGIC;
+	ext->version = SUPER_EXT_VERSION;
+	ext->clean = clean;
+	ext->free_blks = fat_blk_free;
+	ext->free_roots = rdir_blk_free;
+	ext->alloc_hint = alloc_hint;
+	cur_disk.super.tail_blk = tail_blk;
+	ext->root_sum = fnv1a(dir_block(0), BLOCK_SIZE);
+	ext->checksum = super_ext_checksum(ext);
+	block_write(0, &cur_disk.super);
+}
 
-	//Looking for a free spot in the root
-	int free_root_location = find_free_root_spot();
-	if(free_root_location == -1)
-	{
-		printf("No More Free spots in Root");
-		return 0;
-	}
+// called before the first metadata change of a session: if we crash after it,
+// the saved counters must not be trusted at the next mount
+void mark_volume_dirty(void)
+{
+	if (volume_dirty) return;
+	write_super(0);
+	volume_dirty = 1;
+}
 
-	//Looking for a free spot in any of the fat blocks
-	int free_fat_location = find_free_fat_spot();
+// helper functions for phase 3
+// returns the descriptor in slot @slot of the table
+struct file_descriptor *fd_slot(int slot)
+{
+	return &fd_chunks[slot / FD_CHUNK][slot % FD_CHUNK];
+}
 
-	if(free_fat_location == -1)
-	{
-		printf("No more free locations in FAT");
-		return 0;
-	}
+// returns the descriptor @fd, which must be valid
+struct file_descriptor *fd_get(int fd)
+{
+	return fd_slot(fd & (FS_OPEN_MAX_COUNT - 1));
+}
 
-	//Calculate data block index
-	//int data_block_index = free_fat_location;
+// push slots @first to @last, already linked to each other, on the free list
+void fd_push(int first, int last)
+{
+	uint64_t head = __atomic_load_n(&fd_free, __ATOMIC_ACQUIRE), next;
+	do {
+		fd_slot(last)->next_free = (int)(uint32_t)head;
+		next = ((head >> 32) + 1) << 32 | (uint32_t)(first + 1);
+	} while (!__atomic_compare_exchange_n(&fd_free, &head, next, 1,
+		__ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+}
 
-	//Set all information to current root entry
-	strcpy(cur_disk.root.entries[free_root_location].filename, filename);
-	cur_disk.root.entries[free_root_location].file_size = 0;
-	cur_disk.root.entries[free_root_location].first_data_idx = 0xffff;
+// add a chunk of free slots to the table, unless another thread just did;
+// returns -1 if the table cannot grow
+int fd_grow(void)
+{
+	int ret = 0;
 
-	// Now we have to write this altered root block onto the virtual disk
-	for(int i = 0; i < cur_disk.super.fat_blks; i++)
+	pthread_mutex_lock(&fd_grow_lock);
+	if ((uint32_t)__atomic_load_n(&fd_free, __ATOMIC_ACQUIRE) == 0)
 	{
-		block_write(1+i, &cur_disk.fat_entries[i*2048]);
+		int slots = fd_slots;
+		struct file_descriptor *chunk = slots < FS_OPEN_MAX_COUNT ?
+			calloc(FD_CHUNK, sizeof(*chunk)) : NULL;
+		if (chunk)
+		{
+			for (int i = 0; i < FD_CHUNK - 1; i++) chunk[i].next_free = slots + i + 2;
+			fd_chunks[slots / FD_CHUNK] = chunk;
+			__atomic_store_n(&fd_slots, slots + FD_CHUNK, __ATOMIC_RELEASE);
+			fd_push(slots, slots + FD_CHUNK - 1);
+		}
+		else ret = -1;
 	}
-	block_write(cur_disk.super.root_dir_idx, &cur_disk.root);
-
-	return 0;
+	pthread_mutex_unlock(&fd_grow_lock);
+	return ret;
 }
 
-int fs_delete(const char *filename)
+// take a slot from the free list, growing the table when it is empty; the tag
+// in the head keeps a slot taken and given back meanwhile from fooling the swap
+int fd_alloc(void)
 {
-	/* Delete an existing file */
-	// file's entry must be emptied
-	// all data blocks containing the file's contents must be freed in the FAT
-	// 1) Go to root directory, find FAT entry first index from root entry
-	int first_FAT = 1;
-	for (int i = 0; i < 128; i++)
+	uint64_t head = __atomic_load_n(&fd_free, __ATOMIC_ACQUIRE), next;
+	for (;;)
 	{
-		if (strcmp(cur_disk.root.entries[i].filename, filename) == 0)
+		int slot = (int)(uint32_t)head - 1;
+		if (slot < 0)
 		{
-			first_FAT = cur_disk.root.entries[i].first_data_idx;
-
-			// 2) free that file's root entry
-			strcpy(cur_disk.root.entries[i].filename, "\0");
-			cur_disk.root.entries[i].file_size = 0;
-			cur_disk.root.entries[i].first_data_idx = 0;
-			// not sure what else to do about padding
-			break;
+			if (fd_grow()) return -1;
+			head = __atomic_load_n(&fd_free, __ATOMIC_ACQUIRE);
+			continue;
 		}
+		next = ((head >> 32) + 1) << 32 | (uint32_t)fd_slot(slot)->next_free;
+		if (__atomic_compare_exchange_n(&fd_free, &head, next, 1,
+			__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+			return slot;
 	}
-	// 3) for each data block in the file, free the FAT entry/data blocks
+}
 
-	int current_FAT = first_FAT;
-	if (current_FAT == 0xffff)
+void print_fd_table(void)
+{
+	printf("File Descriptor Table:\n");
+	int slots = __atomic_load_n(&fd_slots, __ATOMIC_ACQUIRE);
+	for(int i = 0; i < slots; i++)
 	{
-		block_write(cur_disk.super.root_dir_idx, &cur_disk.root);
-		return 0;
+		struct file_descriptor *d = fd_slot(i);
+		if(d->status)
+		{
+			// index: filename: [filename] | offset: [offset]
+			printf("%d: filename: %s | offset: %zu\n", d->gen << FD_SLOT_BITS | i,
+				dir_entry(d->root_idx)->filename, d->offset);
+		}
+		else
+		{
+			// index: open
+			printf("%d: open\n", i);
+		}
 	}
+}
+
+// helper functions for phase 4
+// returns the root directory index of the file opened by fd
+int fd_root_index(int fd)
+{
+	return fd_get(fd)->root_idx;
+}
+
+// returns the chain hint shared by the descriptors open on the file of fd
+struct chain_hint *fd_hint(int fd)
+{
+	return &open_files[fd_get(fd)->root_idx].hint;
+}
+
+// returns the index of the data block holding byte @offset of the file, or -1
+// if the chain ends before reaching it. The walk starts from the hint when it
+// is at or before the wanted block, and the hint is moved to the result.
+int data_blk_index(int root_idx, size_t offset, struct chain_hint *hint)
+{
+	int fat_idx = root_first(root_idx);
+	size_t hops = offset / BLOCK_SIZE;
 
-	int next_idx = 1;
-	while (cur_disk.fat_entries[current_FAT].entry != 0xffff)
+	if (hint && hint->blk_num >= 0 && (size_t)hint->blk_num <= hops)
 	{
-		//free(cur_disk.data_blks[index]); ???
-		next_idx = cur_disk.fat_entries[current_FAT].entry;
-		cur_disk.fat_entries[current_FAT].entry = 0;
-		current_FAT = next_idx;
-		// cur_disk.data_blks[cur_disk.super.data_blk_idx + index];
-		// cur_disk.fat_blks->entries[index];
+		fat_idx = hint->blk_idx;
+		hops -= hint->blk_num;
 	}
-	cur_disk.fat_entries[current_FAT].entry = 0;
-	/* Free allocated data blocks, if any */
-	for(int i = 0; i < cur_disk.super.fat_blks; i++)
+	while (fat_idx != -1 && hops > 0)
 	{
-		block_write(1+i, &cur_disk.fat_entries[i*2048]);
+		fat_idx = fat_next(fat_idx);
+		hops--;
 	}
-	block_write(cur_disk.super.root_dir_idx, &cur_disk.root);
-	return 0;
+	if (hint && fat_idx != -1)
+	{
+		hint->blk_num = offset / BLOCK_SIZE;
+		hint->blk_idx = fat_idx;
+	}
+	return fat_idx;
 }
 
-int fs_ls(void)
+// forget all chain hints, after blocks of existing chains were moved
+void reset_chain_hints(void)
 {
-	if (block_disk_count() == -1) return -1;
-	/* List all the existing files */
-	printf("FS Ls:\n");
-	// iterate through root directory and pull values
-	for (int i = 0; i < 128; i++)
+	int slots = __atomic_load_n(&fd_slots, __ATOMIC_ACQUIRE);
+	for (int i = 0; i < slots; i++)
 	{
-		if (cur_disk.root.entries[i].filename[0] != '\0')
-		{
-			printf("file: %s, size: %i, data_blk: %i\n", 
-			cur_disk.root.entries[i].filename, 
-			cur_disk.root.entries[i].file_size, 
-			cur_disk.root.entries[i].first_data_idx);
-		}
+		struct file_descriptor *d = fd_slot(i);
+		if (d->status) open_files[d->root_idx].hint.blk_num = -1;
 	}
-	return 0;
 }
 
-/* TODO: Phase 3 - FILE DESCRIPTOR OPERATIONS 
-none of these functions should change the file system*/
+// allocate new data block and link it at the end of the file's block chain
+// (prev_idx is -1 for a file with no blocks yet, root_idx is -1 for a block
+// that belongs to no chain), return new index or -1
+int alloc_data_blk(int root_idx, int prev_idx)
+{
+	if (fat_blk_free == 0) return -1;
 
-int fs_open(const char *filename)
+	// next-fit: carry on from the last allocation, wrapping around once, so
+	// appends neither rescan the full part of the FAT nor interleave files
+	int total = cur_disk.total_data_blks;
+	for (int n = 0, i = alloc_hint; n < total; n++, i++)
+	{
+		if (i >= total) i = 1;
+		if (i == 0) continue;
+		if (fat_is_free(i) && !blk_frozen(i))
+		{
+			fat_set(i, -1);
+			if (prev_idx != -1) fat_set(prev_idx, i);
+			else if (root_idx != -1) root_set_first(root_idx, i);
+			fat_blk_free--;
+			alloc_hint = i + 1 < total ? i + 1 : 1;
+			return i;
+		}
+	}
+	return -1;
+}
+
+// write the FAT and root directory blocks that changed back to the disk, as
+// one batch: the superblock, FAT and root directory sit next to each other
+void write_metadata(void)
 {
-	/* Initialize and return file descriptor */
-	// this will be used for reading/writing operations, changing the file offset, etc.
-	/* Can open same file multiple times */
-	/* Contains the file's offset (initially 0) */
+	block_batch_start();
+	mark_volume_dirty();
+	for (uint32_t i = 0; i < cur_disk.fat_blks; i++)
+	{
+		if (!cur_disk.fat_dirty[i]) continue;
+		// neighbouring dirty FAT blocks go out as one write
+		uint32_t run = 1;
+		while (i + run < cur_disk.fat_blks && cur_disk.fat_dirty[i + run]) run++;
+		block_write_range(1 + i, run, (uint8_t *)cur_disk.fat_entries + i * BLOCK_SIZE);
+		memset(&cur_disk.fat_dirty[i], 0, run);
+		i += run - 1;
+	}
+	for (uint32_t i = 0; i < cur_disk.dir_blks; i++)
+	{
+		if (!cur_disk.dir_dirty[i]) continue;
+		block_write(cur_disk.root_dir_idx + i, cur_disk.dir[i]);
+		cur_disk.dir_dirty[i] = 0;
+	}
+	block_batch_end();
+}
+
+// 1 if the file lives in a tail block rather than in a chain of its own
+int file_packed(int root_idx)
+{
+	return dir_entry(root_idx)->flags & ROOT_PACKED;
+}
+
+// collect the data block indices of the chain starting at first (-1 for an
+// empty one) into a new array
+int *chain_from(int first, int *length)
+{
+	int n = 0;
+	int *chain;
 
-	if (block_disk_count() == -1 || fd_count == FS_OPEN_MAX_COUNT)
+	for (int idx = first; idx != -1; idx = fat_next(idx))
 	{
-		printf("Disk not open or fd is full\n");
-		return -1;
+		n++;
 	}
-	if (!filename || file_exist(filename) == -1)
+	chain = malloc(sizeof(int) * (n ? n : 1));
+	n = 0;
+	for (int idx = first; idx != -1; idx = fat_next(idx))
 	{
-		printf("Filename invalid or already exists\n");
-		return -1;
+		chain[n++] = idx;
+	}
+	*length = n;
+	return chain;
+}
+
+// same for a file's chain (empty for a packed file, whose tail block is shared)
+int *chain_to_array(int root_idx, int *length)
+{
+	if (file_packed(root_idx))
+	{
+		*length = 0;
+		return malloc(sizeof(int));
 	}
+	return chain_from(root_first(root_idx), length);
+}
 
-	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++)
+// release the host storage behind data blocks that were just freed, one
+// call per run of consecutive blocks; snapshots may still read some of them
+void discard_blocks(const int *blocks, int n)
+{
+	int k = 0;
+	while (k < n)
 	{
-		if (file_desc[i].status == 0) //Find empty spot in file descriptor table
+		if (blk_frozen(blocks[k]))
 		{
-			//Look for the file in the root directory
-			for (int j = 0; j < 128; j++)
-			{
-				if (strcmp(cur_disk.root.entries[j].filename, filename) == 0)
-				{
-					file_desc[i].filename = malloc(sizeof(char)*16);
-					strcpy(file_desc[i].filename, filename);
-					file_desc[i].offset = 0;
-					file_desc[i].status = 1;
-					fd_count++;
-					return i;
-				}
-			}
+			k++;
+			continue;
 		}
+		int run = 1;
+		while (k + run < n && blocks[k + run] == blocks[k] + run && !blk_frozen(blocks[k + run])) run++;
+		block_discard(blocks[k] + cur_disk.data_blk_idx, run);
+		k += run;
 	}
-	printf("something's wrong with the fs open implementation");
-	return 0;
 }
 
-int fs_close(int fd)
+// read len bytes at offset off of the bytes held by a file's chain, which
+// need not be the contents of the file (compressed stream, block map)
+int chain_read(int root_idx, size_t off, char *dst, size_t len, struct chain_hint *hint, char *bounce)
 {
-	/* Close file descriptor */
-	file_desc[fd].status = 0;
-	fd_count--;
+	while (len > 0)
+	{
+		int blk = data_blk_index(root_idx, off, hint);
+		if (blk == -1) return -1;
+		size_t start = off % BLOCK_SIZE;
+		size_t chunk = BLOCK_SIZE - start;
+		if (chunk > len) chunk = len;
+		if (block_read(blk + cur_disk.data_blk_idx, bounce)) return -1;
+		memcpy(dst, bounce + start, chunk);
+		dst += chunk;
+		off += chunk;
+		len -= chunk;
+	}
 	return 0;
 }
 
-int fs_stat(int fd)
+// replace block idx of a file's chain, which comes after prev (-1 if it is the
+// first one), by a new block that no snapshot uses; its contents are copied
+// over if keep is set. Returns the new block, or -1 if the volume is full
+int block_thaw(int root_idx, int prev, int idx, int keep, char *bounce)
 {
-	/* return file's size 
-	int offset = file_desc[fd].offset;
-	// corresponding to the specified file descriptor
-		// ex: to append to a file, call fs_lseek(fd, fs_stat(fd));
-	return offset;
-	*/
-	if (block_disk_count() == -1) return -1;
-	if (file_desc[fd].status == 0) return -1;
+	int copy = alloc_data_blk(-1, -1);
+	if (copy == -1) return -1;
+	if (keep)
+	{
+		block_read(idx + cur_disk.data_blk_idx, bounce);
+		block_write(copy + cur_disk.data_blk_idx, bounce);
+	}
+	fat_set(copy, fat_next(idx));
+	if (prev != -1) fat_set(prev, copy);
+	else root_set_first(root_idx, copy);
+	free_data_blk(idx);
+	return copy;
+}
 
-	char *name = file_desc[fd].filename;
-	for(int i = 0; i < FS_FILE_MAX_COUNT; i++)
+// before count bytes are written at offset of a file of size bytes: the blocks
+// of the range that a snapshot still uses are replaced (copy-on-write), so that
+// the write can change them in place. Returns the number of bytes that can be
+// written, which is less than count if the volume runs out of blocks
+size_t chain_thaw(int root_idx, size_t offset, size_t count, size_t size, struct chain_hint *hint)
+{
+	if (!cur_disk.frozen || count == 0) return count;
+
+	size_t first = offset / BLOCK_SIZE, last = (offset + count - 1) / BLOCK_SIZE, k = 0;
+	char *bounce = blk_get();
+	int prev = -1, moved = 0;
+	for (int idx = root_first(root_idx); idx != -1 && k <= last; prev = idx, idx = fat_next(idx), k++)
 	{
-		if(strcmp(name, cur_disk.root.entries[i].filename) == 0)
+		if (k < first || !blk_frozen(idx)) continue;
+		// the bytes of the file that the write leaves alone come along
+		size_t blk_start = k * BLOCK_SIZE;
+		size_t blk_end = size < blk_start + BLOCK_SIZE ? size : blk_start + BLOCK_SIZE;
+		int keep = offset > blk_start || offset + count < blk_end;
+		int copy = block_thaw(root_idx, prev, idx, keep, bounce);
+		if (copy == -1)
 		{
-			return cur_disk.root.entries[i].file_size;
+			count = blk_start > offset ? blk_start - offset : 0;
+			break;
 		}
+		idx = copy;
+		moved = 1;
 	}
-	printf("Problem with stat\n");
-	return -1;
+	blk_put(bounce);
+	if (moved)
+	{
+		// cached chain positions may point to the blocks given up
+		reset_chain_hints();
+		if (hint) hint->blk_num = -1;
+	}
+	return count;
 }
 
-// offset = current reading/writing position in the file
-int fs_lseek(int fd, size_t offset)
+/* TAIL PACKING */
+
+// move the files packed in a tail block that a snapshot still uses to a new
+// block, which the caller then writes. Returns it, or blk itself if the volume
+// is full: only the header of the block changes, which snapshots never read
+int tail_thaw(int blk)
 {
-	/* move file's offset */
-	if (block_disk_count() == -1) return -1;
-	if (file_desc[fd].status == 0) return -1;
-	if (fs_stat(fd) < offset) return -1;
-	
-	file_desc[fd].offset = offset;
-	return file_desc[fd].offset;
+	int copy = alloc_data_blk(-1, -1);
+	if (copy == -1) return blk;
+	for (int i = 0; i < cur_disk.dir_entries; i++)
+	{
+		if (dir_entry(i)->filename[0] != '\0' && file_packed(i) && root_first(i) == blk) root_set_first(i, copy);
+	}
+	free_data_blk(blk);
+	if (tail_blk == blk) tail_blk = copy;
+	return copy;
 }
 
-/* TODO: Phase 4 - FILE READING/WRITING 
-- THIS IS THE MOST COMPLICATED PHASE */
-// reading from a file contained in the data blocks, write from those data blocks into the file
+// take a packed file out of its tail block, whose contents are in tail; the
+// block is freed when no other file is left in it. Returns the freed block
+// (to be discarded once the metadata is written) or -1
+int tail_release(int root_idx, char *tail)
+{
+	struct tail_header *hdr = (struct tail_header *)tail;
+	int blk = root_first(root_idx);
+
+	dir_entry(root_idx)->flags &= ~ROOT_PACKED;
+	dir_entry(root_idx)->tail_off = 0;
+	dir_touch(root_idx);
+	root_set_first(root_idx, -1);
+	if (--hdr->live > 0)
+	{
+		if (blk_frozen(blk)) blk = tail_thaw(blk);
+		block_write(blk + cur_disk.data_blk_idx, tail);
+		return -1;
+	}
+	free_data_blk(blk);
+	if (tail_blk == blk) tail_blk = -1;
+	return blk;
+}
 
-// buf contains data, write onto data blocks (depending on where offset is)
-int fs_write(int fd, void *buf, size_t count)
+// seal a small file when it is closed: move its only block into the tail
+// block being filled, and free the block
+void pack_file(int root_idx)
 {
-	// error check
-	if (block_disk_count() == -1) return -1;
-	if (file_desc[fd].status == 0 || !buf) return -1;
+	struct root_entry *ent = dir_entry(root_idx);
+	int first = root_first(root_idx);
+	char *buf = blk_get();
+	char *tail = blk_get();
+	struct tail_header *hdr = (struct tail_header *)tail;
 
-	//If there is no data to write
-	if(count == 0)
+	if (tail_blk != -1)
 	{
-		return count;
+		block_read(tail_blk + cur_disk.data_blk_idx, tail);
+		if (hdr->magic != TAIL_MAGIC || hdr->end + ent->file_size > BLOCK_SIZE || blk_frozen(tail_blk)) tail_blk = -1;
+	}
+	if (tail_blk == -1)
+	{
+		// the tail block is full (its free space comes back when it empties)
+		tail_blk = alloc_data_blk(-1, -1);
+		if (tail_blk == -1) goto out;
+		memset(tail, 0, BLOCK_SIZE);
+		hdr->magic = TAIL_MAGIC;
+		hdr->live = 0;
+		hdr->end = sizeof(struct tail_header);
 	}
 
-	// prepare the index val used to iterate through a file's data blocks
-	int offset_idx = data_blk_index(fd);
-	if (offset_idx == -1)
+	block_read(first + cur_disk.data_blk_idx, buf);
+	memcpy(tail + hdr->end, buf, ent->file_size);
+	ent->tail_off = hdr->end;
+	hdr->end += ent->file_size;
+	hdr->live++;
+	block_write(tail_blk + cur_disk.data_blk_idx, tail);
+
+	// only now that the data is in the tail block can the metadata point to it
+	ent->flags |= ROOT_PACKED;
+	root_set_first(root_idx, tail_blk);
+	free_data_blk(first);
+	write_metadata();
+	discard_blocks(&first, 1);
+out:
+	blk_put(buf);
+	blk_put(tail);
+}
+
+// unseal a packed file before it is written to: give it a block of its own
+// again. Returns 0, or -1 if there is no free block
+int unpack_file(int root_idx)
+{
+	struct root_entry *ent = dir_entry(root_idx);
+	char *buf = blk_get_zero();
+	char *tail = blk_get();
+	int ret = -1;
+
+	int blk = alloc_data_blk(-1, -1);
+	if (blk == -1) goto out;
+	block_read(root_first(root_idx) + cur_disk.data_blk_idx, tail);
+	memcpy(buf, tail + ent->tail_off, ent->file_size);
+	block_write(blk + cur_disk.data_blk_idx, buf);
+
+	int freed = tail_release(root_idx, tail);
+	root_set_first(root_idx, blk);
+	write_metadata();
+	if (freed != -1) discard_blocks(&freed, 1);
+	// cached chain positions of this file pointed into the tail block
+	reset_chain_hints();
+	ret = 0;
+out:
+	blk_put(buf);
+	blk_put(tail);
+	return ret;
+}
+
+/* COMPRESSION */
+
+// blocks the contents of a file take up, whatever its chain holds
+uint32_t file_blocks(int root_idx)
+{
+	return (root_size(root_idx) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+// offset of the compressed blocks in the stream of a compressed file
+size_t cz_data_start(uint32_t blocks)
+{
+	size_t len = sizeof(struct cz_header) + blocks * sizeof(struct cz_extent);
+	return (len + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+}
+
+// chain being built for a file, which only gets linked to it once complete
+struct chain_builder{
+	int *blocks;
+	int n;
+	int cap;
+};
+
+// add a block to the list, which is then only a list of blocks (e.g. to be
+// discarded) unless they were linked by alloc_data_blk()
+void chain_push(struct chain_builder *cb, int blk)
+{
+	if (cb->n == cb->cap)
+	{
+		cb->cap = cb->cap ? cb->cap * 2 : 16;
+		cb->blocks = realloc(cb->blocks, sizeof(int) * cb->cap);
+	}
+	cb->blocks[cb->n++] = blk;
+}
+
+// allocate a block at the end of the chain being built, return it or -1
+int chain_append(struct chain_builder *cb)
+{
+	int blk = alloc_data_blk(-1, cb->n ? cb->blocks[cb->n - 1] : -1);
+	if (blk != -1) chain_push(cb, blk);
+	return blk;
+}
+
+// give blocks back to the FAT
+void release_blocks(const int *blocks, int n)
+{
+	for (int k = 0; k < n; k++)
+	{
+		free_data_blk(blocks[k]);
+	}
+}
+
+// forget the cached extent table and blocks of a file
+void cz_forget(int root_idx)
+{
+	for (int i = 0; i < CZ_CACHE_SLOTS; i++)
+	{
+		if (cz_cache[i].root_idx == root_idx) cz_cache[i].root_idx = -1;
+	}
+	for (int i = 0; i < CZ_INDEX_SLOTS; i++)
+	{
+		if (cz_index[i].root_idx != root_idx) continue;
+		free(cz_index[i].ext);
+		cz_index[i].ext = NULL;
+		cz_index[i].root_idx = -1;
+	}
+}
+
+// switch a file over to the chain just built (its flags already describe the
+// new contents) and free the old one
+void replace_chain(int root_idx, struct chain_builder *cb)
+{
+	int length;
+	int *old = chain_to_array(root_idx, &length);
+
+	root_set_first(root_idx, cb->n ? cb->blocks[0] : -1);
+	release_blocks(old, length);
+	write_metadata();
+	discard_blocks(old, length);
+	free(old);
+	// cached chain positions and decompressed blocks of the file are stale
+	reset_chain_hints();
+	cz_forget(root_idx);
+}
+
+// extent table of a compressed file, read when first needed; NULL if the
+// file is corrupted
+struct cz_extent *cz_extents(int root_idx)
+{
+	for (int i = 0; i < CZ_INDEX_SLOTS; i++)
+	{
+		if (cz_index[i].root_idx == root_idx) return cz_index[i].ext;
+	}
+
+	struct cz_index_slot *slot = &cz_index[cz_index_next];
+	cz_index_next = (cz_index_next + 1) % CZ_INDEX_SLOTS;
+	free(slot->ext);
+	slot->ext = NULL;
+	slot->root_idx = -1;
+
+	uint32_t blocks = file_blocks(root_idx);
+	size_t len = sizeof(struct cz_header) + blocks * sizeof(struct cz_extent);
+	char *buf = malloc(len);
+	char *bounce = blk_get();
+	struct cz_header *hdr = (struct cz_header *)buf;
+	struct chain_hint hint = { -1, 0 };
+
+	if (chain_read(root_idx, 0, buf, len, &hint, bounce) == 0 &&
+		hdr->magic == CZ_MAGIC && hdr->blocks == blocks)
+	{
+		slot->ext = malloc(blocks * sizeof(struct cz_extent));
+		memcpy(slot->ext, buf + sizeof(struct cz_header), blocks * sizeof(struct cz_extent));
+		slot->root_idx = root_idx;
+		slot->blocks = blocks;
+	}
+	free(buf);
+	blk_put(bounce);
+	return slot->ext;
+}
+
+// block blk of a compressed file, decompressed through the cache; NULL if the
+// file is corrupted
+char *cz_block(int root_idx, uint32_t blk, struct chain_hint *hint)
+{
+	struct cz_cache_slot *slot = &cz_cache[((uint32_t)root_idx * 31 + blk) % CZ_CACHE_SLOTS];
+	if (slot->root_idx == root_idx && slot->blk == blk) return slot->data;
+
+	struct cz_extent *ext = cz_extents(root_idx);
+	if (!ext) return NULL;
+
+	char *comp = blk_get();
+	char *bounce = blk_get();
+	size_t len = ext[blk].len;
+	int n = -1;
+	slot->root_idx = -1;
+	if (len <= BLOCK_SIZE &&
+		chain_read(root_idx, cz_data_start(file_blocks(root_idx)) + ext[blk].off, comp, len, hint, bounce) == 0)
 	{
-		// we have no fat entries or data blocks assigned to this new file
-		for (int i = 0; i < 128; i++)
+		if (ext[blk].flags & CZ_RAW)
 		{
-			if (strcmp(file_desc[fd].filename, cur_disk.root.entries[i].filename) == 0)
+			memcpy(slot->data, comp, len);
+			n = len;
+		}
+		else n = lz_decompress(comp, len, slot->data, BLOCK_SIZE);
+	}
+	blk_put(comp);
+	blk_put(bounce);
+	if (n < 0) return NULL;
+
+	memset(slot->data + n, 0, BLOCK_SIZE - n);
+	slot->root_idx = root_idx;
+	slot->blk = blk;
+	return slot->data;
+}
+
+// seal a file when it is closed: replace its chain by the compressed stream of
+// its blocks, unless that does not save at least one block in eight. Returns 0
+// if the file got compressed
+int compress_file(int root_idx)
+{
+	struct root_entry *ent = dir_entry(root_idx);
+	uint32_t blocks = file_blocks(root_idx);
+	size_t data_start = cz_data_start(blocks);
+	int max_blks = blocks - (blocks / 8 > 1 ? blocks / 8 : 1);
+	struct chain_builder cb = { NULL, 0, 0 };
+	struct cz_extent *ext = calloc(blocks, sizeof(struct cz_extent));
+	char *in = blk_get();
+	char *out = blk_get_zero();
+	char *comp = blk_get();
+	char *head = calloc(1, data_start);
+	size_t pos = 0; // compressed bytes so far
+	int ret = -1;
+
+	// room for the header and the extent table, which are written last
+	for (size_t k = 0; k < data_start / BLOCK_SIZE; k++)
+	{
+		if (cb.n == max_blks || chain_append(&cb) == -1) goto fail;
+	}
+
+	int idx = root_first(root_idx);
+	for (uint32_t k = 0; k < blocks; k++, idx = fat_next(idx))
+	{
+		if (idx == -1) goto fail;
+		size_t valid = root_size(root_idx) - (size_t)k * BLOCK_SIZE;
+		if (valid > BLOCK_SIZE) valid = BLOCK_SIZE;
+		block_read(idx + cur_disk.data_blk_idx, in);
+
+		// a block that does not shrink is stored as is
+		size_t len = lz_compress(in, valid, comp, valid - 1);
+		ext[k].off = pos;
+		ext[k].flags = 0;
+		if (len == 0)
+		{
+			memcpy(comp, in, valid);
+			len = valid;
+			ext[k].flags = CZ_RAW;
+		}
+		ext[k].len = len;
+
+		for (size_t done = 0; done < len; )
+		{
+			size_t start = pos % BLOCK_SIZE;
+			size_t chunk = BLOCK_SIZE - start;
+			if (chunk > len - done) chunk = len - done;
+			memcpy(out + start, comp + done, chunk);
+			done += chunk;
+			pos += chunk;
+			if (pos % BLOCK_SIZE != 0 && !(k == blocks - 1 && done == len)) continue;
+
+			// the stream block is complete, or this is the end of the file
+			if (cb.n == max_blks)
 			{
-				// give a 1st fat entry/data block index to root entry --> FAT_EOC
-				cur_disk.root.entries[i].first_data_idx = find_free_fat_spot();
-				offset_idx = cur_disk.root.entries[i].first_data_idx;
-				cur_disk.fat_entries[cur_disk.root.entries[i].first_data_idx].entry = 0xffff;
+				ret = 1;
+				goto fail;
 			}
+			if (chain_append(&cb) == -1) goto fail;
+			block_write(cb.blocks[cb.n - 1] + cur_disk.data_blk_idx, out);
+			memset(out, 0, BLOCK_SIZE);
 		}
 	}
 
-	// prepare bounce buffer (size of 1 block)
-	char *bounce = malloc(sizeof(char) * 4096); 
+	// the data is in place, the header and extent table can point to it
+	struct cz_header *hdr = (struct cz_header *)head;
+	hdr->magic = CZ_MAGIC;
+	hdr->blocks = blocks;
+	memcpy(head + sizeof(struct cz_header), ext, blocks * sizeof(struct cz_extent));
+	for (size_t k = 0; k < data_start / BLOCK_SIZE; k++)
+	{
+		block_write(cb.blocks[k] + cur_disk.data_blk_idx, head + k * BLOCK_SIZE);
+	}
+	ent->flags |= ROOT_COMPRESSED;
+	dir_touch(root_idx);
+	replace_chain(root_idx, &cb);
+	ret = 0;
+	goto out;
+
+fail:
+	release_blocks(cb.blocks, cb.n);
+	if (ret == 1)
+	{
+		// not worth trying again until the file changes
+		ent->flags |= ROOT_INCOMPRESSIBLE;
+		dir_touch(root_idx);
+	}
+	write_metadata();
+	discard_blocks(cb.blocks, cb.n);
+out:
+	free(cb.blocks);
+	free(ext);
+	blk_put(in);
+	blk_put(out);
+	blk_put(comp);
+	free(head);
+	return ret;
+}
 
-	int modded_count = count;
-	int block_count = modded_count / 4096;
-	// if block_count == 0, we're only working with one block
-	// if block_count == 1 or more, (loop works)
+// unseal a compressed file on a volume too full to hold it twice: the file is
+// decompressed in memory, then written over the blocks of its own stream,
+// which its chain grows from. An interruption leaves the file in pieces, so
+// this is only done when there is no other way. Returns 0, or -1 if the file
+// does not fit either, or if a snapshot still uses its stream
+int decompress_in_place(int root_idx)
+{
+	uint32_t blocks = file_blocks(root_idx);
+	int length;
+	int *old = chain_to_array(root_idx, &length);
+	struct chain_hint hint = { -1, 0 };
+	char *plain = NULL;
+	int ret = -1;
+
+	if (length == 0 || (uint32_t)length > blocks || blocks - length > (uint32_t)fat_blk_free) goto out;
+	for (int k = 0; k < length; k++)
+	{
+		if (blk_frozen(old[k])) goto out;
+	}
+	plain = blk_alloc(blocks);
+	if (!plain) goto out;
+	for (uint32_t k = 0; k < blocks; k++)
+	{
+		char *data = cz_block(root_idx, k, &hint);
+		if (!data) goto out;
+		memcpy(plain + (size_t)k * BLOCK_SIZE, data, BLOCK_SIZE);
+	}
 
-	// figure out point of offset for the first block
-	int startpoint = 0;
-	if (file_desc[fd].offset < 4096) startpoint = file_desc[fd].offset;
-	else
+	// the chain only grows, from its last block
+	struct chain_builder cb = { old, length, length };
+	old = NULL;
+	while ((uint32_t)cb.n < blocks && chain_append(&cb) != -1)
+		;
+	if ((uint32_t)cb.n < blocks)
+	{
+		release_blocks(cb.blocks + length, cb.n - length);
+		fat_set(cb.blocks[length - 1], -1);
+		write_metadata();
+		free(cb.blocks);
+		goto out;
+	}
+	for (uint32_t k = 0; k < blocks; k++)
 	{
-		startpoint = file_desc[fd].offset % 4096;
+		block_write(cb.blocks[k] + cur_disk.data_blk_idx, plain + (size_t)k * BLOCK_SIZE);
 	}
+	dir_entry(root_idx)->flags &= ~ROOT_COMPRESSED;
+	dir_touch(root_idx);
+	write_metadata();
+	reset_chain_hints();
+	cz_forget(root_idx);
+	free(cb.blocks);
+	ret = 0;
+out:
+	free(old);
+	free(plain);
+	return ret;
+}
 
-	// modify the bounce buffer using buf (first block)
-	block_read(offset_idx + cur_disk.super.data_blk_idx, bounce);
-	bounce += startpoint;
-	if (count < 4096 - startpoint) memcpy(bounce, buf, count); // what if buf length is less than (4096 - startpoint)?
-	else memcpy(bounce, buf, 4096 - startpoint);
-	bounce = bounce - startpoint;
-	modded_count -= startpoint;
-	buf += startpoint;
-	block_write(offset_idx + cur_disk.super.data_blk_idx, bounce);
-	
-	// loop and write in the next couple blocks
-	if (block_count > 0)
+// unseal a compressed file before it is written to: give it back a chain of
+// plain blocks. Returns 0, or -1 if they do not fit on the volume
+int decompress_file(int root_idx)
+{
+	uint32_t blocks = file_blocks(root_idx);
+	struct chain_builder cb = { NULL, 0, 0 };
+	struct chain_hint hint = { -1, 0 };
+
+	// the new chain is built before the stream is freed, when there is room
+	if ((uint32_t)fat_blk_free < blocks) return decompress_in_place(root_idx);
+	for (uint32_t k = 0; k < blocks; k++)
 	{
-		while (modded_count > 0)
+		char *data = cz_block(root_idx, k, &hint);
+		if (!data || chain_append(&cb) == -1)
 		{
-			if (cur_disk.fat_entries[offset_idx].entry == 0xffff) alloc_data_blk(fd, offset_idx);
-			offset_idx = cur_disk.fat_entries[offset_idx].entry;
+			release_blocks(cb.blocks, cb.n);
+			write_metadata();
+			discard_blocks(cb.blocks, cb.n);
+			free(cb.blocks);
+			return -1;
+		}
+		block_write(cb.blocks[k] + cur_disk.data_blk_idx, data);
+	}
+	dir_entry(root_idx)->flags &= ~ROOT_COMPRESSED;
+	dir_touch(root_idx);
+	replace_chain(root_idx, &cb);
+	free(cb.blocks);
+	return 0;
+}
 
-			// if last block could be a slice
-			if (modded_count < 4096)
-			{
-				block_read(offset_idx + cur_disk.super.data_blk_idx, bounce);
-				memcpy(bounce, buf, modded_count);
-				modded_count -= modded_count;
-			} 
-			else
-			{
-				memcpy(bounce, buf, 4096);
-				modded_count -= 4096;
-				buf += 4096;
-			}
-			block_write(offset_idx + cur_disk.super.data_blk_idx, bounce);
+/* SHARED BLOCKS AND DEDUPLICATION */
+
+// 1 if the file's chain holds a block map rather than its data
+int file_mapped(int root_idx)
+{
+	return dir_entry(root_idx)->flags & ROOT_MAPPED;
+}
+
+uint32_t dd_fingerprint(const void *data)
+{
+	return crc32c(0, data, BLOCK_SIZE);
+}
+
+void dd_index_add(int blk, uint32_t fp)
+{
+	uint32_t bucket = fp & dd_index.mask;
+	dd_index.fp[blk] = fp;
+	dd_index.next[blk] = dd_index.head[bucket];
+	dd_index.head[bucket] = blk;
+}
+
+// take a block out of the index, before its contents change or it is freed
+void dd_index_remove(int blk)
+{
+	if (!dd_index.loaded) return;
+	int *link = &dd_index.head[dd_index.fp[blk] & dd_index.mask];
+	while (*link != -1 && *link != blk) link = &dd_index.next[*link];
+	if (*link == blk) *link = dd_index.next[blk];
+}
+
+// fingerprint every shared block of the volume, reading them in runs
+void dd_index_load(void)
+{
+	uint32_t total = cur_disk.total_data_blks;
+	uint32_t buckets = 1024;
+	while (buckets < total / 4) buckets *= 2;
+	dd_index.mask = buckets - 1;
+	dd_index.head = malloc(sizeof(int) * buckets);
+	dd_index.next = malloc(sizeof(int) * total);
+	dd_index.fp = calloc(total, sizeof(uint32_t));
+	for (uint32_t b = 0; b < buckets; b++) dd_index.head[b] = -1;
+
+	char *batch = blk_alloc(DD_LOAD_BATCH);
+	for (uint32_t i = 1; i < total; )
+	{
+		if (!fat_refs(i))
+		{
+			i++;
+			continue;
 		}
+		uint32_t run = 1;
+		while (i + run < total && run < DD_LOAD_BATCH && fat_refs(i + run)) run++;
+		block_read_range(i + cur_disk.data_blk_idx, run, batch);
+		for (uint32_t k = 0; k < run; k++) dd_index_add(i + k, dd_fingerprint(batch + k * BLOCK_SIZE));
+		i += run;
+	}
+	free(batch);
+	dd_index.loaded = 1;
+}
+
+void dd_index_free(void)
+{
+	free(dd_index.head);
+	free(dd_index.next);
+	free(dd_index.fp);
+	memset(&dd_index, 0, sizeof(dd_index));
+}
+
+// shared block holding the same data, -1 if there is none; candidates with
+// the same fingerprint are compared byte for byte
+int dd_index_find(const char *data, uint32_t fp, char *bounce)
+{
+	for (int blk = dd_index.head[fp & dd_index.mask]; blk != -1; blk = dd_index.next[blk])
+	{
+		if (dd_index.fp[blk] != fp || fat_refs(blk) >= SHARED_REFS_MAX) continue;
+		block_read(blk + cur_disk.data_blk_idx, bounce);
+		if (memcmp(bounce, data, BLOCK_SIZE) == 0) return blk;
+	}
+	return -1;
+}
+
+// drop a reference to a shared block; the last one frees it, and the block
+// is added to freed to be discarded once the metadata is written
+void dd_unref(int blk, struct chain_builder *freed)
+{
+	uint32_t refs = fat_refs(blk);
+	if (refs > 1)
+	{
+		fat_set_refs(blk, refs - 1);
+		return;
 	}
+	dd_index_remove(blk);
+	free_data_blk(blk);
+	chain_push(freed, blk);
+}
+
+// shared block to hold data, for a file block that was held by old (-1 for a
+// new block): on a deduplicating volume, a block with the same contents is
+// reused without writing anything. Otherwise old is rewritten in place if no
+// other file or snapshot uses it, or left to the others (copy-on-write).
+// Returns -1 if the volume is full
+int dd_store(const char *data, int old, struct chain_builder *freed, char *bounce)
+{
+	int dedup = cur_disk.features & FEAT_DEDUP;
+	uint32_t fp = 0;
+	int blk;
 
-	free(bounce);
-	file_desc[fd].offset += count;
-	// cur_disk.root.entries file size modified
-	for (int i = 0; i < 128; i++)
+	if (dedup)
 	{
-		if (strcmp(file_desc[fd].filename, cur_disk.root.entries[i].filename) == 0)
+		if (!dd_index.loaded) dd_index_load();
+		fp = dd_fingerprint(data);
+		blk = dd_index_find(data, fp, bounce);
+		if (blk != -1)
 		{
-			if (file_desc[fd].offset > cur_disk.root.entries[i].file_size)
+			if (blk != old)
 			{
-				cur_disk.root.entries[i].file_size = file_desc[fd].offset;
+				fat_set_refs(blk, fat_refs(blk) + 1);
+				if (old != -1) dd_unref(old, freed);
 			}
-			break;
+			return blk;
 		}
 	}
-	for(int i = 0; i < cur_disk.super.fat_blks; i++)
+
+	if (old != -1 && fat_refs(old) == 1 && !blk_frozen(old))
 	{
-		block_write(1+i, &cur_disk.fat_entries[i*2048]);
+		blk = old;
+		dd_index_remove(blk);
 	}
-	block_write(cur_disk.super.root_dir_idx, &cur_disk.root);
-	return count;
+	else
+	{
+		blk = alloc_data_blk(-1, -1);
+		if (blk == -1) return -1;
+		fat_set_refs(blk, 1);
+		if (old != -1) dd_unref(old, freed);
+	}
+	block_write(blk + cur_disk.data_blk_idx, data);
+	if (dedup) dd_index_add(blk, fp);
+	return blk;
 }
 
-// buffer gets data here
-/* Write a certain number of bytes to a file */
-int fs_read(int fd, void *buf, size_t count)
+// forget the cached block map of a file
+void dd_forget(int root_idx)
 {
-	//printf("fs read called \n");
-	// error check
-	if (block_disk_count() == -1)
+	for (int i = 0; i < DD_MAP_SLOTS; i++)
 	{
-		printf("fs_read disk not open \n");
-		return -1;
+		if (dd_maps[i].root_idx == root_idx) dd_maps[i].root_idx = -1;
 	}
-	if (file_desc[fd].status == 0 || !buf) 
+}
+
+// block map of a mapped file, read when first needed; NULL if the file is
+// corrupted
+struct dd_map_slot *dd_map(int root_idx)
+{
+	for (int i = 0; i < DD_MAP_SLOTS; i++)
 	{
-		printf("fd is open \n");
-		return -1;
+		if (dd_maps[i].root_idx == root_idx) return &dd_maps[i];
+	}
+
+	struct dd_map_slot *slot = &dd_maps[dd_map_next];
+	dd_map_next = (dd_map_next + 1) % DD_MAP_SLOTS;
+	slot->root_idx = -1;
+
+	uint32_t n = file_blocks(root_idx);
+	if (n > slot->cap)
+	{
+		slot->cap = n;
+		slot->blk = realloc(slot->blk, sizeof(uint32_t) * n);
 	}
-	// prepare the size of the bounce buffer
-	int bytes_written = 0;
-	int block_num = fs_stat(fd) / 4096;
-	if (file_desc[fd].offset % 4096 > 0) 
+	char *bounce = blk_get();
+	struct chain_hint hint = { -1, 0 };
+	int ok = chain_read(root_idx, 0, (char *)slot->blk, n * sizeof(uint32_t), &hint, bounce) == 0;
+	blk_put(bounce);
+	for (uint32_t k = 0; ok && k < n; k++)
 	{
-		block_num++;
+		ok = slot->blk[k] < cur_disk.total_data_blks && fat_refs(slot->blk[k]) > 0;
 	}
+	if (!ok) return NULL;
+	slot->root_idx = root_idx;
+	slot->n = n;
+	return slot;
+}
 
-	// prepare the index val used to iterate through a file's data blocks
-	int data_idx = data_blk_index(fd); //gets first data block
-
-	//If desired data is not in the first few blocks of data
-	int skip_blocks = file_desc[fd].offset / 4096;
+// changes being made to the block map of a mapped file
+struct map_update{
+	struct dd_map_slot *map;
+	uint32_t chain_blks;        // blocks of the chain holding the map
+	uint32_t dirty_first;       // map blocks to write back, none if first > last
+	uint32_t dirty_last;
+	struct chain_builder freed; // blocks to discard once the metadata is written
+};
 
-	while(skip_blocks > 0) //keep skipping until we hit block with data we want to read from
+// start changing the block map of a file, return -1 if it is corrupted or if
+// the volume is full
+int map_begin(struct map_update *mu, int root_idx)
+{
+	mu->map = dd_map(root_idx);
+	if (!mu->map) return -1;
+	mu->chain_blks = (mu->map->n + MAP_ENTRIES - 1) / MAP_ENTRIES;
+	mu->dirty_first = UINT32_MAX;
+	mu->dirty_last = 0;
+
+	// map blocks a snapshot still uses are replaced up front, so that the
+	// update cannot run out of space halfway through; the whole map is in
+	// memory, and gets written back
+	int frozen = 0;
+	for (int idx = root_first(root_idx); cur_disk.frozen && idx != -1; idx = fat_next(idx))
 	{
-		block_num--;//Don't have to worry about these blocks
-		data_idx = cur_disk.fat_entries[data_idx].entry; //skip to next data block
+		frozen += blk_frozen(idx);
 	}
+	if (frozen > fat_blk_free) return -1;
+	if (frozen)
+	{
+		chain_thaw(root_idx, 0, (size_t)mu->chain_blks * BLOCK_SIZE, 0, NULL);
+		mu->dirty_first = 0;
+		mu->dirty_last = mu->chain_blks - 1;
+	}
+	mu->freed = (struct chain_builder){ NULL, 0, 0 };
+	return 0;
+}
 
-	// prepare the bounce buffer array
-	char *bounce_block = malloc(sizeof(char) * 4096); 
-	int bounce_idx = 0; // to iterate through the bounce buffer in blocks
-	int temp_count = count; // to iterate through the count value
+// make room for entry k of the map, at most one past its end: appending may
+// take one more map block, which must leave room for the data blocks still
+// needed. Returns -1 if the volume is full
+int map_reserve(struct map_update *mu, int root_idx, uint32_t k, int data_blks, struct chain_hint *hint)
+{
+	if (k < mu->map->n || k / MAP_ENTRIES < mu->chain_blks) return fat_blk_free < data_blks ? -1 : 0;
+	if (fat_blk_free < 1 + data_blks) return -1;
+	int prev = mu->chain_blks ? data_blk_index(root_idx, (size_t)(mu->chain_blks - 1) * BLOCK_SIZE, hint) : -1;
+	alloc_data_blk(root_idx, prev);
+	mu->chain_blks++;
+	return 0;
+}
 
-	// read blocks into bounce buffer
-	//First block, could be a sliver
-	int starting_point = file_desc[fd].offset % 4096;
-	int bytes_to_write = 0;
-	block_read(data_idx + cur_disk.super.data_blk_idx, bounce_block); //read entire block to bounce block
-	
-	bounce_block += starting_point;
-	bytes_to_write = 4096 - starting_point;
+// point entry k of the map (reserved) to a shared block; the reference the
+// entry held is the caller's business
+void map_set(struct map_update *mu, uint32_t k, uint32_t blk)
+{
+	struct dd_map_slot *map = mu->map;
+	if (k == map->n)
+	{
+		if (map->n == map->cap)
+		{
+			map->cap = map->cap ? map->cap * 2 : 16;
+			map->blk = realloc(map->blk, sizeof(uint32_t) * map->cap);
+		}
+		map->n++;
+	}
+	map->blk[k] = blk;
+	if (k / MAP_ENTRIES < mu->dirty_first) mu->dirty_first = k / MAP_ENTRIES;
+	if (k / MAP_ENTRIES > mu->dirty_last) mu->dirty_last = k / MAP_ENTRIES;
+}
 
-	 //Check if this gets all the data that needs to be written
-	if(bytes_to_write > count)
+// write back the part of the map that changed and the metadata (the file
+// size must already be updated), then discard the blocks given up
+void map_commit(struct map_update *mu, int root_idx, struct chain_hint *hint)
+{
+	struct dd_map_slot *map = mu->map;
+	char *buf = blk_get();
+	for (uint32_t j = mu->dirty_first; j <= mu->dirty_last && mu->dirty_first != UINT32_MAX; j++)
+	{
+		uint32_t from = j * MAP_ENTRIES;
+		uint32_t len = map->n - from < MAP_ENTRIES ? map->n - from : MAP_ENTRIES;
+		memset(buf, 0, BLOCK_SIZE);
+		memcpy(buf, &map->blk[from], len * sizeof(uint32_t));
+		block_write(data_blk_index(root_idx, (size_t)j * BLOCK_SIZE, hint) + cur_disk.data_blk_idx, buf);
+	}
+	blk_put(buf);
+	write_metadata();
+	// a block freed early in the update may have been allocated again
+	// since, to hold data of the same update: only the ones still free are
+	// discarded
+	int n = 0;
+	for (int k = 0; k < mu->freed.n; k++)
 	{
-		bytes_to_write = count;
+		if (fat_is_free(mu->freed.blocks[k])) mu->freed.blocks[n++] = mu->freed.blocks[k];
 	}
+	discard_blocks(mu->freed.blocks, n);
+	free(mu->freed.blocks);
+}
+
+// turn a plain file into a mapped one: its data blocks become shared blocks
+// with one reference each, and a new chain holds their map. Packed and
+// compressed files are left alone. Returns 0, or -1 if the file was not mapped
+int map_file(int root_idx)
+{
+	struct root_entry *ent = dir_entry(root_idx);
+	if (!cur_disk.fat32 || (ent->flags & (ROOT_PACKED | ROOT_COMPRESSED))) return -1;
 
-	memcpy(buf, bounce_block, bytes_to_write);
-	buf += bytes_to_write;
-	block_num--;
-	data_idx = cur_disk.fat_entries[data_idx].entry; //skip to next data block
-	bytes_written = bytes_to_write;
+	int length;
+	int *chain = chain_to_array(root_idx, &length);
+	struct chain_builder cb = { NULL, 0, 0 };
+	uint32_t *buf = (uint32_t *)blk_get_zero();
+	int ret = -1;
 
-	//Now we handle the middle blocks of the file
-	while(block_num - 1 > 0) 
+	// the map is written before the metadata switches over to it
+	for (int from = 0; from < length; from += MAP_ENTRIES)
 	{
-		//Each entire block is read in and copied to buf
-		block_read(data_idx + cur_disk.super.data_blk_idx, bounce_block);
-		memcpy(buf, bounce_block, 4096);
-		buf += 4096;
-		data_idx = cur_disk.fat_entries[data_idx].entry;
-		bytes_written += 4096;
-		block_num--;
+		int len = length - from < MAP_ENTRIES ? length - from : MAP_ENTRIES;
+		if (chain_append(&cb) == -1)
+		{
+			release_blocks(cb.blocks, cb.n);
+			write_metadata();
+			discard_blocks(cb.blocks, cb.n);
+			goto out;
+		}
+		memset(buf, 0, BLOCK_SIZE);
+		for (int k = 0; k < len; k++) buf[k] = chain[from + k];
+		block_write(cb.blocks[cb.n - 1] + cur_disk.data_blk_idx, buf);
 	}
-	//Last block
-	if(block_num == 1)
+	for (int k = 0; k < length; k++)
 	{
-		bytes_to_write = count - bytes_written;
-		block_read(data_idx + cur_disk.super.data_blk_idx, bounce_block);
-		memcpy(buf, bounce_block, bytes_to_write);
-		bytes_written += bytes_to_write;
+		fat_set_refs(chain[k], 1);
 	}
-	int final_offset = file_desc[fd].offset += count;
+	ent->flags |= ROOT_MAPPED;
+	root_set_first(root_idx, cb.n ? cb.blocks[0] : -1);
+	write_metadata();
+	// cached chain positions of the file are stale
+	reset_chain_hints();
+	ret = 0;
+out:
+	free(chain);
+	free(cb.blocks);
+	blk_put(buf);
+	return ret;
+}
+
+/* SNAPSHOTS */
 
-	if(final_offset > fs_stat(fd)) //if offset is bigger than file size
+// header of the snapshot in slot s of the superblock, -1 if the slot is free
+// or does not hold a snapshot of this volume
+int snap_header(int s, struct snap_header *hdr)
+{
+	uint32_t blk = cur_disk.super.snap_blk[s];
+	if (!cur_disk.fat32 || blk == 0 || blk >= cur_disk.total_data_blks) return -1;
+	char *buf = blk_get();
+	block_read(blk + cur_disk.data_blk_idx, buf);
+	memcpy(hdr, buf, sizeof(*hdr));
+	blk_put(buf);
+	return hdr->magic == SNAP_MAGIC && hdr->fat_blks == cur_disk.fat_blks &&
+		hdr->dir_blks == cur_disk.dir_blks ? 0 : -1;
+}
+
+// slot of the snapshot called name, -1 if there is none
+int snap_find(const char *name)
+{
+	struct snap_header hdr;
+	for (int s = 0; s < SNAP_MAX; s++)
 	{
-		final_offset = fs_stat(fd);
+		if (snap_header(s, &hdr) == 0 && strncmp(hdr.name, name, FS_FILENAME_LEN) == 0) return s;
 	}
-	
-	file_desc[fd].offset = final_offset;
-	return bytes_written;
+	return -1;
+}
 
+// chain of the snapshot in slot s: header, FAT copy and root directory copy.
+// NULL if it is not as long as that
+int *snap_chain(int s)
+{
+	int n;
+	int *chain = chain_from(cur_disk.super.snap_blk[s], &n);
+	if ((uint32_t)n == 1 + cur_disk.fat_blks + cur_disk.dir_blks) return chain;
+	free(chain);
+	return NULL;
+}
+
+// mark the data blocks in use in a copy of the FAT as frozen
+void snap_freeze_fat(const uint32_t *fat)
+{
+	if (!cur_disk.frozen) cur_disk.frozen = calloc((cur_disk.total_data_blks + 7) / 8, 1);
+	for (uint32_t i = 0; i < cur_disk.total_data_blks; i++)
+	{
+		if (fat[i] != 0) cur_disk.frozen[i / 8] |= 1 << (i % 8);
+	}
+}
+
+// build the set of frozen blocks from the FAT copies of all the snapshots
+void snap_freeze(void)
+{
+	free(cur_disk.frozen);
+	cur_disk.frozen = NULL;
+
+	struct snap_header hdr;
+	uint32_t *fat = NULL;
+	for (int s = 0; s < SNAP_MAX; s++)
+	{
+		int *chain = snap_header(s, &hdr) == 0 ? snap_chain(s) : NULL;
+		if (!chain) continue;
+		if (!fat) fat = malloc((size_t)cur_disk.fat_blks * BLOCK_SIZE);
+		for (uint32_t j = 0; j < cur_disk.fat_blks; j++)
+		{
+			block_read(chain[1 + j] + cur_disk.data_blk_idx, (char *)fat + (size_t)j * BLOCK_SIZE);
+		}
+		snap_freeze_fat(fat);
+		free(chain);
+	}
+	free(fat);
+}
+
+int fs_snapshot(const char *name)
+{
+	FS_LOCKED;
+	if (block_disk_count() == -1 || !name || cur_disk.read_only) return -1;
+	if (!cur_disk.fat32)
+	{
+		printf("Snapshots need a 32-bit FAT volume\n");
+		return -1;
+	}
+	if (name[0] == '\0' || strlen(name) >= FS_FILENAME_LEN)
+	{
+		printf("Name too long \n");
+		return -1;
+	}
+	if (snap_find(name) != -1)
+	{
+		printf("Snapshot already exists\n");
+		return -1;
+	}
+	struct snap_header old;
+	int s = 0;
+	while (s < SNAP_MAX && snap_header(s, &old) == 0) s++;
+	if (s == SNAP_MAX)
+	{
+		printf("Too many snapshots\n");
+		return -1;
+	}
+
+	// the FAT is copied before the chain holding the copies is allocated,
+	// which the snapshot then does not see
+	size_t fat_len = (size_t)cur_disk.fat_blks * BLOCK_SIZE;
+	uint32_t *fat = malloc(fat_len);
+	memcpy(fat, cur_disk.fat_entries, fat_len);
+	struct chain_builder cb = { NULL, 0, 0 };
+	int ret = -1;
+	for (uint32_t k = 0; k < 1 + cur_disk.fat_blks + cur_disk.dir_blks; k++)
+	{
+		if (chain_append(&cb) == -1)
+		{
+			printf("No room for the snapshot\n");
+			release_blocks(cb.blocks, cb.n);
+			write_metadata();
+			discard_blocks(cb.blocks, cb.n);
+			goto out;
+		}
+	}
+
+	char *buf = blk_get_zero();
+	struct snap_header *hdr = (struct snap_header *)buf;
+	hdr->magic = SNAP_MAGIC;
+	hdr->seq = cur_disk.super.snap_seq;
+	strcpy(hdr->name, name);
+	hdr->fat_blks = cur_disk.fat_blks;
+	hdr->dir_blks = cur_disk.dir_blks;
+	block_write(cb.blocks[0] + cur_disk.data_blk_idx, buf);
+	blk_put(buf);
+	for (uint32_t j = 0; j < cur_disk.fat_blks; j++)
+	{
+		block_write(cb.blocks[1 + j] + cur_disk.data_blk_idx, (char *)fat + (size_t)j * BLOCK_SIZE);
+	}
+	for (uint32_t j = 0; j < cur_disk.dir_blks; j++)
+	{
+		block_write(cb.blocks[1 + cur_disk.fat_blks + j] + cur_disk.data_blk_idx, dir_block(j));
+	}
+
+	// the snapshot exists once the superblock lists it, and from then on
+	// every block that was in use is left alone
+	write_metadata();
+	block_flush();
+	cur_disk.super.snap_blk[s] = cb.blocks[0];
+	cur_disk.super.snap_seq++;
+	snap_freeze_fat(fat);
+	tail_blk = -1;
+	write_super(0);
+	ret = 0;
+out:
+	free(cb.blocks);
+	free(fat);
+	return ret;
+}
+
+int fs_snapshot_delete(const char *name)
+{
+	FS_LOCKED;
+	if (block_disk_count() == -1 || !name || cur_disk.read_only) return -1;
+	int s = snap_find(name);
+	int *chain = s == -1 ? NULL : snap_chain(s);
+	if (!chain)
+	{
+		printf("No snapshot to delete\n");
+		return -1;
+	}
+
+	// the superblock stops listing the snapshot before its blocks are reused
+	mark_volume_dirty();
+	cur_disk.super.snap_blk[s] = 0;
+	write_super(0);
+
+	int length = 1 + cur_disk.fat_blks + cur_disk.dir_blks;
+	release_blocks(chain, length);
+	uint8_t *was_frozen = cur_disk.frozen;
+	cur_disk.frozen = NULL;
+	snap_freeze();
+	fat_blk_free = free_fats();
+	write_metadata();
+
+	// blocks only this snapshot was holding on to are free now
+	struct chain_builder freed = { NULL, 0, 0 };
+	for (uint32_t i = 1; i < cur_disk.total_data_blks; i++)
+	{
+		if (was_frozen && (was_frozen[i / 8] >> (i % 8) & 1) && !blk_frozen(i) && fat_is_free(i))
+			chain_push(&freed, i);
+	}
+	discard_blocks(chain, length);
+	discard_blocks(freed.blocks, freed.n);
+	free(freed.blocks);
+	free(was_frozen);
+	free(chain);
+	return 0;
+}
+
+int fs_mount_snapshot(const char *diskname, const char *name)
+{
+	FS_LOCKED;
+	if (!name) return -1;
+	if (fs_mount(diskname)) return -1;
+
+	int s = snap_find(name);
+	int *chain = s == -1 ? NULL : snap_chain(s);
+	if (!chain)
+	{
+		printf("No such snapshot\n");
+		fs_umount();
+		return -1;
+	}
+
+	// the copies of the FAT and root directory stand in for the volume's
+	for (uint32_t j = 0; j < cur_disk.fat_blks; j++)
+	{
+		block_read(chain[1 + j] + cur_disk.data_blk_idx, (char *)cur_disk.fat_entries + (size_t)j * BLOCK_SIZE);
+	}
+	for (uint32_t j = 0; j < cur_disk.dir_blks; j++)
+	{
+		if (!cur_disk.dir[j]) cur_disk.dir[j] = blk_alloc(1);
+		block_read(chain[1 + cur_disk.fat_blks + j] + cur_disk.data_blk_idx, cur_disk.dir[j]);
+	}
+	free(chain);
+	free(cur_disk.frozen);
+	cur_disk.frozen = NULL;
+	cur_disk.read_only = 1;
+	fat_blk_free = free_fats();
+	rdir_blk_free = free_roots();
+	tail_blk = -1;
+	return 0;
+}
+
+// check that fd is in bounds, currently open, and not left over from an
+// earlier use of its slot
+int fd_valid(int fd)
+{
+	if (fd < 0) return 0;
+	int slot = fd & (FS_OPEN_MAX_COUNT - 1);
+	if (slot >= __atomic_load_n(&fd_slots, __ATOMIC_ACQUIRE)) return 0;
+	struct file_descriptor *d = fd_slot(slot);
+	return __atomic_load_n(&d->status, __ATOMIC_ACQUIRE) &&
+		d->gen == fd >> FD_SLOT_BITS;
+}
+
+/* TODO: Phase 1 - VOLUME MOUNTING */
+
+// fill in the volume geometry from the superblock: "ECS150FS" volumes have a
+// 16-bit FAT and 16-bit fields, "ECS150FX" ones a 32-bit FAT and 32-bit fields
+int load_geometry(void)
+{
+	struct super_block *sb = &cur_disk.super;
+
+	if (memcmp(&sb->signature, "ECS150FS", 8) == 0)
+	{
+		cur_disk.fat32 = 0;
+		cur_disk.fat_per_blk = FAT_ENTRIES;
+		cur_disk.total_blks = sb->total_blks;
+		cur_disk.root_dir_idx = sb->root_dir_idx;
+		cur_disk.data_blk_idx = sb->data_blk_idx;
+		cur_disk.total_data_blks = sb->total_data_blks;
+		cur_disk.fat_blks = sb->fat_blks;
+		cur_disk.dir_blks = 1;
+		cur_disk.features = 0;
+	}
+	else if (memcmp(&sb->signature, "ECS150FX", 8) == 0)
+	{
+		cur_disk.fat32 = 1;
+		cur_disk.fat_per_blk = FAT32_ENTRIES;
+		cur_disk.total_blks = sb->geo.total_blks;
+		cur_disk.root_dir_idx = sb->geo.root_dir_idx;
+		cur_disk.data_blk_idx = sb->geo.data_blk_idx;
+		cur_disk.total_data_blks = sb->geo.total_data_blks;
+		cur_disk.fat_blks = sb->geo.fat_blks;
+		cur_disk.dir_blks = sb->geo.dir_blks ? sb->geo.dir_blks : 1;
+		cur_disk.features = sb->features;
+		// deduplicated files are all mapped, never packed or compressed
+		if (cur_disk.features & FEAT_DEDUP) cur_disk.features &= ~(FEAT_TAILS | FEAT_COMPRESS);
+	}
+	else return -1;
+
+	// a single directory block is the original root directory, larger
+	// directories are hashed and give up one slot per block to a header
+	cur_disk.dir_hashed = cur_disk.dir_blks > 1;
+	cur_disk.dir_per_blk = FS_FILE_MAX_COUNT - cur_disk.dir_hashed;
+
+	// the layout must fit the disk, and the FAT must cover every data block
+	if (cur_disk.total_blks != (uint32_t)block_disk_count() ||
+		cur_disk.total_data_blks > INT32_MAX ||
+		(uint64_t)cur_disk.fat_blks * cur_disk.fat_per_blk < cur_disk.total_data_blks ||
+		cur_disk.root_dir_idx != cur_disk.fat_blks + 1 ||
+		cur_disk.dir_blks > INT32_MAX / FS_FILE_MAX_COUNT ||
+		(uint64_t)cur_disk.data_blk_idx < (uint64_t)cur_disk.root_dir_idx + cur_disk.dir_blks ||
+		(uint64_t)cur_disk.data_blk_idx + cur_disk.total_data_blks != cur_disk.total_blks)
+		return -1;
+	cur_disk.dir_entries = cur_disk.dir_per_blk * cur_disk.dir_blks;
+	return 0;
+}
+
+int fs_mount(const char *diskname)
+{
+	FS_LOCKED;
+	if (!diskname) 
+	{
+		printf("Disk name was NULL\n");
+		return -1;
+	}
+	/* Open Virtual Disk*/
+	// added "#include <unistd.h>" to use O_RDWR
+	int disk_check = block_disk_open(diskname);
+	if (disk_check != 0)
+	{
+		printf("Unsuccessful disk open\n");
+		return -1;
+	}
+
+	/* Read the metadata (superblock, fat, root directory)*/
+	// 1) Superblock - 1st 8 bytes
+	struct super_block obj;
+	block_read(0, &obj);
+	cur_disk.super = obj;
+	if (load_geometry() != 0)
+	{
+		printf("No valid file system on disk\n");
+		block_disk_close();
+		return -1;
+	}
+
+	// 2.2 FAT blocks - each block is 2048 entries of 16 bits, or 1024
+	// entries of 32 bits; they are read in with a single I/O
+	cur_disk.fat_entries = blk_alloc(cur_disk.fat_blks);
+	cur_disk.fat32_entries = (uint32_t *)cur_disk.fat_entries;
+	cur_disk.fat_dirty = calloc(cur_disk.fat_blks, 1);
+	if (!cur_disk.fat_entries || !cur_disk.fat_dirty ||
+		block_read_range(1, cur_disk.fat_blks, cur_disk.fat_entries) != 0)
+	{
+		printf("Cannot load FAT\n");
+		free(cur_disk.fat_entries);
+		free(cur_disk.fat_dirty);
+		block_disk_close();
+		return -1;
+	}
+
+	// 3) Root directory - 32-byte entry per file, its blocks are read when
+	// first looked at
+	cur_disk.dir = calloc(cur_disk.dir_blks, sizeof(struct root_blocks *));
+	cur_disk.dir_dirty = calloc(cur_disk.dir_blks, 1);
+	open_files = calloc(cur_disk.dir_entries, sizeof(struct open_file));
+
+	// blocks of the snapshots, which the free counts leave out
+	cur_disk.read_only = 0;
+	snap_freeze();
+
+	// free counts and allocation cursor, from the superblock if still valid
+	load_alloc_state();
+
+	// 4) Data Blocks - read on demand by fs_read()/fs_write()
+	for (int i = 0; i < CZ_CACHE_SLOTS; i++) cz_cache[i].root_idx = -1;
+	for (int i = 0; i < CZ_INDEX_SLOTS; i++) cz_index[i].root_idx = -1;
+	for (int i = 0; i < DD_MAP_SLOTS; i++) dd_maps[i].root_idx = -1;
+
+	// without the cache, blocks are simply written straight away
+	block_writeback_start(WRITEBACK_EXPIRE_MS, WRITEBACK_BLOCKS);
+
+	return 0;
+}
+
+int fs_umount(void)
+{
+	FS_LOCKED;
+	/* Chack if virtual disk os open */
+	if (block_disk_count() == -1) return -1;
+	if (__atomic_load_n(&fd_count, __ATOMIC_ACQUIRE) > 0)
+	{
+		printf("Files are still open\n");
+		return -1;
+	}
+
+	/* Metadata is written back as it changes in the other functions, only
+	the allocation state is left to save for the next mount. The volume is
+	only marked clean once everything else is on disk */
+	if (volume_dirty && !cur_disk.read_only)
+	{
+		block_flush();
+		write_super(1);
+	}
+
+	//free allocated space and close disk
+	free(cur_disk.fat_entries);
+	free(cur_disk.fat_dirty);
+	for (uint32_t i = 0; i < cur_disk.dir_blks; i++) free(cur_disk.dir[i]);
+	for (int i = 0; i < CZ_INDEX_SLOTS; i++)
+	{
+		free(cz_index[i].ext);
+		cz_index[i].ext = NULL;
+	}
+	for (int i = 0; i < DD_MAP_SLOTS; i++)
+	{
+		free(dd_maps[i].blk);
+		dd_maps[i].blk = NULL;
+		dd_maps[i].cap = 0;
+	}
+	dd_index_free();
+	blk_pool_drain();
+	free(cur_disk.frozen);
+	cur_disk.frozen = NULL;
+	cur_disk.read_only = 0;
+	free(cur_disk.dir);
+	free(cur_disk.dir_dirty);
+	free(open_files);
+	open_files = NULL;
+	cur_disk.dir = NULL;
+	cur_disk.dir_dirty = NULL;
+	cur_disk.fat_entries = NULL;
+	cur_disk.fat32_entries = NULL;
+	cur_disk.fat_dirty = NULL;
+	block_disk_close();
+	return 0;
+}
+
+int fs_sync(void)
+{
+	FS_LOCKED;
+	if (block_disk_count() == -1) return -1;
+	return block_sync();
+}
+
+int fs_info(void)
+{
+	FS_LOCKED;
+	if (block_disk_count() == -1) return -1;
+	/* Show Info about Volume */
+	// there should be a global class that contains the current vd info
+	// we would then read from it if available, and print the info
+	printf("FS Info:\n");
+	printf("total_blk_count=%u\n", cur_disk.total_blks);
+	printf("fat_blk_count=%u\n", cur_disk.fat_blks);
+	printf("rdir_blk=%u\n", cur_disk.root_dir_idx);
+	printf("data_blk=%u\n", cur_disk.data_blk_idx);
+	printf("data_blk_count=%u\n", cur_disk.total_data_blks);
+	printf("fat_free_ratio=%i/%u\n", fat_blk_free, cur_disk.total_data_blks);
+	printf("rdir_free_ratio=%i/%i\n", rdir_blk_free, cur_disk.dir_entries);
+	struct snap_header hdr;
+	for (int s = 0; s < SNAP_MAX; s++)
+	{
+		if (snap_header(s, &hdr) == 0) printf("snapshot=%.*s\n", FS_FILENAME_LEN, hdr.name);
+	}
+
+	return 0;
+}
+
+/* TODO: Phase 2 - FILE CREATION/DELETION */
+
+int fs_create(const char *filename)
+{
+	FS_LOCKED;
+	/* TODO: Phase 2 */
+	if (block_disk_count() == -1 || !filename)
+	{
+		printf("No disk mounted \n");
+		return -1;
+	}
+	if (filename[0] == '\0' || strlen(filename) >= FS_FILENAME_LEN)
+	{
+		printf("Name too long \n");
+		return -1;
+	}
+	if (cur_disk.read_only)
+	{
+		printf("Snapshots are read-only\n");
+		return -1;
+	}
+	// check in root directory if the filename already exists, if so return -1
+	if (dir_lookup(filename) != -1)
+	{
+		printf("File already exists \n");
+		return -1;
+	}
+
+	// Create New File
+
+	//Looking for a free spot in the root
+	int free_root_location = dir_insert(filename);
+	if(free_root_location == -1)
+	{
+		printf("No More Free spots in Root\n");
+		return -1;
+	}
+
+	//Set all information to current root entry, data blocks are allocated
+	//on the first write
+	root_set_size(free_root_location, 0);
+	root_set_first(free_root_location, -1);
+
+	// Now we have to write the altered root blocks onto the virtual disk
+	rdir_blk_free--;
+	write_metadata();
+
+	return 0;
+}
+
+int fs_delete(const char *filename)
+{
+	FS_LOCKED;
+	/* Delete an existing file */
+	// file's entry must be emptied
+	// all data blocks containing the file's contents must be freed in the FAT
+	if (block_disk_count() == -1 || !filename || cur_disk.read_only) return -1;
+
+	// 1) Go to root directory, find the file's chain from its root entry
+	int length = 0;
+	int root_idx = dir_lookup(filename);
+	if (root_idx == -1)
+	{
+		printf("No file to delete\n");
+		return -1;
+	}
+	if (__atomic_load_n(&open_files[root_idx].refs, __ATOMIC_ACQUIRE) > 0)
+	{
+		printf("File is currently open\n");
+		return -1;
+	}
+	int *chain = chain_to_array(root_idx, &length);
+
+	// a packed file only gives back its share of the tail block
+	int freed = -1;
+	if (file_packed(root_idx))
+	{
+		char *tail = blk_get();
+		block_read(root_first(root_idx) + cur_disk.data_blk_idx, tail);
+		freed = tail_release(root_idx, tail);
+		blk_put(tail);
+	}
+
+	// a mapped file also gives back its references to shared blocks
+	struct chain_builder unshared = { NULL, 0, 0 };
+	if (file_mapped(root_idx))
+	{
+		struct dd_map_slot *map = dd_map(root_idx);
+		for (uint32_t k = 0; map && k < map->n; k++) dd_unref(map->blk[k], &unshared);
+		dd_forget(root_idx);
+	}
+
+	// 2) free that file's root entry
+	cz_forget(root_idx);
+	dir_remove(root_idx);
+	rdir_blk_free++;
+
+	// 3) for each data block in the file, free the FAT entry/data blocks
+	release_blocks(chain, length);
+
+	// 4) once the FAT no longer references them, the host can drop the blocks
+	write_metadata();
+	discard_blocks(chain, length);
+	if (freed != -1) discard_blocks(&freed, 1);
+	discard_blocks(unshared.blocks, unshared.n);
+	free(unshared.blocks);
+	free(chain);
+	return 0;
+}
+
+int fs_ls(void)
+{
+	FS_LOCKED;
+	if (block_disk_count() == -1) return -1;
+	/* List all the existing files */
+	printf("FS Ls:\n");
+	// iterate through root directory and pull values
+	for (int i = 0; i < cur_disk.dir_entries; i++)
+	{
+		struct root_entry *ent = dir_entry(i);
+		if (ent->filename[0] != '\0')
+		{
+			printf("file: %s, size: %zu, data_blk: %i\n", 
+			ent->filename, 
+			root_size(i), 
+			cur_disk.fat32 ? root_first(i) : ent->first_data_idx);
+		}
+	}
+	return 0;
+}
+
+/* TODO: Phase 3 - FILE DESCRIPTOR OPERATIONS 
+none of these functions should change the file system*/
+
+int fs_open(const char *filename)
+{
+	FS_LOCKED;
+	/* Initialize and return file descriptor */
+	// this will be used for reading/writing operations, changing the file offset, etc.
+	/* Can open same file multiple times */
+	/* Contains the file's offset (initially 0) */
+
+	if (block_disk_count() == -1)
+	{
+		printf("Disk not open\n");
+		return -1;
+	}
+	int root_idx = filename ? dir_lookup(filename) : -1;
+	if (root_idx == -1)
+	{
+		printf("Filename invalid or does not exist\n");
+		return -1;
+	}
+
+	int slot = fd_alloc(); // take a free slot, the table grows when there is none
+	if (slot == -1)
+	{
+		printf("fd is full\n");
+		return -1;
+	}
+	struct file_descriptor *d = fd_slot(slot);
+	d->offset = 0;
+	d->root_idx = root_idx;
+	// the first descriptor open on a file starts its shared state afresh
+	if (__atomic_fetch_add(&open_files[root_idx].refs, 1, __ATOMIC_ACQ_REL) == 0)
+		open_files[root_idx].hint.blk_num = -1;
+	__atomic_store_n(&d->status, 1, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&fd_count, 1, __ATOMIC_RELEASE);
+	return d->gen << FD_SLOT_BITS | slot;
+}
+
+int fs_close(int fd)
+{
+	FS_LOCKED;
+	/* Close file descriptor */
+	if (block_disk_count() == -1 || !fd_valid(fd)) return -1;
+
+	// a small file is packed once the last descriptor open on it goes away
+	// (never in a mounted snapshot)
+	int root_idx = fd_root_index(fd);
+	int last = !cur_disk.read_only &&
+		__atomic_load_n(&open_files[root_idx].refs, __ATOMIC_ACQUIRE) == 1;
+	// (and a larger one compressed), unless its blocks may be shared
+	size_t size = root_size(root_idx);
+	block_batch_start();
+	if ((cur_disk.features & FEAT_TAILS) && last && !file_packed(root_idx) && !file_mapped(root_idx) &&
+		size > 0 && size <= PACK_MAX)
+		pack_file(root_idx);
+	else if ((cur_disk.features & FEAT_COMPRESS) && last && size > BLOCK_SIZE &&
+		!(dir_entry(root_idx)->flags & (ROOT_PACKED | ROOT_COMPRESSED | ROOT_INCOMPRESSIBLE | ROOT_MAPPED)))
+		compress_file(root_idx);
+	block_batch_end();
+
+	// a new generation makes the old descriptor invalid before the slot is reused
+	struct file_descriptor *d = fd_get(fd);
+	int slot = fd & (FS_OPEN_MAX_COUNT - 1);
+	__atomic_store_n(&d->status, 0, __ATOMIC_RELEASE);
+	d->gen = (d->gen + 1) & FD_GEN_MASK;
+	__atomic_sub_fetch(&open_files[root_idx].refs, 1, __ATOMIC_ACQ_REL);
+	__atomic_sub_fetch(&fd_count, 1, __ATOMIC_RELEASE);
+	fd_push(slot, slot);
+	return 0;
+}
+
+int fs_fsync(int fd)
+{
+	FS_LOCKED;
+	if (block_disk_count() == -1 || !fd_valid(fd)) return -1;
+	// the cache does not know which blocks belong to which file
+	return block_sync();
+}
+
+off_t fs_stat64(int fd)
+{
+	FS_LOCKED;
+	/* return file's size */
+	if (block_disk_count() == -1) return -1;
+	if (!fd_valid(fd)) return -1;
+
+	int root_idx = fd_root_index(fd);
+	if (root_idx == -1)
+	{
+		printf("Problem with stat\n");
+		return -1;
+	}
+	return root_size(root_idx);
+}
+
+int fs_stat(int fd)
+{
+	FS_LOCKED;
+	// a size that does not fit is an error rather than a wrong size
+	off_t size = fs_stat64(fd);
+	return size > INT_MAX ? -1 : (int)size;
+}
+
+// offset = current reading/writing position in the file
+int fs_lseek64(int fd, off_t offset)
+{
+	FS_LOCKED;
+	/* move file's offset */
+	if (block_disk_count() == -1) return -1;
+	if (!fd_valid(fd) || offset < 0) return -1;
+	if (fs_stat64(fd) < offset) return -1;
+	
+	fd_get(fd)->offset = offset;
+	return 0;
+}
+
+int fs_lseek(int fd, size_t offset)
+{
+	FS_LOCKED;
+	if (offset > INT64_MAX) return -1;
+	return fs_lseek64(fd, offset);
+}
+
+/* TODO: Phase 4 - FILE READING/WRITING 
+- THIS IS THE MOST COMPLICATED PHASE */
+// reading from a file contained in the data blocks, write from those data blocks into the file
+
+// walks a caller's iovec array as one continuous stream of bytes
+struct iov_cursor{
+	const struct iovec *iov;
+	int iovcnt;
+	int idx;     // current segment
+	size_t off;  // offset inside the current segment
+};
+
+void iov_init(struct iov_cursor *cur, const struct iovec *iov, int iovcnt)
+{
+	cur->iov = iov;
+	cur->iovcnt = iovcnt;
+	cur->idx = 0;
+	cur->off = 0;
+	// skip leading empty segments so iov_contig() always sees data
+	while (cur->idx < cur->iovcnt && cur->iov[cur->idx].iov_len == 0) cur->idx++;
+}
+
+// total number of bytes described by an iovec array, -1 if invalid
+long iov_total(const struct iovec *iov, int iovcnt)
+{
+	long total = 0;
+	if (!iov || iovcnt < 0) return -1;
+	for (int i = 0; i < iovcnt; i++)
+	{
+		if (!iov[i].iov_base && iov[i].iov_len) return -1;
+		total += iov[i].iov_len;
+	}
+	return total;
+}
+
+// bytes left in the current segment, and where they are
+size_t iov_contig(struct iov_cursor *cur, char **ptr)
+{
+	if (cur->idx >= cur->iovcnt) return 0;
+	*ptr = (char *)cur->iov[cur->idx].iov_base + cur->off;
+	return cur->iov[cur->idx].iov_len - cur->off;
+}
+
+void iov_advance(struct iov_cursor *cur, size_t n)
+{
+	while (n > 0 && cur->idx < cur->iovcnt)
+	{
+		size_t left = cur->iov[cur->idx].iov_len - cur->off;
+		size_t step = n < left ? n : left;
+		cur->off += step;
+		n -= step;
+		if (cur->off == cur->iov[cur->idx].iov_len)
+		{
+			cur->idx++;
+			cur->off = 0;
+		}
+	}
+	while (cur->idx < cur->iovcnt && cur->iov[cur->idx].iov_len == 0) cur->idx++;
+}
+
+// gather n bytes from the iovecs into dst (dst == NULL copies the other way)
+void iov_copy(struct iov_cursor *cur, char *dst, const char *src, size_t n)
+{
+	while (n > 0)
+	{
+		char *ptr;
+		size_t step = iov_contig(cur, &ptr);
+		if (step == 0) break;
+		if (step > n) step = n;
+		if (dst)
+		{
+			memcpy(dst, ptr, step);
+			dst += step;
+		}
+		else
+		{
+			memcpy(ptr, src, step);
+			src += step;
+		}
+		iov_advance(cur, step);
+		n -= step;
+	}
+}
+
+// next block of the chain after idx, extending the chain if it ends there;
+// fresh tells whether the block was just allocated
+int next_data_blk(int root_idx, int idx, int *fresh)
+{
+	int next_idx = fat_next(idx);
+	*fresh = 0;
+	if (next_idx == -1)
+	{
+		next_idx = alloc_data_blk(root_idx, idx);
+		*fresh = 1;
+	}
+	return next_idx;
+}
+
+// write path of mapped files: every block written goes through dd_store(),
+// then the part of the block map that changed is written back to the chain
+size_t mapped_writev(int root_idx, size_t offset, struct iov_cursor *cur, size_t count,
+	struct chain_hint *hint)
+{
+	struct map_update mu;
+	if (map_begin(&mu, root_idx) != 0) return 0;
+
+	size_t file_size = root_size(root_idx);
+	char *bounce = blk_get();
+	char *cmp = blk_get();
+	size_t written = 0;
+
+	while (written < count)
+	{
+		uint32_t k = offset / BLOCK_SIZE;
+		size_t startpoint = offset % BLOCK_SIZE;
+		size_t chunk = BLOCK_SIZE - startpoint;
+		if (chunk > count - written) chunk = count - written;
+		if (map_reserve(&mu, root_idx, k, 1, hint) != 0) break;
+		int old = k < mu.map->n ? (int)mu.map->blk[k] : -1;
+
+		// whole blocks are stored straight from the caller's buffer, the
+		// others are merged with what the file has around them
+		char *src;
+		const char *data = bounce;
+		if (startpoint == 0 && chunk == BLOCK_SIZE && iov_contig(cur, &src) >= BLOCK_SIZE)
+		{
+			data = src;
+		}
+		else
+		{
+			size_t valid = file_size > offset - startpoint ? file_size - (offset - startpoint) : 0;
+			if (old == -1 || (startpoint == 0 && chunk >= valid)) memset(bounce, 0, BLOCK_SIZE);
+			else block_read(old + cur_disk.data_blk_idx, bounce);
+			iov_copy(cur, bounce + startpoint, NULL, chunk);
+		}
+
+		int blk = dd_store(data, old, &mu.freed, cmp);
+		if (blk == -1) break;
+		if (data != bounce) iov_advance(cur, BLOCK_SIZE);
+		map_set(&mu, k, blk);
+		written += chunk;
+		offset += chunk;
+	}
+
+	if (offset > file_size)
+	{
+		root_set_size(root_idx, offset);
+	}
+	map_commit(&mu, root_idx, hint);
+	blk_put(bounce);
+	blk_put(cmp);
+	return written;
+}
+
+// write count bytes gathered from iov at offset of a file, extending it if
+// needed, return the number of bytes actually written
+size_t file_writev_blocks(int root_idx, size_t offset, const struct iovec *iov, int iovcnt, size_t count,
+	struct chain_hint *hint)
+{
+	struct root_entry *ent = dir_entry(root_idx);
+	if (file_packed(root_idx) && unpack_file(root_idx) != 0) return 0;
+	if ((ent->flags & ROOT_COMPRESSED) && decompress_file(root_idx) != 0) return 0;
+	if (ent->flags & ROOT_INCOMPRESSIBLE)
+	{
+		// the new contents may compress better
+		ent->flags &= ~ROOT_INCOMPRESSIBLE;
+		dir_touch(root_idx);
+	}
+	if ((cur_disk.features & FEAT_DEDUP) && !file_mapped(root_idx) && root_first(root_idx) == -1)
+	{
+		// files of a deduplicating volume are all written through a map
+		ent->flags |= ROOT_MAPPED;
+		dir_touch(root_idx);
+	}
+
+	size_t file_size = root_size(root_idx);
+	struct iov_cursor cur;
+	iov_init(&cur, iov, iovcnt);
+	if (file_mapped(root_idx)) return mapped_writev(root_idx, offset, &cur, count, hint);
+
+	// blocks a snapshot still uses are copied before they change
+	count = chain_thaw(root_idx, offset, count, file_size, hint);
+	if (count == 0) return 0;
+
+	// find the block holding the offset; a write at the very end of the chain
+	// (empty file, or offset on a block boundary) gets a freshly allocated block
+	int offset_idx = data_blk_index(root_idx, offset, hint);
+	int fresh = 0; // block was just allocated, its old contents are garbage
+	if (offset_idx == -1)
+	{
+		int prev_idx = -1;
+		if (offset > 0) prev_idx = data_blk_index(root_idx, offset - 1, hint);
+		offset_idx = alloc_data_blk(root_idx, prev_idx);
+		fresh = 1;
+	}
+
+	// prepare bounce buffer (size of 1 block)
+	char *bounce = blk_get();
+	size_t written = 0;
+
+	while (offset_idx != -1 && written < count)
+	{
+		// figure out point of offset for the current block
+		size_t startpoint = offset % BLOCK_SIZE;
+		size_t chunk = BLOCK_SIZE - startpoint;
+		if (chunk > count - written) chunk = count - written;
+
+		// run of whole blocks that are next to each other both in the
+		// caller's buffer and on disk: one write straight from the buffer
+		char *src;
+		size_t contig = iov_contig(&cur, &src);
+		if (contig > count - written) contig = count - written;
+		if (startpoint == 0 && contig >= BLOCK_SIZE)
+		{
+			int run = 1, next_idx = -1, next_fresh = 0;
+			while ((size_t)(run + 1) * BLOCK_SIZE <= contig)
+			{
+				next_idx = next_data_blk(root_idx, offset_idx + run - 1, &next_fresh);
+				if (next_idx != offset_idx + run) break;
+				run++;
+				next_idx = -1;
+			}
+			block_write_range(offset_idx + cur_disk.data_blk_idx, run, src);
+			iov_advance(&cur, (size_t)run * BLOCK_SIZE);
+			written += (size_t)run * BLOCK_SIZE;
+			offset += (size_t)run * BLOCK_SIZE;
+			if (written == count) break;
+
+			// the block after the run may already have been looked up
+			if (next_idx != -1)
+			{
+				offset_idx = next_idx;
+				fresh = next_fresh;
+			}
+			else offset_idx = next_data_blk(root_idx, offset_idx + run - 1, &fresh);
+			continue;
+		}
+
+		// only the bytes of the file that this write leaves in place need to be
+		// read back: nothing for a new block, or when the write starts at the
+		// beginning of the block and covers every byte the file has in it
+		size_t blk_start = offset - startpoint;
+		size_t valid = file_size > blk_start ? file_size - blk_start : 0;
+		if (valid > BLOCK_SIZE) valid = BLOCK_SIZE;
+
+		if (fresh || (startpoint == 0 && chunk >= valid))
+		{
+			memset(bounce, 0, startpoint);
+			memset(bounce + startpoint + chunk, 0, BLOCK_SIZE - startpoint - chunk);
+		}
+		else
+		{
+			block_read(offset_idx + cur_disk.data_blk_idx, bounce);
+		}
+		iov_copy(&cur, bounce + startpoint, NULL, chunk);
+		block_write(offset_idx + cur_disk.data_blk_idx, bounce);
+
+		written += chunk;
+		offset += chunk;
+		if (written == count) break;
+
+		// move on to the next block, extending the chain if we ran off its end
+		offset_idx = next_data_blk(root_idx, offset_idx, &fresh);
+	}
+
+	blk_put(bounce);
+	// directory entry file size modified
+	if (offset > root_size(root_idx))
+	{
+		root_set_size(root_idx, offset);
+	}
+	write_metadata();
+	return written;
+}
+
+// write to a file as one batch of block writes: its data blocks go out sorted
+// and merged with the FAT and root directory blocks that point to them
+size_t file_writev(int root_idx, size_t offset, const struct iovec *iov, int iovcnt, size_t count,
+	struct chain_hint *hint)
+{
+	block_batch_start();
+	size_t written = file_writev_blocks(root_idx, offset, iov, iovcnt, count, hint);
+	block_batch_end();
+	return written;
+}
+
+// returned by file_readv() when nothing could be read because a block did not
+// match its checksum
+#define READ_FAILED ((size_t)-1)
+
+// read up to count bytes at offset of a file, scattered into iov, return the
+// number of bytes actually read. A block that fails its checksum ends the read
+size_t file_readv(int root_idx, size_t offset, const struct iovec *iov, int iovcnt, size_t count,
+	struct chain_hint *hint)
+{
+	size_t file_size = root_size(root_idx);
+	struct iov_cursor cur;
+	iov_init(&cur, iov, iovcnt);
+
+	// never read past the end of the file
+	if (offset >= file_size) return 0;
+	if (count > file_size - offset) count = file_size - offset;
+
+	// prepare the bounce buffer
+	char *bounce_block = blk_get();
+	size_t bytes_read = 0;
+
+	// a packed file is a slice of its tail block
+	if (file_packed(root_idx))
+	{
+		if (block_read(root_first(root_idx) + cur_disk.data_blk_idx, bounce_block)) goto fail;
+		iov_copy(&cur, NULL, bounce_block + dir_entry(root_idx)->tail_off + offset, count);
+		blk_put(bounce_block);
+		return count;
+	}
+
+	// a compressed file is read through the cache of decompressed blocks
+	if (dir_entry(root_idx)->flags & ROOT_COMPRESSED)
+	{
+		while (bytes_read < count)
+		{
+			size_t starting_point = offset % BLOCK_SIZE;
+			size_t bytes_to_read = BLOCK_SIZE - starting_point;
+			if (bytes_to_read > count - bytes_read) bytes_to_read = count - bytes_read;
+			char *data = cz_block(root_idx, offset / BLOCK_SIZE, hint);
+			if (!data) goto fail;
+			iov_copy(&cur, NULL, data + starting_point, bytes_to_read);
+			bytes_read += bytes_to_read;
+			offset += bytes_to_read;
+		}
+		blk_put(bounce_block);
+		return bytes_read;
+	}
+
+	// a mapped file is read through its block map, runs of blocks that are
+	// consecutive on disk and in the caller's buffer with a single read
+	if (file_mapped(root_idx))
+	{
+		struct dd_map_slot *map = dd_map(root_idx);
+		while (map && bytes_read < count)
+		{
+			uint32_t k = offset / BLOCK_SIZE;
+			size_t starting_point = offset % BLOCK_SIZE;
+			size_t bytes_to_read = BLOCK_SIZE - starting_point;
+			if (bytes_to_read > count - bytes_read) bytes_to_read = count - bytes_read;
+
+			char *dst;
+			size_t contig = iov_contig(&cur, &dst);
+			if (contig > count - bytes_read) contig = count - bytes_read;
+			if (starting_point == 0 && contig >= BLOCK_SIZE)
+			{
+				uint32_t run = 1;
+				while ((size_t)(run + 1) * BLOCK_SIZE <= contig && map->blk[k + run] == map->blk[k] + run) run++;
+				if (block_read_range(map->blk[k] + cur_disk.data_blk_idx, run, dst)) goto fail;
+				iov_advance(&cur, (size_t)run * BLOCK_SIZE);
+				bytes_read += (size_t)run * BLOCK_SIZE;
+				offset += (size_t)run * BLOCK_SIZE;
+				continue;
+			}
+			if (block_read(map->blk[k] + cur_disk.data_blk_idx, bounce_block)) goto fail;
+			iov_copy(&cur, NULL, bounce_block + starting_point, bytes_to_read);
+			bytes_read += bytes_to_read;
+			offset += bytes_to_read;
+		}
+		blk_put(bounce_block);
+		return bytes_read;
+	}
+
+	// prepare the index val used to iterate through a file's data blocks
+	int data_idx = data_blk_index(root_idx, offset, hint);
+
+	while (data_idx != -1 && bytes_read < count)
+	{
+		//First block could be a sliver, and so could the last one
+		size_t starting_point = offset % BLOCK_SIZE;
+		size_t bytes_to_read = BLOCK_SIZE - starting_point;
+		if (bytes_to_read > count - bytes_read) bytes_to_read = count - bytes_read;
+
+		//Runs of full blocks that are consecutive on disk and in the caller's
+		//buffer go straight into it with a single read
+		char *dst;
+		size_t contig = iov_contig(&cur, &dst);
+		if (contig > count - bytes_read) contig = count - bytes_read;
+		if (starting_point == 0 && contig >= BLOCK_SIZE)
+		{
+			int run = 1;
+			while ((size_t)(run + 1) * BLOCK_SIZE <= contig &&
+				fat_next(data_idx + run - 1) == data_idx + run) run++;
+			if (block_read_range(data_idx + cur_disk.data_blk_idx, run, dst)) goto fail;
+			iov_advance(&cur, (size_t)run * BLOCK_SIZE);
+			bytes_read += (size_t)run * BLOCK_SIZE;
+			offset += (size_t)run * BLOCK_SIZE;
+			data_idx = fat_next(data_idx + run - 1);
+			continue;
+		}
+
+		if (block_read(data_idx + cur_disk.data_blk_idx, bounce_block)) goto fail;
+		iov_copy(&cur, NULL, bounce_block + starting_point, bytes_to_read);
+
+		bytes_read += bytes_to_read;
+		offset += bytes_to_read;
+		data_idx = fat_next(data_idx); //skip to next data block
+	}
+	blk_put(bounce_block);
+	return bytes_read;
+
+fail:
+	// a bad block ends the read early, and is an error if it is the first one
+	blk_put(bounce_block);
+	return bytes_read ? bytes_read : READ_FAILED;
+}
+
+// buf contains data, write onto data blocks (depending on where offset is)
+ssize_t fs_write64(int fd, void *buf, size_t count)
+{
+	FS_LOCKED;
+	// error check
+	if (block_disk_count() == -1 || cur_disk.read_only) return -1;
+	if (!fd_valid(fd) || !buf || count > SSIZE_MAX) return -1;
+
+	//If there is no data to write
+	if(count == 0)
+	{
+		return count;
+	}
+
+	struct iovec iov = { .iov_base = buf, .iov_len = count };
+	size_t written = file_writev(fd_root_index(fd), fd_get(fd)->offset, &iov, 1, count, fd_hint(fd));
+	fd_get(fd)->offset += written;
+	return written;
+}
+
+int fs_write(int fd, void *buf, size_t count)
+{
+	FS_LOCKED;
+	return fs_write64(fd, buf, count < IO_MAX ? count : IO_MAX);
+}
+
+// buffer gets data here
+/* Read a certain number of bytes from a file */
+ssize_t fs_read64(int fd, void *buf, size_t count)
+{
+	FS_LOCKED;
+	// error check
+	if (block_disk_count() == -1)
+	{
+		printf("fs_read disk not open \n");
+		return -1;
+	}
+	if (!fd_valid(fd) || !buf) 
+	{
+		printf("fd is not open \n");
+		return -1;
+	}
+	if (count > SSIZE_MAX) return -1;
+
+	struct iovec iov = { .iov_base = buf, .iov_len = count };
+	size_t bytes_read = file_readv(fd_root_index(fd), fd_get(fd)->offset, &iov, 1, count, fd_hint(fd));
+	if (bytes_read == READ_FAILED) return -1;
+	fd_get(fd)->offset += bytes_read;
+	return bytes_read;
+}
+
+int fs_read(int fd, void *buf, size_t count)
+{
+	FS_LOCKED;
+	return fs_read64(fd, buf, count < IO_MAX ? count : IO_MAX);
+}
+
+// same as fs_write()/fs_read() but at an explicit offset, the fd's own offset
+// is left untouched
+ssize_t fs_pwrite64(int fd, void *buf, size_t count, off_t offset)
+{
+	FS_LOCKED;
+	if (block_disk_count() == -1 || cur_disk.read_only) return -1;
+	if (!fd_valid(fd) || !buf || offset < 0 || count > SSIZE_MAX) return -1;
+
+	int root_idx = fd_root_index(fd);
+	if ((size_t)offset > root_size(root_idx)) return -1;
+	if (count == 0) return 0;
+
+	struct iovec iov = { .iov_base = buf, .iov_len = count };
+	return file_writev(root_idx, offset, &iov, 1, count, fd_hint(fd));
+}
+
+int fs_pwrite(int fd, void *buf, size_t count, size_t offset)
+{
+	FS_LOCKED;
+	if (offset > INT64_MAX) return -1;
+	return fs_pwrite64(fd, buf, count < IO_MAX ? count : IO_MAX, offset);
+}
+
+ssize_t fs_pread64(int fd, void *buf, size_t count, off_t offset)
+{
+	FS_LOCKED;
+	if (block_disk_count() == -1) return -1;
+	if (!fd_valid(fd) || !buf || offset < 0 || count > SSIZE_MAX) return -1;
+
+	struct iovec iov = { .iov_base = buf, .iov_len = count };
+	size_t bytes_read = file_readv(fd_root_index(fd), offset, &iov, 1, count, fd_hint(fd));
+	return bytes_read == READ_FAILED ? -1 : (ssize_t)bytes_read;
+}
+
+int fs_pread(int fd, void *buf, size_t count, size_t offset)
+{
+	FS_LOCKED;
+	if (offset > INT64_MAX) return -1;
+	return fs_pread64(fd, buf, count < IO_MAX ? count : IO_MAX, offset);
+}
+
+// gathered/scattered versions, the whole vector is handled by one chain walk
+ssize_t fs_writev64(int fd, const struct iovec *iov, int iovcnt)
+{
+	FS_LOCKED;
+	if (block_disk_count() == -1 || cur_disk.read_only) return -1;
+	if (!fd_valid(fd)) return -1;
+
+	long total = iov_total(iov, iovcnt);
+	if (total < 0) return -1;
+	if (total == 0) return 0;
+
+	size_t written = file_writev(fd_root_index(fd), fd_get(fd)->offset, iov, iovcnt, total, fd_hint(fd));
+	fd_get(fd)->offset += written;
+	return written;
+}
+
+// a vector is not cut short, one too large for an int is refused instead
+int fs_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	FS_LOCKED;
+	if (iov_total(iov, iovcnt) > IO_MAX) return -1;
+	return fs_writev64(fd, iov, iovcnt);
+}
+
+ssize_t fs_readv64(int fd, const struct iovec *iov, int iovcnt)
+{
+	FS_LOCKED;
+	if (block_disk_count() == -1) return -1;
+	if (!fd_valid(fd)) return -1;
+
+	long total = iov_total(iov, iovcnt);
+	if (total < 0) return -1;
+
+	size_t bytes_read = file_readv(fd_root_index(fd), fd_get(fd)->offset, iov, iovcnt, total, fd_hint(fd));
+	if (bytes_read == READ_FAILED) return -1;
+	fd_get(fd)->offset += bytes_read;
+	return bytes_read;
+}
+
+int fs_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	FS_LOCKED;
+	if (iov_total(iov, iovcnt) > IO_MAX) return -1;
+	return fs_readv64(fd, iov, iovcnt);
+}
+
+/* CLONES */
+
+// bytes copied at once by fs_copy_range() when blocks cannot be shared
+#define COPY_CHUNK (16 * BLOCK_SIZE)
+
+// block aligned copy between mapped files: dst maps the blocks of src and
+// takes a reference to each of them. The last, partial block of src is only
+// shared if nothing of dst comes after it. Returns the number of bytes copied
+size_t share_range(int src, size_t src_offset, int dst, size_t dst_offset, size_t count,
+	struct chain_hint *hint)
+{
+	size_t src_size = root_size(src);
+	size_t dst_size = root_size(dst);
+	uint32_t n = count / BLOCK_SIZE;
+	if (count % BLOCK_SIZE && src_offset + count == src_size && dst_offset + count >= dst_size) n++;
+
+	// the entries of src are copied first, loading the map of dst may
+	// evict it from the cache
+	struct dd_map_slot *src_map = dd_map(src);
+	if (!src_map || n == 0) return 0;
+	uint32_t *blocks = malloc(sizeof(uint32_t) * n);
+	memcpy(blocks, &src_map->blk[src_offset / BLOCK_SIZE], sizeof(uint32_t) * n);
+
+	struct map_update mu;
+	size_t copied = 0;
+	if (map_begin(&mu, dst) != 0)
+	{
+		free(blocks);
+		return 0;
+	}
+	// the references dst gives up are only dropped once the map is complete,
+	// so that a map block allocated on the way cannot be one of the blocks
+	// they free
+	struct chain_builder dropped = { NULL, 0, 0 };
+	for (uint32_t k = 0; k < n; k++)
+	{
+		uint32_t j = dst_offset / BLOCK_SIZE + k;
+		if (fat_refs(blocks[k]) >= SHARED_REFS_MAX || map_reserve(&mu, dst, j, 0, hint) != 0) break;
+		int old = j < mu.map->n ? (int)mu.map->blk[j] : -1;
+		fat_set_refs(blocks[k], fat_refs(blocks[k]) + 1);
+		if (old != -1) chain_push(&dropped, old);
+		map_set(&mu, j, blocks[k]);
+		copied += BLOCK_SIZE;
+	}
+	for (int k = 0; k < dropped.n; k++) dd_unref(dropped.blocks[k], &mu.freed);
+	free(dropped.blocks);
+	if (copied > count) copied = count;
+
+	if (dst_offset + copied > dst_size)
+	{
+		root_set_size(dst, dst_offset + copied);
+	}
+	map_commit(&mu, dst, hint);
+	free(blocks);
+	return copied;
+}
+
+int fs_copy_range(int src_fd, size_t src_offset, int dst_fd, size_t dst_offset, size_t count)
+{
+	FS_LOCKED;
+	if (block_disk_count() == -1 || cur_disk.read_only) return -1;
+	if (!fd_valid(src_fd) || !fd_valid(dst_fd)) return -1;
+
+	int src = fd_root_index(src_fd), dst = fd_root_index(dst_fd);
+	size_t src_size = root_size(src);
+	if (src_offset > src_size || dst_offset > root_size(dst)) return -1;
+	if (count > src_size - src_offset) count = src_size - src_offset;
+	if (count > IO_MAX) count = IO_MAX;
+	if (src == dst && src_offset < dst_offset + count && dst_offset < src_offset + count) return -1;
+	if (count == 0) return 0;
+
+	// block aligned ranges share their blocks, once both files are mapped
+	size_t copied = 0;
+	if (src_offset % BLOCK_SIZE == 0 && dst_offset % BLOCK_SIZE == 0 &&
+		(file_mapped(src) || map_file(src) == 0) && (file_mapped(dst) || map_file(dst) == 0))
+		copied = share_range(src, src_offset, dst, dst_offset, count, fd_hint(dst_fd));
+
+	// whatever is left goes through a buffer, without leaving the library
+	char *buf = blk_alloc(COPY_CHUNK / BLOCK_SIZE);
+	while (copied < count)
+	{
+		size_t chunk = count - copied < COPY_CHUNK ? count - copied : COPY_CHUNK;
+		struct iovec iov = { .iov_base = buf, .iov_len = chunk };
+		chunk = file_readv(src, src_offset + copied, &iov, 1, chunk, fd_hint(src_fd));
+		if (chunk == 0 || chunk == READ_FAILED) break;
+		iov.iov_len = chunk;
+		size_t written = file_writev(dst, dst_offset + copied, &iov, 1, chunk, fd_hint(dst_fd));
+		copied += written;
+		if (written < chunk) break;
+	}
+	free(buf);
+	return copied;
+}
+
+int fs_clone(const char *src, const char *dst)
+{
+	FS_LOCKED;
+	if (block_disk_count() == -1 || !src || !dst) return -1;
+	if (dir_lookup(src) == -1)
+	{
+		printf("No file to clone\n");
+		return -1;
+	}
+	if (fs_create(dst) != 0) return -1;
+
+	int src_fd = fs_open(src);
+	int dst_fd = fs_open(dst);
+	int ret = -1;
+	if (src_fd != -1 && dst_fd != -1)
+	{
+		// a copy stops at IO_MAX bytes, larger files take several
+		off_t size = fs_stat64(src_fd), done = 0;
+		int copied = 1;
+		while (done < size && copied > 0)
+		{
+			copied = fs_copy_range(src_fd, done, dst_fd, done, size - done);
+			if (copied > 0) done += copied;
+		}
+		if (done == size) ret = 0;
+	}
+	if (src_fd != -1) fs_close(src_fd);
+	if (dst_fd != -1) fs_close(dst_fd);
+	if (ret != 0) fs_delete(dst);
+	return ret;
+}
+
+/* DEFRAGMENTATION */
+
+// number of blocks moved per sequential read/write during defragmentation
+#define DEFRAG_BATCH 64
+// owner of tail blocks, which are moved out of the way like file blocks
+#define DEFRAG_TAIL -2
+
+// block chain of every file, kept in step with the FAT while blocks move
+struct defrag_state{
+	int **chain; // indexed by directory entry
+	int *length;
+	char *batch;
+};
+
+// file of the volume, with the block it currently starts at
+struct defrag_order{
+	int first;
+	int root_idx;
+};
+
+int defrag_order_cmp(const void *a, const void *b)
+{
+	const struct defrag_order *x = a, *y = b;
+	return (x->first > y->first) - (x->first < y->first);
+}
+
+// 1 if the chain occupies consecutive blocks starting at start
+int chain_is_at(const int *chain, int length, int start)
+{
+	for (int k = 0; k < length; k++)
+	{
+		if (chain[k] != start + k) return 0;
+	}
+	return 1;
+}
+
+// copy block src[k] to dst[k] for every k, reading and writing runs of
+// consecutive blocks with single I/O operations. Returns 0, or -1 if a read
+// or write failed: the destinations must then not be used
+int copy_blocks(struct defrag_state *st, const int *src, const int *dst, int n)
+{
+	int k = 0;
+	while (k < n)
+	{
+		// extend the batch while destinations stay consecutive
+		int len = 1;
+		while (k + len < n && len < DEFRAG_BATCH && dst[k + len] == dst[k] + len) len++;
+
+		// sources are read in their own consecutive runs
+		int r = 0;
+		while (r < len)
+		{
+			int run = 1;
+			while (r + run < len && src[k + r + run] == src[k + r] + run) run++;
+			if (block_read_range(src[k + r] + cur_disk.data_blk_idx, run, st->batch + r * BLOCK_SIZE) != 0)
+				return -1;
+			r += run;
+		}
+		if (block_write_range(dst[k] + cur_disk.data_blk_idx, len, st->batch) != 0) return -1;
+		k += len;
+	}
+	// the copies reach the disk before the FAT that points to them, the
+	// write-back cache would write the FAT first
+	return block_flush() == 0 ? 0 : -1;
+}
+
+// relink block number pos of file root_idx to new_idx in the in-memory FAT,
+// the data must already have been copied
+void move_chain_block(struct defrag_state *st, int root_idx, int pos, int new_idx)
+{
+	int old_idx = st->chain[root_idx][pos];
+
+	fat_set(new_idx, fat_next(old_idx));
+	fat_set(old_idx, 0);
+	if (pos == 0) root_set_first(root_idx, new_idx);
+	else fat_set(st->chain[root_idx][pos - 1], new_idx);
+	st->chain[root_idx][pos] = new_idx;
+}
+
+// move a tail block, and every packed file stored in it. Returns 0, or -1 if
+// the block could not be copied and stays where it is
+int move_tail_block(struct defrag_state *st, int old_idx, int new_idx)
+{
+	if (copy_blocks(st, &old_idx, &new_idx, 1) != 0) return -1;
+	fat_set(new_idx, -1);
+	fat_set(old_idx, 0);
+	for (int i = 0; i < cur_disk.dir_entries; i++)
+	{
+		if (dir_entry(i)->filename[0] != '\0' && file_packed(i) && root_first(i) == old_idx)
+			root_set_first(i, new_idx);
+	}
+	if (tail_blk == old_idx) tail_blk = new_idx;
+	write_metadata();
+	return 0;
+}
+
+// move every block of a file to the given destinations: the data is copied
+// first and the FAT/root switch to the new locations in one metadata write.
+// Returns 0, or -1 if the copy failed and the file was left where it was
+int move_file_blocks(struct defrag_state *st, int root_idx, const int *pos, const int *dst, int n)
+{
+	if (n <= 0) return 0;
+	int *src = calloc(n, sizeof(int));
+	for (int k = 0; k < n; k++) src[k] = st->chain[root_idx][pos[k]];
+	int ret = copy_blocks(st, src, dst, n);
+	for (int k = 0; k < n && ret == 0; k++) move_chain_block(st, root_idx, pos[k], dst[k]);
+	free(src);
+	return ret;
+}
+
+// first-fit search for a run of length free blocks, -1 if there is none
+int find_free_extent(int length)
+{
+	int run = 0;
+	for (uint32_t i = 1; i < cur_disk.total_data_blks; i++)
+	{
+		if (fat_is_free(i))
+		{
+			if (++run == length) return i - length + 1;
+		}
+		else run = 0;
+	}
+	return -1;
+}
+
+// make one file contiguous by moving it to the first free extent that fits
+int defrag_file(struct defrag_state *st, int root_idx)
+{
+	int n = st->length[root_idx];
+	if (n == 0 || chain_is_at(st->chain[root_idx], n, st->chain[root_idx][0])) return 0;
+
+	int start = find_free_extent(n);
+	if (start == -1) return -1;
+
+	int *pos = malloc(sizeof(int) * n);
+	int *dst = malloc(sizeof(int) * n);
+	for (int k = 0; k < n; k++)
+	{
+		pos[k] = k;
+		dst[k] = start + k;
+	}
+	int ret = move_file_blocks(st, root_idx, pos, dst, n);
+	if (ret == 0) write_metadata();
+	free(pos);
+	free(dst);
+	return ret;
+}
+
+// compact the whole volume: files are laid out back to back from the first
+// data block in the order they currently appear on disk, which leaves all the
+// free space in a single extent at the end
+int defrag_volume(struct defrag_state *st)
+{
+	struct defrag_order *files_by_pos = malloc(sizeof(struct defrag_order) * cur_disk.dir_entries);
+	int *order = malloc(sizeof(int) * cur_disk.dir_entries);
+	int files = 0;
+	int cursor = 1;
+
+	// process files by current position so most blocks only move downwards
+	for (int i = 0; i < cur_disk.dir_entries; i++)
+	{
+		if (st->length[i] > 0)
+		{
+			files_by_pos[files].first = st->chain[i][0];
+			files_by_pos[files++].root_idx = i;
+		}
+	}
+	qsort(files_by_pos, files, sizeof(struct defrag_order), defrag_order_cmp);
+	for (int f = 0; f < files; f++) order[f] = files_by_pos[f].root_idx;
+	free(files_by_pos);
+
+	// which file and chain position each block holds, for evictions
+	int *owner = malloc(sizeof(int) * cur_disk.total_data_blks);
+	int *owner_pos = malloc(sizeof(int) * cur_disk.total_data_blks);
+	int *pos = malloc(sizeof(int) * cur_disk.total_data_blks);
+	int *dst = malloc(sizeof(int) * cur_disk.total_data_blks);
+	for (uint32_t i = 0; i < cur_disk.total_data_blks; i++) owner[i] = -1;
+	for (int i = 0; i < cur_disk.dir_entries; i++)
+	{
+		if (dir_entry(i)->filename[0] != '\0' && file_packed(i)) owner[root_first(i)] = DEFRAG_TAIL;
+	}
+	for (int f = 0; f < files; f++)
+	{
+		for (int k = 0; k < st->length[order[f]]; k++)
+		{
+			owner[st->chain[order[f]][k]] = order[f];
+			owner_pos[st->chain[order[f]][k]] = k;
+		}
+	}
+
+	int ret = 0;
+	int evict_hint = cur_disk.total_data_blks - 1;
+	for (int f = 0; f < files && ret == 0; f++)
+	{
+		int r = order[f];
+		int n = st->length[r];
+		if (chain_is_at(st->chain[r], n, cursor))
+		{
+			cursor += n;
+			continue;
+		}
+
+		// blocks of no chain (shared blocks of mapped files, orphans) stay
+		// where they are: the file goes past the last one in its way
+		for (int t = cursor; t < cursor + n && t < (int)cur_disk.total_data_blks; t++)
+		{
+			if (!fat_is_free(t) && owner[t] == -1) cursor = t + 1;
+		}
+		if (cursor + n > (int)cur_disk.total_data_blks)
+		{
+			ret = -1;
+			break;
+		}
+
+		// 1) evict every block sitting in the target window that does not
+		// already hold the right piece of this file, towards the end of the disk
+		int moves = 0;
+		for (int t = cursor; t < cursor + n; t++)
+		{
+			if (fat_is_free(t)) continue;
+			if (owner[t] == r && owner_pos[t] == t - cursor) continue;
+			if (owner[t] == -1) continue; // orphan block, left alone
+
+			while (evict_hint >= cursor + n && !fat_is_free(evict_hint)) evict_hint--;
+			if (evict_hint < cursor + n)
+			{
+				ret = -1;
+				break;
+			}
+			int g = owner[t], k = owner_pos[t];
+			if (g == DEFRAG_TAIL ? move_tail_block(st, t, evict_hint) != 0 :
+				move_file_blocks(st, g, &k, &evict_hint, 1) != 0)
+			{
+				ret = -1;
+				break;
+			}
+			owner[evict_hint] = g;
+			owner_pos[evict_hint] = k;
+			owner[t] = -1;
+			moves++;
+		}
+		if (moves) write_metadata();
+		if (ret == -1) break;
+
+		// 2) move the rest of the file into the now free window
+		moves = 0;
+		for (int k = 0; k < n; k++)
+		{
+			if (st->chain[r][k] == cursor + k) continue;
+			if (!fat_is_free(cursor + k))
+			{
+				// an orphan is in the way, the file cannot be placed here
+				ret = -1;
+				break;
+			}
+			pos[moves] = k;
+			dst[moves] = cursor + k;
+			moves++;
+		}
+		if (ret == -1) break;
+		for (int m = 0; m < moves; m++) owner[st->chain[r][pos[m]]] = -1;
+		if (move_file_blocks(st, r, pos, dst, moves) != 0)
+		{
+			ret = -1;
+			break;
+		}
+		for (int m = 0; m < moves; m++)
+		{
+			owner[dst[m]] = r;
+			owner_pos[dst[m]] = pos[m];
+		}
+		write_metadata();
+		cursor += n;
+	}
+
+	// 3) tail blocks go right after the files; every block below the one
+	// being moved is a file block, a tail block already moved, or free
+	for (int b = cursor; ret == 0 && b < (int)cur_disk.total_data_blks; b++)
+	{
+		if (owner[b] != DEFRAG_TAIL) continue;
+		while (cursor < b && !fat_is_free(cursor)) cursor++;
+		if (cursor < b && move_tail_block(st, b, cursor) != 0) ret = -1;
+		cursor++;
+	}
+
+	free(owner);
+	free(order);
+	free(owner_pos);
+	free(pos);
+	free(dst);
+	return ret;
+}
+
+int fs_defrag(const char *filename)
+{
+	FS_LOCKED;
+	if (block_disk_count() == -1 || cur_disk.read_only) return -1;
+	// moving blocks would not free the ones the snapshots hold on to
+	if (cur_disk.frozen)
+	{
+		printf("Cannot defragment a volume with snapshots\n");
+		return -1;
+	}
+
+	int root_idx = -1;
+	if (filename)
+	{
+		root_idx = dir_lookup(filename);
+		if (root_idx == -1)
+		{
+			printf("No file to defragment\n");
+			return -1;
+		}
+	}
+
+	struct defrag_state st;
+	st.batch = blk_alloc(DEFRAG_BATCH);
+	st.chain = calloc(cur_disk.dir_entries, sizeof(int *));
+	st.length = calloc(cur_disk.dir_entries, sizeof(int));
+	for (int i = 0; i < cur_disk.dir_entries; i++)
+	{
+		if (dir_entry(i)->filename[0] != '\0') st.chain[i] = chain_to_array(i, &st.length[i]);
+	}
+
+	int ret;
+	if (root_idx != -1) ret = defrag_file(&st, root_idx);
+	else ret = defrag_volume(&st);
+
+	for (int i = 0; i < cur_disk.dir_entries; i++) free(st.chain[i]);
+	free(st.chain);
+	free(st.length);
+	free(st.batch);
+	// open files may have had blocks moved under their cached positions
+	reset_chain_hints();
+	return ret;
+}
+
+/* MEMORY MAPPING */
+
+// data block index of block k of a file, if blocks k to k + n - 1 follow each
+// other on disk; -1 if they do not, or if the file stores its contents in
+// another form (packed, compressed)
+int file_extent(int root_idx, uint32_t k, uint32_t n, struct chain_hint *hint)
+{
+	if (file_packed(root_idx) || (dir_entry(root_idx)->flags & ROOT_COMPRESSED)) return -1;
+	if (file_mapped(root_idx))
+	{
+		struct dd_map_slot *map = dd_map(root_idx);
+		if (!map || k + n > map->n) return -1;
+		for (uint32_t j = 1; j < n; j++)
+		{
+			if (map->blk[k + j] != map->blk[k] + j) return -1;
+		}
+		return map->blk[k];
+	}
+
+	int first = data_blk_index(root_idx, (size_t)k * BLOCK_SIZE, hint), idx = first;
+	for (uint32_t j = 1; idx != -1 && j < n; j++)
+	{
+		idx = fat_next(idx);
+		if (idx != first + (int)j) return -1;
+	}
+	return idx == -1 ? -1 : first;
+}
+
+void *fs_mmap(int fd, off_t offset, size_t len)
+{
+	FS_LOCKED;
+	if (block_disk_count() == -1 || !fd_valid(fd)) return NULL;
+	int root_idx = fd_root_index(fd);
+	size_t size = root_size(root_idx);
+	if (offset < 0 || len == 0 || (size_t)offset > size || len > size - offset) return NULL;
+
+	uint32_t k = offset / BLOCK_SIZE;
+	uint32_t n = ((size_t)offset + len - 1) / BLOCK_SIZE - k + 1;
+	size_t skip = offset % BLOCK_SIZE;
+
+	// a file in pieces is defragmented first, when the volume allows it
+	int start = file_extent(root_idx, k, n, fd_hint(fd));
+	if (start == -1 && !cur_disk.read_only && !cur_disk.frozen && !file_mapped(root_idx) &&
+		!file_packed(root_idx) && !(dir_entry(root_idx)->flags & ROOT_COMPRESSED) &&
+		fs_defrag(dir_entry(root_idx)->filename) == 0)
+		start = file_extent(root_idx, k, n, fd_hint(fd));
+
+	// contiguous blocks are the image itself
+	char *addr = start == -1 ? NULL : block_map(start + cur_disk.data_blk_idx, n);
+	if (addr) return addr + skip;
+
+	// anything else is read into private memory, through the block cache
+	addr = mmap(NULL, (size_t)n * BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED) return NULL;
+	size_t want = skip + len;
+	struct iovec iov = { .iov_base = addr, .iov_len = want };
+	if (file_readv(root_idx, (size_t)k * BLOCK_SIZE, &iov, 1, want, fd_hint(fd)) != want ||
+		mprotect(addr, (size_t)n * BLOCK_SIZE, PROT_READ))
+	{
+		munmap(addr, (size_t)n * BLOCK_SIZE);
+		return NULL;
+	}
+	return addr + skip;
+}
+
+int fs_munmap(void *addr, size_t len)
+{
+	if (!addr || len == 0) return -1;
+	// mappings start on a block boundary, at the block holding the offset
+	size_t skip = (uintptr_t)addr % BLOCK_SIZE;
+	return munmap((char *)addr - skip, skip + len) ? -1 : 0;
 }
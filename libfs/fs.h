@@ -2,15 +2,22 @@
 #define _FS_H
 
 #include <stddef.h> /* for size_t definition */
+#include <sys/types.h> /* for off_t and ssize_t definitions */
+#include <sys/uio.h> /* for struct iovec definition */
 
 /** Maximum filename length (including the NULL character) */
 #define FS_FILENAME_LEN 16
 
-/** Maximum number of files in the root directory */
+/** Maximum number of files in a root directory of a single block */
 #define FS_FILE_MAX_COUNT 128
 
-/** Maximum number of open files */
-#define FS_OPEN_MAX_COUNT 32
+/**
+ * Maximum number of open files. The table of descriptors grows by chunks as
+ * files are opened, so the limit costs nothing until it is reached; it is the
+ * number of slots that the low 16 bits of a descriptor can name, the others
+ * telling the successive users of a slot apart.
+ */
+#define FS_OPEN_MAX_COUNT 65536
 
 /**
  * fs_mount - Mount a file system
@@ -20,6 +27,15 @@
  * contains. A file system needs to be mounted before files can be read from it
  * with fs_read() or written to it with fs_write().
  *
+ * The functions of this interface can be called from several threads: each
+ * call holds a lock of the file system until it returns, so calls run one at a
+ * time and never see the metadata half updated.
+ *
+ * Blocks written to a mounted file system are kept in a write-back cache, and
+ * reach the disk in the background within a few seconds, when the cache fills
+ * up, or at the latest when the file system is unmounted or synced with
+ * fs_sync() or fs_fsync().
+ *
  * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
  * file system can be located. 0 otherwise.
  */
@@ -36,6 +52,18 @@ int fs_mount(const char *diskname);
  */
 int fs_umount(void);
 
+/**
+ * fs_sync - Make the file system durable
+ *
+ * Write every block of the mounted file system held in the write-back cache,
+ * and flush the virtual disk file to the host storage, so that the files as
+ * they are now survive a crash.
+ *
+ * Return: -1 if no FS is currently mounted, or if a block could not be
+ * written. 0 otherwise.
+ */
+int fs_sync(void);
+
 /**
  * fs_info - Display information about file system
  *
@@ -56,7 +84,7 @@ int fs_info(void);
  *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if a
  * file named @filename already exists, or if string @filename is too long, or
- * if the root directory already contains %FS_FILE_MAX_COUNT files. 0 otherwise.
+ * if the root directory is full. 0 otherwise.
  */
 int fs_create(const char *filename);
 
@@ -92,7 +120,9 @@ int fs_ls(void);
  * of the file descriptor is set to 0 initially (beginning of the file). If the
  * same file is opened multiple files, fs_open() must return distinct file
  * descriptors. A maximum of %FS_OPEN_MAX_COUNT files can be open
- * simultaneously.
+ * simultaneously; the table of descriptors grows as needed. A descriptor that
+ * was closed stays invalid, even once fs_open() reuses its place in the table.
+ * The descriptors open on the same file share what they know of its blocks.
  *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
  * there is no file named @filename to open, or if there are already
@@ -112,6 +142,20 @@ int fs_open(const char *filename);
  */
 int fs_close(int fd);
 
+/**
+ * fs_fsync - Make a file durable
+ * @fd: File descriptor
+ *
+ * Make the contents of the file referenced by file descriptor @fd, and the
+ * metadata needed to find them, survive a crash. The rest of the file system is
+ * synced along with it, as with fs_sync().
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if a block could not be
+ * written. 0 otherwise.
+ */
+int fs_fsync(int fd);
+
 /**
  * fs_stat - Get file status
  * @fd: File descriptor
@@ -119,8 +163,8 @@ int fs_close(int fd);
  * Get the current size of the file pointed by file descriptor @fd.
  *
  * Return: -1 if no FS is currently mounted, of if file descriptor @fd is
- * invalid (out of bounds or not currently open). Otherwise return the current
- * size of file.
+ * invalid (out of bounds or not currently open), or if the size does not fit
+ * in an int (see fs_stat64()). Otherwise return the current size of file.
  */
 int fs_stat(int fd);
 
@@ -174,12 +218,327 @@ int fs_write(int fd, void *buf, size_t count);
  * The number of bytes read can be smaller than @count if there are less than
  * @count bytes until the end of the file (it can even be 0 if the file offset
  * is at the end of the file). The file offset of the file descriptor is
- * implicitly incremented by the number of bytes that were actually read.
+ * implicitly incremented by the number of bytes that were actually read. On a
+ * volume with block checksums (see block_verify()), the read ends early at a
+ * block that does not match its checksum.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @buf is NULL, or if
+ * nothing could be read before a block that does not match its checksum.
+ * Otherwise return the number of bytes actually read.
+ */
+int fs_read(int fd, void *buf, size_t count);
+
+/**
+ * fs_pwrite - Write to a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ * @offset: File offset to write at
+ *
+ * Same as fs_write(), but write at @offset instead of the file offset of @fd,
+ * which is not modified. Each call holds the lock of the file system, which
+ * keeps the FAT and the directory consistent, so several threads can share a
+ * file descriptor without serializing fs_lseek() and fs_write() pairs.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @buf is NULL, or if
+ * @offset is larger than the current file size. Otherwise return the number of
+ * bytes actually written.
+ */
+int fs_pwrite(int fd, void *buf, size_t count, size_t offset);
+
+/**
+ * fs_pread - Read from a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @offset: File offset to read from
+ *
+ * Same as fs_read(), but read from @offset instead of the file offset of @fd,
+ * which is not modified.
  *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
  * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
  * return the number of bytes actually read.
  */
-int fs_read(int fd, void *buf, size_t count);
+int fs_pread(int fd, void *buf, size_t count, size_t offset);
+
+/**
+ * fs_writev - Write to a file from several buffers
+ * @fd: File descriptor
+ * @iov: Array of buffers to write in the file, in order
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Same as fs_write() for the concatenation of the @iovcnt buffers described by
+ * @iov, e.g. a record header followed by its payload. The whole vector is
+ * written with a single walk of the file's block chain, and whole blocks that
+ * are contiguous both in a buffer and on disk are written with one I/O.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @iov is invalid.
+ * Otherwise return the number of bytes actually written.
+ */
+int fs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_readv - Read from a file into several buffers
+ * @fd: File descriptor
+ * @iov: Array of buffers to be filled with data, in order
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Same as fs_read(), with the data scattered over the @iovcnt buffers
+ * described by @iov.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @iov is invalid.
+ * Otherwise return the number of bytes actually read.
+ */
+int fs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/*
+ * 64-bit variants
+ *
+ * Files of 32-bit FAT volumes can grow beyond 2 GiB. The calls above return an
+ * int, so they transfer at most 0x7ffff000 bytes at once, like Linux does, and
+ * fs_readv() and fs_writev() refuse larger vectors. The variants below take
+ * and return 64-bit offsets and counts instead, and transfer everything they
+ * are asked to in a single call. They otherwise behave as the calls they are
+ * named after, and fail as well when @offset is negative.
+ */
+
+/**
+ * fs_stat64 - Get file status
+ * @fd: File descriptor
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid. Otherwise return the current size of file.
+ */
+off_t fs_stat64(int fd);
+
+/**
+ * fs_lseek64 - Set file offset
+ * @fd: File descriptor
+ * @offset: File offset
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid, or if @offset is negative or larger than the current file size. 0
+ * otherwise.
+ */
+int fs_lseek64(int fd, off_t offset);
+
+/**
+ * fs_write64 - Write to a file
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ *
+ * Return: -1 on the same errors as fs_write(). Otherwise return the number of
+ * bytes actually written.
+ */
+ssize_t fs_write64(int fd, void *buf, size_t count);
+
+/**
+ * fs_read64 - Read from a file
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ *
+ * Return: -1 on the same errors as fs_read(). Otherwise return the number of
+ * bytes actually read.
+ */
+ssize_t fs_read64(int fd, void *buf, size_t count);
+
+/**
+ * fs_pwrite64 - Write to a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ * @offset: File offset to write at
+ *
+ * Return: -1 on the same errors as fs_pwrite(). Otherwise return the number of
+ * bytes actually written.
+ */
+ssize_t fs_pwrite64(int fd, void *buf, size_t count, off_t offset);
+
+/**
+ * fs_pread64 - Read from a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @offset: File offset to read from
+ *
+ * Return: -1 on the same errors as fs_pread(). Otherwise return the number of
+ * bytes actually read.
+ */
+ssize_t fs_pread64(int fd, void *buf, size_t count, off_t offset);
+
+/**
+ * fs_writev64 - Write to a file from several buffers
+ * @fd: File descriptor
+ * @iov: Array of buffers to write in the file, in order
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Return: -1 on the same errors as fs_writev(). Otherwise return the number of
+ * bytes actually written.
+ */
+ssize_t fs_writev64(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_readv64 - Read from a file into several buffers
+ * @fd: File descriptor
+ * @iov: Array of buffers to be filled with data, in order
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Return: -1 on the same errors as fs_readv(). Otherwise return the number of
+ * bytes actually read.
+ */
+ssize_t fs_readv64(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_copy_range - Copy part of a file into another one
+ * @src_fd: File descriptor of the file to copy from
+ * @src_offset: Offset of the data to copy in the source file
+ * @dst_fd: File descriptor of the file to copy to
+ * @dst_offset: Offset to copy the data at in the destination file
+ * @count: Number of bytes to copy
+ *
+ * Copy @count bytes at @src_offset of the file referenced by @src_fd to
+ * @dst_offset of the file referenced by @dst_fd, as fs_pread() and fs_pwrite()
+ * would, but without going through a user buffer. Neither file offset is
+ * modified.
+ *
+ * On 32-bit FAT volumes, when both offsets are multiples of %BLOCK_SIZE, the
+ * destination shares the data blocks of the source instead of getting a copy
+ * of them: the copy only costs metadata, and a block is only duplicated when
+ * one of the files is later written to (copy-on-write).
+ *
+ * Return: -1 if no FS is currently mounted, or if a file descriptor is invalid,
+ * or if an offset is larger than the size of its file, or if the two ranges
+ * overlap in the same file. Otherwise return the number of bytes actually
+ * copied, which is smaller than @count if the source file ends first or the
+ * disk runs out of space, and at most 0x7ffff000.
+ */
+int fs_copy_range(int src_fd, size_t src_offset, int dst_fd, size_t dst_offset, size_t count);
+
+/**
+ * fs_clone - Copy a file
+ * @src: File name of the file to copy
+ * @dst: File name of the new file
+ *
+ * Create a new file named @dst with the contents of file @src, with
+ * fs_copy_range(): on 32-bit FAT volumes, both files share their data blocks
+ * until they are written to.
+ *
+ * Return: -1 if no FS is currently mounted, or if there is no file named @src,
+ * or if @dst cannot be created, or if the disk runs out of space. 0 otherwise.
+ */
+int fs_clone(const char *src, const char *dst);
+
+/**
+ * fs_snapshot - Take a snapshot of the file system
+ * @name: Name of the snapshot
+ *
+ * Freeze the current state of the mounted file system as a read-only snapshot
+ * called @name, which can later be mounted with fs_mount_snapshot(). Only a
+ * copy of the FAT and of the root directory is written, whatever the amount
+ * of data: from then on, the data blocks the snapshot uses are never written
+ * or reused, and a file block that changes is written to a newly allocated
+ * block instead (copy-on-write). Up to 8 snapshots can be kept at a time.
+ *
+ * Return: -1 if no FS is currently mounted, or if it is not a 32-bit FAT
+ * volume, or if @name is invalid or already used by another snapshot, or if
+ * there are already 8 snapshots, or if the disk runs out of space. 0
+ * otherwise.
+ */
+int fs_snapshot(const char *name);
+
+/**
+ * fs_snapshot_delete - Delete a snapshot
+ * @name: Name of the snapshot
+ *
+ * Delete snapshot @name of the mounted file system, and free the data blocks
+ * that only it still used.
+ *
+ * Return: -1 if no FS is currently mounted, or if there is no snapshot named
+ * @name. 0 otherwise.
+ */
+int fs_snapshot_delete(const char *name);
+
+/**
+ * fs_mount_snapshot - Mount a snapshot of a file system
+ * @diskname: Name of the virtual disk file
+ * @name: Name of the snapshot
+ *
+ * Mount snapshot @name of the file system on virtual disk file @diskname, as
+ * fs_mount() would mount the file system itself. The files are the ones the
+ * file system had when the snapshot was taken, and cannot be changed: the
+ * functions that would create, delete or write files all fail.
+ *
+ * Return: -1 if the file system cannot be mounted, or if it has no snapshot
+ * named @name. 0 otherwise.
+ */
+int fs_mount_snapshot(const char *diskname, const char *name);
+
+/**
+ * fs_defrag - Defragment file system
+ * @filename: File name, or NULL for the whole volume
+ *
+ * Relocate data blocks so that file chains become physically contiguous. If
+ * @filename is given, only that file is moved, to the first free extent large
+ * enough to hold it. Otherwise, the volume is compacted: all files are laid
+ * out back to back from the first data block, which coalesces the free space
+ * into a single extent at the end of the disk.
+ *
+ * Blocks are copied with large sequential I/Os, and reach the disk before the
+ * FAT and the root directory are switched to the new locations: a block that
+ * cannot be read or written leaves its file where it was. The switch itself
+ * spans several blocks and is not atomic, an interruption while it is written
+ * can leave chains that fs_check reports as broken.
+ *
+ * Return: -1 if no FS is currently mounted, or if there is no file named
+ * @filename, or if there is not enough free space to move the blocks, or if
+ * the file system has snapshots, or if a block could not be moved. 0
+ * otherwise.
+ */
+int fs_defrag(const char *filename);
+
+/**
+ * fs_mmap - Map part of a file in memory
+ * @fd: File descriptor
+ * @offset: Offset of the part to map in the file
+ * @len: Number of bytes to map
+ *
+ * Make @len bytes at @offset of the file referenced by @fd readable with plain
+ * pointer accesses. When the data blocks holding them follow each other on
+ * disk, the range of the image file that holds them is mapped read-only,
+ * without copying anything; a file in pieces is defragmented first, as
+ * fs_defrag() would, unless the volume has snapshots. Otherwise, for instance
+ * for packed, compressed or in-memory files, the bytes are read into private
+ * memory.
+ *
+ * A mapping of the image shows later writes to the file once they reach the
+ * disk, and what the blocks hold after the file is deleted or its blocks move;
+ * a private mapping keeps the contents the file had. Either way, the mapping
+ * stays valid until fs_munmap(), even once the file is closed or the file
+ * system unmounted. Blocks read through a mapping of the image are not checked
+ * against their checksums.
+ *
+ * Return: NULL if no FS is currently mounted, or if file descriptor @fd is
+ * invalid, or if @len is 0, or if the range does not lie within the file, or if
+ * it cannot be mapped or read. Otherwise the address of byte @offset of the
+ * file.
+ */
+void *fs_mmap(int fd, off_t offset, size_t len);
+
+/**
+ * fs_munmap - Release a mapping of a file
+ * @addr: Address returned by fs_mmap()
+ * @len: Number of bytes mapped, as given to fs_mmap()
+ *
+ * Return: -1 if @addr is NULL, if @len is 0 or if the mapping cannot be
+ * released. 0 otherwise.
+ */
+int fs_munmap(void *addr, size_t len);
 
 #endif /* _FS_H */
@@ -0,0 +1,165 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+/* Matches are at least 4 bytes long, the last 5 bytes are always literals and
+ * the last match starts at least 12 bytes before the end (LZ4 block format) */
+#define MIN_MATCH 4
+#define LAST_LITERALS 5
+#define MF_LIMIT 12
+#define MAX_OFFSET 65535
+
+/* Positions of recently seen 4-byte sequences, by hash */
+#define HASH_BITS 12
+
+static uint32_t read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t hash4(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/* Write a length that does not fit in its token nibble as 255-valued bytes
+ * followed by the remainder, return the new output position or NULL */
+static uint8_t *put_length(uint8_t *op, const uint8_t *oend, size_t n)
+{
+	while (n >= 255) {
+		if (op >= oend)
+			return NULL;
+		*op++ = 255;
+		n -= 255;
+	}
+	if (op >= oend)
+		return NULL;
+	*op++ = n;
+	return op;
+}
+
+/* Emit one sequence: literals, then a match (mlen == 0 for the last one) */
+static uint8_t *put_sequence(uint8_t *op, const uint8_t *oend,
+			     const uint8_t *lit, size_t nlit,
+			     size_t offset, size_t mlen)
+{
+	uint8_t *token = op++;
+
+	if (token >= oend)
+		return NULL;
+	*token = (nlit < 15 ? nlit : 15) << 4;
+	if (nlit >= 15 && !(op = put_length(op, oend, nlit - 15)))
+		return NULL;
+	if (op + nlit > oend)
+		return NULL;
+	memcpy(op, lit, nlit);
+	op += nlit;
+	if (!mlen)
+		return op;
+
+	if (op + 2 > oend)
+		return NULL;
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+	mlen -= MIN_MATCH;
+	*token |= mlen < 15 ? mlen : 15;
+	if (mlen >= 15 && !(op = put_length(op, oend, mlen - 15)))
+		return NULL;
+	return op;
+}
+
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap)
+{
+	const uint8_t *in = src, *anchor = src;
+	uint8_t *op = dst, *oend = op + cap;
+	uint16_t table[1 << HASH_BITS];
+	size_t ip = 0;
+
+	if (len > MAX_OFFSET)
+		return 0;
+	memset(table, 0, sizeof(table));
+
+	while (len >= MF_LIMIT && ip + MF_LIMIT < len) {
+		uint32_t seq = read32(in + ip);
+		uint32_t h = hash4(seq);
+		size_t ref = table[h];
+		size_t mlen;
+
+		table[h] = ip;
+		if (ref >= ip || read32(in + ref) != seq) {
+			ip++;
+			continue;
+		}
+
+		mlen = MIN_MATCH;
+		while (ip + mlen < len - LAST_LITERALS && in[ref + mlen] == in[ip + mlen])
+			mlen++;
+		op = put_sequence(op, oend, anchor, in + ip - anchor, ip - ref, mlen);
+		if (!op)
+			return 0;
+		ip += mlen;
+		anchor = in + ip;
+	}
+
+	op = put_sequence(op, oend, anchor, in + len - anchor, 0, 0);
+	return op ? (size_t)(op - (uint8_t *)dst) : 0;
+}
+
+/* Read a length continued over 255-valued bytes, -1 if the input ends */
+static long get_length(const uint8_t **ip, const uint8_t *iend, long n)
+{
+	uint8_t b;
+
+	do {
+		if (*ip >= iend)
+			return -1;
+		b = *(*ip)++;
+		n += b;
+	} while (b == 255);
+	return n;
+}
+
+int lz_decompress(const void *src, size_t len, void *dst, size_t cap)
+{
+	const uint8_t *ip = src, *iend = ip + len;
+	uint8_t *op = dst, *oend = op + cap;
+
+	while (ip < iend) {
+		uint8_t token = *ip++;
+		long nlit = token >> 4, mlen = token & 15;
+		size_t offset;
+
+		if (nlit == 15 && (nlit = get_length(&ip, iend, nlit)) < 0)
+			return -1;
+		if (nlit > iend - ip || nlit > oend - op)
+			return -1;
+		memcpy(op, ip, nlit);
+		ip += nlit;
+		op += nlit;
+
+		/* The last sequence has no match */
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		if (offset == 0 || offset > (size_t)(op - (uint8_t *)dst))
+			return -1;
+		if (mlen == 15 && (mlen = get_length(&ip, iend, mlen)) < 0)
+			return -1;
+		mlen += MIN_MATCH;
+		if (mlen > oend - op)
+			return -1;
+
+		/* Byte by byte: the match may overlap the bytes it produces */
+		for (long k = 0; k < mlen; k++, op++)
+			*op = *(op - offset);
+	}
+	return op - (uint8_t *)dst;
+}
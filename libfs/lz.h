@@ -0,0 +1,36 @@
+#ifndef _LZ_H
+#define _LZ_H
+
+#include <stddef.h>
+
+/**
+ * lz_compress - Compress a buffer
+ * @src: Data to compress
+ * @len: Size of @src, at most 65535 bytes
+ * @dst: Buffer receiving the compressed data
+ * @cap: Size of @dst
+ *
+ * Compress @len bytes from @src into @dst, in the LZ4 block format (byte
+ * oriented LZ77 without entropy coding, built for decompression speed).
+ *
+ * Return: the size of the compressed data, or 0 if it does not fit in @cap
+ * bytes.
+ */
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap);
+
+/**
+ * lz_decompress - Decompress a buffer
+ * @src: Compressed data
+ * @len: Size of @src
+ * @dst: Buffer receiving the decompressed data
+ * @cap: Size of @dst
+ *
+ * Decompress @len bytes of LZ4 block format data from @src into @dst. Corrupted
+ * data cannot make the decoder read or write out of the given buffers.
+ *
+ * Return: -1 if @src is not valid compressed data or decompresses to more than
+ * @cap bytes. The size of the decompressed data otherwise.
+ */
+int lz_decompress(const void *src, size_t len, void *dst, size_t cap);
+
+#endif /* _LZ_H */